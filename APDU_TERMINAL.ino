@@ -36,16 +36,139 @@
 #define PN532_SS   (4)
 #define PN532_MISO (5)
 
-#define UID_LENGTH  7
+#define UID_LENGTH  7 // MYTERM_CARDFOUND data without MYTERM_CONFIG_TARGETINFO
+#define UID_MAX_LEN 10 // triple size UIDs
+#define ATS_MAX_LEN 20 // ATS bytes kept, after its length byte
+#define MAX_TARGETS 2 // cards listed at once, with MYTERM_CONFIG_DUAL
+#define SAK_ISODEP 0x20 // ISO/IEC 14443-4 compliant
 #define TIMEOUT     1000 // ms
 #define READ_BUFFER_LEN 255 // max 255
+#define LONG_READ_LEN 512 // max frame data with MYTERM_CONFIG_LONGFRAMES
+#define PN532_CHUNK_LEN 240 // max APDU bytes given to the PN532 at once
 #define ACK_TIMEOUT 10000 // ms
+#define DETECT_TIMEOUT 100 // ms, so that configuration frames are read between two polls
+#define TAG_QUEUE_LEN 4 // tagged commands waiting for the card
+#define PRESENCE_INTERVAL 20 // ms between two card presence checks
+#define CHAIN_MAX 16 // GET RESPONSE / 6Cxx retries per command
+#define DEFAULT_BAUDRATE 115200 // at startup, and when a new rate fails
+#define BAUD_PROBATION 500 // ms for the computer to check a new rate
+#define ECHO_MAX_LEN 64 // max MYTERM_ECHO frame data
+#define RX_BUFFER_LEN LONG_READ_LEN // largest frame data the computer sends
+#define PN532_HEADER_LEN 8 // bytes before the data of a PN532 answer
+#define TX_HALF_LEN (PN532_HEADER_LEN+LONG_READ_LEN/2)
+#define FRAME_GAP 100 // ms between two bytes of a frame, with MYTERM_CONFIG_CRC
+#define SENT_HEAD_LEN 8 // bytes of the last frame sent kept as copies
+#define SENT_FRAMES 4 // frames sent before it which may be kept too, as many as TAG_QUEUE_LEN answers
+#define SENT_RING_LEN 128 // bytes of these frames, only short ones fit (max 255)
+#define NAK_LENGTH 2 // MYTERM_NAK frame data
+#define INLIST_ANSWER_LEN (PN532_HEADER_LEN+MAX_TARGETS*(5+UID_MAX_LEN+1+ATS_MAX_LEN)+2) // InListPassiveTarget
 
 /*
  * Frame format:
  * - 1 byte: opcode / rescode
- * - 1 byte: data length (may be 0)
+ * - 1 byte: data length (may be 0), 2 bytes (big endian) with
+ *   MYTERM_CONFIG_LONGFRAMES
  * - xx bytes: data
+ *
+ * MYTERM_BATCH command data:
+ * - 1 byte: flags (MYTERM_BATCH_STOPONERROR)
+ * - 1 byte: number of commands
+ * - for each command: 1 byte length, then the command, as in MYTERM_COMMAND
+ *
+ * MYTERM_BATCH response data (the response may be split in several frames):
+ * - 1 byte: flags (MYTERM_BATCH_MORE if another frame follows)
+ * - 1 byte: number of responses in this frame
+ * - for each response: 1 byte rescode, 1 byte length, then the card answer
+ *
+ * MYTERM_SCRIPT command data: bytecode run by the board (SCRIPT_*).
+ * - SCRIPT_APDU: 1 byte length, then the APDU (without the PN532 header)
+ * - SCRIPT_SELECTTAG: 2 bytes tag; selects the AID found in the last answer
+ * - SCRIPT_GPO: GET PROCESSING OPTIONS, with the PDOL (tag 9F38) of the
+ *   last answer filled with zeros
+ * - SCRIPT_FILTER: 1 byte count, then 2 bytes per tag
+ * - SCRIPT_READAFL: reads the records of the AFL, emitting the filtered
+ *   TLV objects (or the whole records if there is no filter)
+ * - SCRIPT_EMIT: emits the last answer
+ * - SCRIPT_END
+ * Emitted data is sent in MYTERM_RECORD frames. The script ends with a
+ * MYTERM_SCRIPT frame: 1 byte rescode, 1 byte offset of the last
+ * instruction, SW1 and SW2 of the last answer.
+ *
+ * MYTERM_CONFIG command data: 1 byte flags (MYTERM_CONFIG_*), and an
+ * optional second byte for the flags above 0xFF. Accepted at any time.
+ * The board answers with a MYTERM_CONFIG frame holding the flags it
+ * supports among them (first byte), the length of its tagged command
+ * queue, its largest frame data (2 bytes, LONG_READ_LEN), then the flags
+ * of the second byte.
+ * With MYTERM_CONFIG_PPSE, the board selects the PPSE as soon as a card is
+ * detected: the MYTERM_CARDFOUND frame is followed by the answer, as if the
+ * computer had sent the command.
+ * With MYTERM_CONFIG_LONGFRAMES, frame lengths take 2 bytes from the frame
+ * following the answer, in both directions. MYTERM_COMMAND frames may then
+ * hold extended-length APDUs: the board splits them, and gathers the
+ * answer, as the PN532 requires (MI bit, see PN532ReadData). Batches,
+ * scripts and tagged commands still use short answers.
+ * With MYTERM_CONFIG_CHAIN, the board completes the answers ending with
+ * 61xx or 6Cxx before sending them (see exchange), so that batches and
+ * tagged commands don't need the computer to follow them.
+ * With MYTERM_CONFIG_DEADLINE, MYTERM_COMMAND data, MYTERM_TAGGED data
+ * after the tag and MYTERM_BATCH data after the number of commands start
+ * with the time the card may take for each command (2 bytes, ms). Past
+ * it, the command is answered with MYTERM_TIMEOUT, and the session ends
+ * as if the card had left. Otherwise, the card gets ACK_TIMEOUT.
+ * With MYTERM_CONFIG_CRC, frames in both directions, from the frame
+ * following the answer, have a sequence number after their length (1
+ * byte, one counter per direction), and end with a CRC-16 (CCITT, from
+ * 0xFFFF, 2 bytes big endian) of the bytes before it. MYTERM_HELLO and
+ * MYTERM_ECHO frames never do. A frame with a wrong CRC, or whose bytes
+ * stop coming for FRAME_GAP, is dropped and answered with MYTERM_NAK; a
+ * frame received twice is dropped.
+ * With MYTERM_CONFIG_TARGETINFO, MYTERM_CARDFOUND frames carry all that
+ * the PN532 tells about the card (see detectCards), instead of its UID
+ * on UID_LENGTH bytes: ATQA (2 bytes), SAK, the UID length, the UID, the
+ * ATS length (0 for cards which are not ISO-DEP), then the ATS without
+ * its length byte. MYTERM_CONFIG_PPSE is then skipped for cards which are
+ * not ISO-DEP, as they can't take APDUs.
+ * With MYTERM_CONFIG_DUAL, up to MAX_TARGETS cards are listed at once:
+ * MYTERM_CARDFOUND data is the number of cards, then the information of
+ * each, as with MYTERM_CONFIG_TARGETINFO. Card n (from 1) is target n in
+ * the InDataExchange header of the commands (40 0n). The PPSE is only
+ * selected for the first card, and scripts only run on it.
+ *
+ * MYTERM_NAK data (with MYTERM_CONFIG_CRC): 1 byte sequence number of the
+ * frame asked for (the one expected next, or the first one missing), 1
+ * byte sequence number of the last frame sent. NAK frames take no
+ * sequence number of their own (0). The board answers a MYTERM_NAK asking
+ * for its last frame, or for one of the SENT_FRAMES before it short
+ * enough to be copied (see sentCopies), by sending that frame again, as
+ * is: the computer keeps the frames which followed it. Otherwise it
+ * answers with its own MYTERM_NAK, so that the computer sends its last
+ * frame again, or knows that the frames it missed are lost.
+ *
+ * MYTERM_BAUD command data (with MYTERM_CONFIG_BAUD, between two cards
+ * only): 4 bytes rate (big endian). The board answers at the current rate
+ * with the rate it switches to, or 0 if it doesn't support it. Then, for
+ * BAUD_PROBATION, it echoes the MYTERM_ECHO frames of the computer, which
+ * checks the link with them. An empty MYTERM_ECHO frame keeps the new
+ * rate; otherwise the board goes back to the previous one.
+ *
+ * MYTERM_HELLO frames always have a 1-byte length (0), whatever the frame
+ * format, so that a restarted computer can send them without knowing the
+ * board settings. The board answers at its current rate with 3 bytes of
+ * PN532 version, as in the startup banner, and its state (MYTERM_HELLO_*).
+ * Then it goes back to its startup settings: no MYTERM_CONFIG flags,
+ * DEFAULT_BAUDRATE. A running session ends without any other answer.
+ *
+ * MYTERM_TAGGED command data (with MYTERM_CONFIG_TAGGED): 1 byte tag, then
+ * the command, as in MYTERM_COMMAND. The computer may send the next ones
+ * without waiting for the answer, up to the queue length.
+ * MYTERM_TAGGED response data: 1 byte tag, 1 byte rescode, then the card
+ * answer.
+ *
+ * A session ends when the computer sends MYTERM_RELEASE (answered with an
+ * empty MYTERM_RELEASE frame), or after TIMEOUT without any command
+ * (MYTERM_TIMEOUT). Then the board waits for the card to leave and sends
+ * MYTERM_CARDREMOVED, before looking for the next one.
  */
 
 // Opcodes / rescodes
@@ -58,17 +181,182 @@
 #define MYTERM_OK         0x0A // Everything is all right!
 #define MYTERM_CARDFOUND  0x0B // When the chip detects a new card
 #define MYTERM_COMMAND    0x0C // Computer wants to send a command to the card
+#define MYTERM_BATCH      0x0D // Computer sends several commands at once
+#define MYTERM_SCRIPT     0x0E // Computer sends a script to run on the board
+#define MYTERM_RECORD     0x0F // Data emitted by a running script
+#define MYTERM_CONFIG     0x10 // Computer enables optional features
+#define MYTERM_TAGGED     0x13 // Command or answer carrying a request tag
+#define MYTERM_RELEASE    0x14 // Computer ends the session
+#define MYTERM_CARDREMOVED 0x15 // The card of the last session has left
+#define MYTERM_BAUD       0x16 // Computer asks for another serial rate
+#define MYTERM_ECHO       0x17 // Link check, sent back as is
+#define MYTERM_HELLO      0x18 // Computer resyncs with the running board
+#define MYTERM_NAK        0x19 // A frame was garbled: send it again
+
+#define MYTERM_HELLO_IDLE    0x00 // Waiting for a card
+#define MYTERM_HELLO_SESSION 0x01 // A session was running: waiting for the card to leave
+
+#define MYTERM_BATCH_STOPONERROR 0x01 // Stop after the first answer which is not 9000
+#define MYTERM_BATCH_MORE        0x01 // Another batch response frame follows
+
+#define MYTERM_CONFIG_PPSE       0x01 // Select the PPSE on card detection
+#define MYTERM_CONFIG_TAGGED     0x02 // Accept MYTERM_TAGGED frames
+#define MYTERM_CONFIG_LONGFRAMES 0x04 // 16-bit frame lengths, after the answer
+#define MYTERM_CONFIG_CHAIN      0x08 // Follow 61xx and 6Cxx answers on the board
+#define MYTERM_CONFIG_BAUD       0x10 // Accept MYTERM_BAUD frames between two cards
+#define MYTERM_CONFIG_DEADLINE   0x20 // Commands start with the time the card may take
+#define MYTERM_CONFIG_CRC        0x40 // Sequence number and CRC-16 on frames, after the answer
+#define MYTERM_CONFIG_TARGETINFO 0x80 // MYTERM_CARDFOUND carries ATQA, SAK, UID length and ATS
+#define MYTERM_CONFIG_DUAL       0x0100 // Up to two cards at once (second byte)
+#define CONFIG_SUPPORTED         (MYTERM_CONFIG_PPSE | MYTERM_CONFIG_TAGGED | MYTERM_CONFIG_LONGFRAMES \
+                                  | MYTERM_CONFIG_CHAIN | MYTERM_CONFIG_BAUD | MYTERM_CONFIG_DEADLINE \
+                                  | MYTERM_CONFIG_CRC | MYTERM_CONFIG_TARGETINFO | MYTERM_CONFIG_DUAL)
+
+// MYTERM_BAUD rates. Whether they work depends on the board clock: the
+// computer checks them before use.
+const uint32_t BAUD_RATES[] = {230400, 460800, 921600, 1000000, 2000000};
+
+// Script opcodes
+#define SCRIPT_END        0x00
+#define SCRIPT_APDU       0x01
+#define SCRIPT_SELECTTAG  0x02
+#define SCRIPT_GPO        0x03
+#define SCRIPT_FILTER     0x04
+#define SCRIPT_READAFL    0x05
+#define SCRIPT_EMIT       0x06
+
+#define SCRIPT_MAX_FILTER 8
+#define SCRIPT_MAX_PDOL   64
 
 Adafruit_PN532 nfc(PN532_SCK, PN532_MISO, PN532_MOSI, PN532_SS);
 
 unsigned long timeEllapsed = 0;
+uint16_t configFlags = 0;
+uint32_t baudrate = DEFAULT_BAUDRATE;
+uint32_t firmwareVersion = 0;
+bool cardHung = false; // a command went past its deadline: the session ends
+
+// Frame data received from the computer. While tagged commands wait for
+// the card, nothing else is received: they are kept there too.
+uint8_t rxBuffer[RX_BUFFER_LEN];
+
+// Card answers are read in place, after room for the PN532 frame header
+// (see PN532ReadData), and sent to the computer from there. Batches and
+// scripts need two answers at once: the second one takes the second half.
+uint8_t txBuffer[2*TX_HALF_LEN];
+#define TX_ANSWER (txBuffer+PN532_HEADER_LEN)
+#define TX_SECOND (txBuffer+TX_HALF_LEN+PN532_HEADER_LEN)
+
+// Receive state machine (see receiveFrame)
+enum
+{
+  RX_OPCODE,
+  RX_LENGTH,     // high byte, with MYTERM_CONFIG_LONGFRAMES
+  RX_LENGTH_LOW,
+  RX_SEQ,        // with MYTERM_CONFIG_CRC
+  RX_DATA,
+  RX_CRC,
+  RX_CRC_LOW
+};
+
+struct receiver
+{
+  uint8_t state;
+  uint8_t opcode;
+  uint16_t length;   // of the frame data
+  uint16_t received;
+  uint8_t *data;     // where the data goes, NULL if it is dropped
+  uint8_t first;     // first data byte, kept when dropped (tag)
+  bool checked;      // sequence number and CRC (MYTERM_CONFIG_CRC)
+  uint8_t seq;
+  uint16_t crc;      // computed over the bytes received
+  uint16_t check;    // received at the end of the frame
+  unsigned long lastByte;
+};
+
+receiver rx = {RX_OPCODE, 0, 0, 0, NULL, 0, false, 0, 0, 0, 0};
+
+// Frame being sent (see writeHeader), with MYTERM_CONFIG_CRC
+struct transmitter
+{
+  bool checked;
+  bool kept;         // it is the one sent again on MYTERM_NAK
+  bool copied;       // it is copied to sentRing too
+  uint16_t left;     // data bytes still to write
+  uint16_t crc;
+};
+
+transmitter tx = {false, false, false, 0, 0};
+uint8_t txSeq = 0; // of the next frame sent
+uint8_t rxSeq = 0; // expected for the next frame received
+
+// Last frame sent, to send it again on MYTERM_NAK. There is no room for a
+// copy: its first bytes, written piecewise, are copied, then the rest is
+// a single block, which stays where it was sent from until the next frame
+// (TX_ANSWER, TX_SECOND). Frames written otherwise are not kept.
+struct sentFrame
+{
+  uint8_t code;
+  uint16_t length;
+  uint8_t seq;
+  uint8_t head[SENT_HEAD_LEN];
+  uint8_t headLength;
+  const uint8_t *body;
+  uint16_t bodyLength;
+  bool valid;
+};
+
+sentFrame sent = {0, 0, 0, {0}, 0, NULL, 0, false};
+
+// Frames sent before the last one, as a tagged window or the records of a
+// script go back to back before the computer can ask for a garbled one.
+// Short frames are copied whole to sentRing, over the oldest ones; longer
+// ones are lost if garbled, as their data is overwritten by the next
+// answer. sentCopies is indexed by sequence number.
+struct sentCopy
+{
+  uint8_t seq;
+  uint8_t start;     // in sentRing
+  uint8_t length;    // whole frame, from its opcode to its CRC, 0 if none
+  uint8_t written;
+};
+
+uint8_t sentRing[SENT_RING_LEN];
+sentCopy sentCopies[SENT_FRAMES];
+uint8_t sentEnd = 0; // where the next copy goes in sentRing
+
+// Cards in the field, as listed by the PN532 (see detectCards)
+struct target
+{
+  uint8_t atqa[2];   // SENS_RES
+  uint8_t sak;       // SEL_RES
+  uint8_t uidLength;
+  uint8_t uid[UID_MAX_LEN];
+  uint8_t atsLength; // without its length byte, 0 if none
+  uint8_t ats[ATS_MAX_LEN];
+};
+
+target cards[MAX_TARGETS];
+uint8_t cardCount = 0;
+
+struct taggedCommand
+{
+  uint8_t *data; // tag, then the command, in rxBuffer
+  uint16_t length;
+};
+
+// Tagged commands received while the card is busy
+taggedCommand tagQueue[TAG_QUEUE_LEN];
+uint8_t tagHead = 0;
+uint8_t tagCount = 0;
 
 void setup(void) {
-  Serial.begin(115200);
+  Serial.begin(DEFAULT_BAUDRATE);
   while (!Serial) delay(10); // for Leonardo/Micro/Zero
   nfc.begin();
 
   uint32_t versiondata = nfc.getFirmwareVersion();
+  firmwareVersion = versiondata;
   if (!versiondata)
   {
     uint8_t buf[2] = {MYTERM_NOTFOUND,0x00};
@@ -90,136 +378,1265 @@ void setup(void) {
 
 void loop(void)
 {
-  uint8_t uid[UID_LENGTH];
-  uint8_t uidLength = UID_LENGTH;
-  
-  bool waitForLength = false;
-  uint8_t dataLength = 0;
-  uint8_t *dataBuffer = NULL;
+  bool released = false;
+  bool interrupted = false;
+
+  // Between two cards, only configuration frames are expected.
+  if (receiveFrame(false))
+  {
+    if (rx.opcode == MYTERM_HELLO)
+      hello(MYTERM_HELLO_IDLE);
+    else if (rx.opcode == MYTERM_CONFIG && rx.data != NULL)
+      configure(rx.data, rx.length);
+    else if (rx.opcode == MYTERM_BAUD && rx.data != NULL && (configFlags & MYTERM_CONFIG_BAUD))
+      changeBaudrate(rx.data, rx.length);
+  }
 
-  // This function actually works also for credit cards
-  if (nfc.readPassiveTargetID(PN532_MIFARE_ISO14443A, uid, &uidLength))
+  if (detectCards(DETECT_TIMEOUT))
   {
     timeEllapsed = millis();
-    Serial.write(MYTERM_CARDFOUND);
-    Serial.write(UID_LENGTH);
-    Serial.write(uid, UID_LENGTH);
+    cardHung = false;
+    sendCardFound();
+
+    // Only ISO-DEP cards take APDUs. Older computers wait for the answer.
+    bool isoDep = (cards[0].sak & SAK_ISODEP) != 0;
+    bool typed = (configFlags & (MYTERM_CONFIG_TARGETINFO | MYTERM_CONFIG_DUAL)) != 0;
+    if ((configFlags & MYTERM_CONFIG_PPSE) && (isoDep || !typed))
+    {
+      selectPpse();
+      timeEllapsed = millis();
+    }
 
     // Timeout loop
-    while (millis()-timeEllapsed < TIMEOUT)
+    while (!cardHung && millis()-timeEllapsed < TIMEOUT)
     {
-      // Wait for commands. Read serial port one byte after another.
-      int r = Serial.read();
-      if (r >= 0)
+      // Wait for commands, taking the received bytes as they come.
+      if (!receiveFrame(false))
+        continue;
+
+      if (rx.opcode == MYTERM_RELEASE)
       {
-        uint8_t c = r & 0xFF;
-        
-        // reset timeout
+        released = true;
+        break;
+      }
+
+      // The computer restarted: this session is over.
+      if (rx.opcode == MYTERM_HELLO)
+      {
+        hello(MYTERM_HELLO_SESSION);
+        interrupted = true;
+        break;
+      }
+
+      if (rx.opcode == MYTERM_TAGGED)
+      {
+        queueTagged(rx.data, rx.length, rx.first);
+        runTagged();
         timeEllapsed = millis();
+      }
+      else if (rx.length == 0)
+        continue;
+      else if (rx.data == NULL) // too long for rxBuffer
+        writeHeader(MYTERM_UNDEFERROR, 0);
+      else if (rx.opcode == MYTERM_BATCH)
+        runBatch(rx.data, rx.length);
+      else if (rx.opcode == MYTERM_SCRIPT)
+        runScript(rx.data, rx.length > 255 ? 255 : rx.length);
+      else if (rx.opcode == MYTERM_CONFIG)
+        configure(rx.data, rx.length);
+      else if (rx.opcode == MYTERM_BAUD)
+      {
+        // Refused during a session
+        writeHeader(MYTERM_BAUD, 4);
+        for (uint8_t i=0; i<4; i++)
+          writeByte(0);
+      }
+      else // MYTERM_COMMAND: start transmitting to the card!
+      {
+        // The answer is read in place, and sent from there.
+        uint8_t *cmd = rx.data;
+        uint16_t cmdLength = rx.length;
+        uint16_t timeout = takeDeadline(&cmd, &cmdLength);
+        uint16_t answerLength = (configFlags & MYTERM_CONFIG_LONGFRAMES) ? LONG_READ_LEN : READ_BUFFER_LEN;
+        uint8_t rescode = exchange(cmd, cmdLength, TX_ANSWER, &answerLength, timeout);
+        if (rescode != MYTERM_OK)
+          answerLength = 0;
+        writeHeader(rescode, answerLength);
+        writeData(TX_ANSWER, answerLength);
+      }
+    }
 
-        // if we don't have received the command length,
-        // and computer start sending a new command...
-        if (!waitForLength && c == MYTERM_COMMAND)
-          waitForLength = true;
-        else if (waitForLength)
+    if (released)
+    {
+      writeHeader(MYTERM_RELEASE, 0);
+    }
+    else if (!interrupted && !cardHung)
+    {
+      // Timeout is over. Send an error.
+      writeHeader(MYTERM_TIMEOUT, 0);
+    }
+    waitCardRemoval();
+  }
+}
+
+// Opcodes of the frames the computer may send. Other bytes are skipped.
+bool knownOpcode(uint8_t c)
+{
+  return c == MYTERM_COMMAND || c == MYTERM_BATCH || c == MYTERM_SCRIPT || c == MYTERM_CONFIG
+    || c == MYTERM_TAGGED || c == MYTERM_RELEASE || c == MYTERM_BAUD || c == MYTERM_HELLO
+    || c == MYTERM_NAK;
+}
+
+// Where the data of a frame goes: tagged commands are appended to their
+// ring, anything else at the start of rxBuffer. NULL if it doesn't fit,
+// then the frame is dropped.
+uint8_t* frameDestination(uint8_t opcode, uint16_t length)
+{
+  if (opcode == MYTERM_TAGGED)
+    return tagAlloc(length);
+  return length <= RX_BUFFER_LEN ? rxBuffer : NULL;
+}
+
+// Receive state machine: takes the bytes already there, without waiting,
+// and returns true once a whole frame was received (see rx). Any received
+// byte resets the session timeout. With taggedOnly, frames other than
+// MYTERM_TAGGED are not started, and stay in the serial buffer.
+// With MYTERM_CONFIG_CRC, garbled frames, frames received twice and
+// MYTERM_NAK frames are handled here (see checkFrame).
+bool receiveFrame(bool taggedOnly)
+{
+  int available;
+  while ((available = Serial.available()) > 0)
+  {
+    timeEllapsed = millis();
+    rx.lastByte = timeEllapsed;
+    if (rx.state == RX_OPCODE)
+    {
+      if (taggedOnly && Serial.peek() != MYTERM_TAGGED)
+        return false;
+      uint8_t c = Serial.read();
+      if (!knownOpcode(c))
+        continue;
+      rx.opcode = c;
+      rx.length = 0;
+      rx.received = 0;
+      rx.first = 0;
+      rx.checked = checkedFrame(c);
+      rx.crc = crc16(0xFFFF, &c, 1);
+      // MYTERM_HELLO always has a 1-byte length.
+      rx.state = (configFlags & MYTERM_CONFIG_LONGFRAMES) && c != MYTERM_HELLO ? RX_LENGTH : RX_LENGTH_LOW;
+      continue;
+    }
+    else if (rx.state == RX_LENGTH)
+    {
+      uint8_t c = Serial.read();
+      rx.crc = crc16(rx.crc, &c, 1);
+      rx.length = c << 8;
+      rx.state = RX_LENGTH_LOW;
+      continue;
+    }
+    else if (rx.state == RX_LENGTH_LOW)
+    {
+      uint8_t c = Serial.read();
+      rx.crc = crc16(rx.crc, &c, 1);
+      rx.length |= c;
+      rx.data = frameDestination(rx.opcode, rx.length);
+      rx.state = rx.checked ? RX_SEQ : RX_DATA;
+      if (rx.checked)
+        continue;
+    }
+    else if (rx.state == RX_SEQ)
+    {
+      rx.seq = Serial.read();
+      rx.crc = crc16(rx.crc, &rx.seq, 1);
+      rx.state = RX_DATA;
+    }
+    else if (rx.state == RX_DATA)
+    {
+      // Bulk read of what is there, straight to its place
+      uint16_t n = rx.length-rx.received;
+      if ((uint16_t) available < n)
+        n = available;
+      if (rx.data != NULL)
+      {
+        Serial.readBytes(rx.data+rx.received, n);
+        rx.crc = crc16(rx.crc, rx.data+rx.received, n);
+        if (rx.received == 0 && n > 0)
+          rx.first = rx.data[0];
+      }
+      else
+      {
+        for (uint16_t i=0; i<n; i++)
         {
-          dataLength = c;
-          waitForLength = false;
-  
-          if (dataLength > 0)
+          uint8_t c = Serial.read();
+          rx.crc = crc16(rx.crc, &c, 1);
+          if (rx.received+i == 0)
+            rx.first = c;
+        }
+      }
+      rx.received += n;
+    }
+    else
+    {
+      rx.check = (rx.check << 8) | Serial.read();
+      if (rx.state == RX_CRC)
+      {
+        rx.state = RX_CRC_LOW;
+        continue;
+      }
+      rx.state = RX_OPCODE;
+      if (checkFrame())
+        return true;
+      continue;
+    }
+
+    if (rx.received == rx.length)
+    {
+      if (rx.checked)
+      {
+        rx.state = RX_CRC;
+        continue;
+      }
+      rx.state = RX_OPCODE;
+      return true;
+    }
+  }
+
+  // The end of the frame doesn't come: its length was garbled.
+  if (rx.state != RX_OPCODE && rx.checked && millis()-rx.lastByte > FRAME_GAP)
+  {
+    rx.state = RX_OPCODE;
+    sendNak();
+  }
+  return false;
+}
+
+// Whether frames with this opcode carry a sequence number and a CRC.
+// MYTERM_HELLO ones never do, as the computer may have restarted, nor
+// MYTERM_ECHO ones, which check the link by themselves.
+bool checkedFrame(uint8_t code)
+{
+  return (configFlags & MYTERM_CONFIG_CRC) && code != MYTERM_HELLO && code != MYTERM_ECHO;
+}
+
+// Checks a frame received with MYTERM_CONFIG_CRC. Returns false if it
+// must be dropped: garbled (a MYTERM_NAK is sent), received twice, or a
+// MYTERM_NAK, which is answered here with the frame asked for, if it is
+// still kept (see sent and sentCopies).
+bool checkFrame(void)
+{
+  if (rx.check != rx.crc)
+  {
+    sendNak();
+    return false;
+  }
+  if (rx.opcode == MYTERM_NAK)
+  {
+    if (rx.data != NULL && rx.length >= NAK_LENGTH && rx.data[0] == sent.seq && sent.valid)
+      resendFrame();
+    else if (rx.data == NULL || rx.length < NAK_LENGTH || !resendCopy(rx.data[0]))
+      sendNak();
+    return false;
+  }
+  if (rx.seq == (uint8_t) (rxSeq-1))
+    return false;
+  rxSeq = rx.seq+1;
+  return true;
+}
+
+// Tells the computer which frame is expected, and which one was sent last.
+void sendNak(void)
+{
+  uint8_t nak[NAK_LENGTH] = {rxSeq, (uint8_t) (txSeq-1)};
+  writeHeader(MYTERM_NAK, NAK_LENGTH);
+  writeData(nak, NAK_LENGTH);
+}
+
+// CRC-16/CCITT, as crc16 in crc.c.
+uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t length)
+{
+  while (length-- > 0)
+  {
+    crc ^= (uint16_t) *data++ << 8;
+    for (uint8_t i=0; i<8; i++)
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// Looks for ISO/IEC 14443A cards, as readPassiveTargetID, but keeps in
+// cards all that InListPassiveTarget tells about them (PN532 user manual,
+// section 7.3.5): for ISO-DEP cards, the PN532 has already sent RATS, and
+// gives the ATS too. Up to MAX_TARGETS cards with MYTERM_CONFIG_DUAL.
+bool detectCards(uint16_t timeout)
+{
+  uint8_t maxTargets = (configFlags & MYTERM_CONFIG_DUAL) ? MAX_TARGETS : 1;
+  uint8_t cmd[3] = {0x4A, maxTargets, PN532_MIFARE_ISO14443A};
+  uint8_t answer[INLIST_ANSWER_LEN];
+
+  if (!nfc.sendCommandCheckAck(cmd, sizeof(cmd), timeout))
+    return false;
+  nfc.readdata(answer, sizeof(answer));
+
+  // After the frame header (see PN532ReadData), which ends with the number
+  // of targets, for each one: Tg, SENS_RES (2 bytes), SEL_RES,
+  // NFCIDLength, NFCID1, then for ISO-DEP cards the ATS, from its length
+  // byte. A card whose information was not read entirely is dropped.
+  uint8_t end = answer[3]+5 < sizeof(answer) ? answer[3]+5 : sizeof(answer);
+  uint8_t pos = PN532_HEADER_LEN;
+  cardCount = 0;
+  for (uint8_t i=0; i<answer[7] && i<maxTargets; i++)
+  {
+    target *t = &cards[cardCount];
+    if (pos+5 > end || answer[pos+4] > UID_MAX_LEN || pos+5+answer[pos+4] > end)
+      break;
+    t->atqa[0] = answer[pos+1];
+    t->atqa[1] = answer[pos+2];
+    t->sak = answer[pos+3];
+    t->uidLength = answer[pos+4];
+    memcpy(t->uid, answer+pos+5, t->uidLength);
+    pos += 5+t->uidLength;
+
+    t->atsLength = 0;
+    if ((t->sak & SAK_ISODEP) && pos < end && answer[pos] > 0)
+    {
+      uint8_t n = answer[pos]-1;
+      if (n > ATS_MAX_LEN)
+        n = ATS_MAX_LEN;
+      if (pos+1+n > end)
+        break;
+      memcpy(t->ats, answer+pos+1, n);
+      t->atsLength = n;
+      pos += answer[pos];
+    }
+    cardCount++;
+  }
+  return cardCount > 0;
+}
+
+// Sends MYTERM_CARDFOUND: the UID of the first card on UID_LENGTH bytes,
+// as older computers expect it, or all that is known of the cards with
+// MYTERM_CONFIG_TARGETINFO or MYTERM_CONFIG_DUAL. The data is laid out in
+// TX_ANSWER.
+void sendCardFound(void)
+{
+  uint8_t *data = TX_ANSWER;
+  uint16_t length = 0;
+
+  if (!(configFlags & (MYTERM_CONFIG_TARGETINFO | MYTERM_CONFIG_DUAL)))
+  {
+    memset(data, 0, UID_LENGTH);
+    memcpy(data, cards[0].uid, cards[0].uidLength < UID_LENGTH ? cards[0].uidLength : UID_LENGTH);
+    length = UID_LENGTH;
+  }
+  else
+  {
+    uint8_t count = (configFlags & MYTERM_CONFIG_DUAL) ? cardCount : 1;
+    if (configFlags & MYTERM_CONFIG_DUAL)
+      data[length++] = count;
+    for (uint8_t i=0; i<count; i++)
+    {
+      target *t = &cards[i];
+      data[length++] = t->atqa[0];
+      data[length++] = t->atqa[1];
+      data[length++] = t->sak;
+      data[length++] = t->uidLength;
+      memcpy(data+length, t->uid, t->uidLength);
+      length += t->uidLength;
+      data[length++] = t->atsLength;
+      memcpy(data+length, t->ats, t->atsLength);
+      length += t->atsLength;
+    }
+  }
+  writeHeader(MYTERM_CARDFOUND, length);
+  writeData(data, length);
+}
+
+// Waits for the card of the last session to leave, and tells the computer.
+void waitCardRemoval(void)
+{
+  // Diagnose, test 6: ISO/IEC 14443-4 card presence detection.
+  // See the PN532 user manual, section 7.2.1. With two cards, it checks
+  // the one the PN532 talked to last.
+  uint8_t cmd[2] = {0x00, 0x06};
+  uint8_t buffer[16];
+
+  while (1)
+  {
+    uint8_t len = sizeof(buffer)-PN532_HEADER_LEN;
+    if (!nfc.sendCommandCheckAck(cmd, sizeof(cmd), ACK_TIMEOUT)
+      || !PN532ReadData(buffer+PN532_HEADER_LEN, &len, NULL))
+      break;
+    if (rx.state == RX_OPCODE && Serial.available() >= 2 && Serial.peek() == MYTERM_HELLO)
+    {
+      Serial.read();
+      Serial.read();
+      hello(MYTERM_HELLO_SESSION);
+    }
+    delay(PRESENCE_INTERVAL);
+  }
+  writeHeader(MYTERM_CARDREMOVED, 0);
+}
+
+// Answers a MYTERM_HELLO frame, then goes back to the startup settings of
+// the link, as the computer which sent it has just started.
+void hello(uint8_t state)
+{
+  configFlags = 0;
+  writeHeader(MYTERM_HELLO, 4);
+  writeByte((firmwareVersion >> 24) & 0xFF);
+  writeByte((firmwareVersion >> 16) & 0xFF);
+  writeByte((firmwareVersion >> 8) & 0xFF);
+  writeByte(state);
+
+  if (baudrate != DEFAULT_BAUDRATE)
+  {
+    Serial.flush(); // the answer leaves at the current rate
+    Serial.end();
+    baudrate = DEFAULT_BAUDRATE;
+    Serial.begin(baudrate);
+  }
+}
+
+// Keeps the supported flags of a MYTERM_CONFIG frame, and sends them back.
+// The answer still uses the frame format of the request. Sequence numbers
+// start again from 0.
+void configure(uint8_t *data, uint16_t length)
+{
+  uint16_t flags = length > 0 ? data[0] : 0;
+  if (length > 1)
+    flags |= (uint16_t) data[1] << 8;
+  flags &= CONFIG_SUPPORTED;
+  writeHeader(MYTERM_CONFIG, 5);
+  writeByte(flags & 0xFF);
+  writeByte(TAG_QUEUE_LEN);
+  writeByte(LONG_READ_LEN >> 8);
+  writeByte(LONG_READ_LEN & 0xFF);
+  writeByte(flags >> 8);
+  configFlags = flags;
+  txSeq = 0;
+  rxSeq = 0;
+  sent.valid = false;
+  for (uint8_t i=0; i<SENT_FRAMES; i++)
+    sentCopies[i].length = 0;
+}
+
+// Answers a MYTERM_BAUD frame, and switches to the requested rate if it
+// is supported. The computer then checks the link with MYTERM_ECHO frames:
+// without an empty one before BAUD_PROBATION, the previous rate is back.
+void changeBaudrate(uint8_t *data, uint16_t length)
+{
+  uint32_t rate = 0;
+  if (length >= 4)
+    rate = ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) | ((uint32_t) data[2] << 8) | data[3];
+
+  bool supported = false;
+  for (uint8_t i=0; i<sizeof(BAUD_RATES)/sizeof(BAUD_RATES[0]); i++)
+    supported = supported || BAUD_RATES[i] == rate;
+  if (!supported)
+    rate = 0;
+
+  writeHeader(MYTERM_BAUD, 4);
+  writeByte(rate >> 24);
+  writeByte((rate >> 16) & 0xFF);
+  writeByte((rate >> 8) & 0xFF);
+  writeByte(rate & 0xFF);
+  if (!supported)
+    return;
+
+  Serial.flush(); // the answer leaves at the old rate
+  Serial.end();
+  Serial.begin(rate);
+
+  bool kept = false;
+  unsigned long start = millis();
+  while (!kept && millis()-start < BAUD_PROBATION)
+  {
+    if (Serial.available() < headerLength())
+      continue;
+    uint8_t code = Serial.read();
+    uint16_t len = readLength();
+    uint8_t echo[ECHO_MAX_LEN];
+    if (code != MYTERM_ECHO || len > ECHO_MAX_LEN || Serial.readBytes(echo, len) != len)
+      break;
+    if (len == 0)
+      kept = true;
+    else
+    {
+      writeHeader(MYTERM_ECHO, len);
+      writeData(echo, len);
+    }
+  }
+
+  if (kept)
+    baudrate = rate;
+  else
+  {
+    Serial.end();
+    Serial.begin(baudrate);
+  }
+}
+
+// Frame header: opcode, then a 1-byte length, or a 2-byte one once
+// MYTERM_CONFIG_LONGFRAMES is enabled.
+uint8_t headerLength(void)
+{
+  return (configFlags & MYTERM_CONFIG_LONGFRAMES) ? 3 : 2;
+}
+
+// With MYTERM_CONFIG_CRC, the sequence number follows, and the CRC is
+// written after the last data byte (see writeData).
+void writeHeader(uint8_t code, uint16_t length)
+{
+  uint8_t header[4];
+  uint8_t n = 0;
+  header[n++] = code;
+  if (configFlags & MYTERM_CONFIG_LONGFRAMES)
+    header[n++] = length >> 8;
+  header[n++] = length & 0xFF;
+
+  tx.checked = checkedFrame(code);
+  tx.copied = false;
+  if (tx.checked)
+  {
+    // MYTERM_NAK frames take no sequence number, and are not sent again.
+    tx.kept = code != MYTERM_NAK;
+    header[n++] = tx.kept ? txSeq : 0;
+    if (tx.kept)
+    {
+      sent.code = code;
+      sent.length = length;
+      sent.seq = txSeq++;
+      sent.headLength = 0;
+      sent.body = NULL;
+      sent.bodyLength = 0;
+      sent.valid = true;
+      copyFrame(sent.seq, n+length+2);
+    }
+    tx.crc = crc16(0xFFFF, header, n);
+    tx.left = length;
+  }
+  Serial.write(header, n);
+  copyBytes(header, n);
+  if (tx.checked && length == 0)
+    writeCrc(tx.crc);
+}
+
+// Writes data of the current frame. Blocks which don't fit in the copy of
+// the last frame must stay in place until the next one.
+void writeData(const uint8_t *data, uint16_t length)
+{
+  Serial.write(data, length);
+  if (!tx.checked || length == 0)
+    return;
+  tx.crc = crc16(tx.crc, data, length);
+  if (tx.kept)
+  {
+    if (sent.body == NULL && sent.headLength+length <= SENT_HEAD_LEN)
+    {
+      memcpy(sent.head+sent.headLength, data, length);
+      sent.headLength += length;
+    }
+    else if (sent.body == NULL)
+    {
+      sent.body = data;
+      sent.bodyLength = length;
+    }
+    else
+      sent.valid = false;
+  }
+  copyBytes(data, length);
+  tx.left -= length;
+  if (tx.left == 0)
+    writeCrc(tx.crc);
+}
+
+void writeByte(uint8_t c)
+{
+  // Not a block which stays in place: its copy must fit.
+  if (tx.checked && tx.kept && (sent.body != NULL || sent.headLength == SENT_HEAD_LEN))
+    sent.valid = false;
+  writeData(&c, 1);
+}
+
+void writeCrc(uint16_t crc)
+{
+  uint8_t c[2] = {(uint8_t) (crc >> 8), (uint8_t) (crc & 0xFF)};
+  Serial.write(c, 2);
+  copyBytes(c, 2);
+  tx.copied = false;
+}
+
+// Sends the last frame again, with its sequence number, for MYTERM_NAK.
+void resendFrame(void)
+{
+  uint8_t header[4];
+  uint8_t n = 0;
+  header[n++] = sent.code;
+  if (configFlags & MYTERM_CONFIG_LONGFRAMES)
+    header[n++] = sent.length >> 8;
+  header[n++] = sent.length & 0xFF;
+  header[n++] = sent.seq;
+
+  uint16_t crc = crc16(0xFFFF, header, n);
+  crc = crc16(crc, sent.head, sent.headLength);
+  crc = crc16(crc, sent.body, sent.bodyLength);
+  Serial.write(header, n);
+  Serial.write(sent.head, sent.headLength);
+  if (sent.bodyLength > 0)
+    Serial.write(sent.body, sent.bodyLength);
+  uint8_t c[2] = {(uint8_t) (crc >> 8), (uint8_t) (crc & 0xFF)};
+  Serial.write(c, 2);
+}
+
+// Makes room in sentRing for a copy of the frame being sent, of length
+// bytes, over the oldest copies. Longer frames than sentRing are not
+// copied.
+void copyFrame(uint8_t seq, uint16_t length)
+{
+  sentCopy *f = &sentCopies[seq % SENT_FRAMES];
+  f->seq = seq;
+  f->length = 0;
+  if (length > SENT_RING_LEN)
+    return;
+  if (sentEnd+length > SENT_RING_LEN)
+    sentEnd = 0;
+  for (uint8_t i=0; i<SENT_FRAMES; i++)
+  {
+    sentCopy *old = &sentCopies[i];
+    if (old != f && old->length > 0 && old->start < sentEnd+length && sentEnd < old->start+old->length)
+      old->length = 0;
+  }
+  f->start = sentEnd;
+  f->length = length;
+  f->written = 0;
+  sentEnd += length;
+  tx.copied = true;
+}
+
+// Copies bytes of the frame being sent to sentRing, if it is copied.
+void copyBytes(const uint8_t *data, uint16_t length)
+{
+  if (!tx.copied)
+    return;
+  sentCopy *f = &sentCopies[(uint8_t) (txSeq-1) % SENT_FRAMES];
+  if (f->written+length > f->length)
+    return;
+  memcpy(sentRing+f->start+f->written, data, length);
+  f->written += length;
+}
+
+// Sends a copied frame again, as is, for MYTERM_NAK. Returns false if it
+// isn't copied.
+bool resendCopy(uint8_t seq)
+{
+  sentCopy *f = &sentCopies[seq % SENT_FRAMES];
+  if (f->seq != seq || f->length == 0 || f->written != f->length)
+    return false;
+  Serial.write(sentRing+f->start, f->length);
+  return true;
+}
+
+// Reads the length of a frame, after its opcode.
+uint16_t readLength(void)
+{
+  uint8_t c[2] = {0, 0};
+  if (configFlags & MYTERM_CONFIG_LONGFRAMES)
+  {
+    Serial.readBytes(c, 2);
+    return (c[0] << 8) | c[1];
+  }
+  Serial.readBytes(c, 1);
+  return c[0];
+}
+
+void sendTaggedAnswer(uint8_t tag, uint8_t rescode, uint8_t *answer, uint8_t length)
+{
+  writeHeader(MYTERM_TAGGED, length+2);
+  writeByte(tag);
+  writeByte(rescode);
+  writeData(answer, length);
+}
+
+// Room in rxBuffer for a tagged command, after the queued ones: they
+// form a ring, each command being kept in one piece. NULL if the queue or
+// the ring is full.
+uint8_t* tagAlloc(uint16_t length)
+{
+  if (tagCount == TAG_QUEUE_LEN || length < 2 || length > READ_BUFFER_LEN)
+    return NULL;
+  if (tagCount == 0)
+    return rxBuffer;
+
+  taggedCommand *last = &tagQueue[(tagHead+tagCount-1) % TAG_QUEUE_LEN];
+  uint16_t head = tagQueue[tagHead].data-rxBuffer;
+  uint16_t tail = last->data+last->length-rxBuffer;
+  if (tail > head)
+  {
+    // Used: [head, tail). Free: after tail, then before head.
+    if (tail+length <= RX_BUFFER_LEN)
+      return rxBuffer+tail;
+    if (length < head)
+      return rxBuffer;
+  }
+  else if (tail+length < head) // used: [head, end) and [0, tail)
+    return rxBuffer+tail;
+  return NULL;
+}
+
+// Queues a received MYTERM_TAGGED frame, already in its place (see
+// tagAlloc). Answers an error to dropped ones.
+void queueTagged(uint8_t *data, uint16_t length, uint8_t tag)
+{
+  if (data == NULL || !(configFlags & MYTERM_CONFIG_TAGGED))
+  {
+    sendTaggedAnswer(tag, MYTERM_UNDEFERROR, NULL, 0);
+    return;
+  }
+  uint8_t i = (tagHead+tagCount) % TAG_QUEUE_LEN;
+  tagQueue[i].data = data;
+  tagQueue[i].length = length;
+  tagCount++;
+}
+
+// With MYTERM_CONFIG_DEADLINE, skips the time the card may take at the
+// start of the command data, and returns it. ACK_TIMEOUT otherwise.
+uint16_t takeDeadline(uint8_t **data, uint16_t *length)
+{
+  if (!(configFlags & MYTERM_CONFIG_DEADLINE) || *length < 2)
+    return ACK_TIMEOUT;
+  uint16_t timeout = ((*data)[0] << 8) | (*data)[1];
+  *data += 2;
+  *length -= 2;
+  return timeout > 0 ? timeout : ACK_TIMEOUT;
+}
+
+// Queues the tagged frames received so far, so that the computer can keep
+// on sending while the card is busy.
+void receiveTagged(void)
+{
+  while (receiveFrame(true))
+    queueTagged(rx.data, rx.length, rx.first);
+}
+
+// Runs the queued tagged commands, in order.
+void runTagged(void)
+{
+  while (tagCount > 0)
+  {
+    receiveTagged();
+
+    taggedCommand *cmd = &tagQueue[tagHead];
+    // Once the card hung, the next ones are not even tried.
+    uint8_t *command = cmd->data+1;
+    uint16_t length = cmd->length-1;
+    uint16_t timeout = takeDeadline(&command, &length);
+    uint16_t answerLength = READ_BUFFER_LEN-2; // room for tag and rescode
+    uint8_t rescode = cardHung ? MYTERM_TIMEOUT
+      : exchange(command, length, TX_ANSWER, &answerLength, timeout);
+    if (rescode != MYTERM_OK)
+      answerLength = 0;
+    sendTaggedAnswer(cmd->data[0], rescode, TX_ANSWER, answerLength);
+
+    tagHead = (tagHead+1) % TAG_QUEUE_LEN;
+    tagCount--;
+  }
+}
+
+// Sends SELECT 2PAY.SYS.DDF01 without waiting for the computer, and the
+// answer as for a MYTERM_COMMAND frame.
+void selectPpse(void)
+{
+  uint8_t cmd[22] = {0x40, 0x01, 0x00, 0xA4, 0x04, 0x00, 0x0E,
+    '2', 'P', 'A', 'Y', '.', 'S', 'Y', 'S', '.', 'D', 'D', 'F', '0', '1', 0x00};
+  uint16_t answerLength = READ_BUFFER_LEN;
+  uint8_t rescode = exchange(cmd, sizeof(cmd), TX_ANSWER, &answerLength, ACK_TIMEOUT);
+
+  if (rescode != MYTERM_OK)
+  {
+    writeHeader(rescode, 0);
+  }
+  else
+  {
+    writeHeader(MYTERM_OK, answerLength);
+    writeData(TX_ANSWER, answerLength);
+  }
+}
+
+// Runs the commands of a MYTERM_BATCH frame back to back, and sends
+// their answers packed in as few frames as possible.
+void runBatch(uint8_t *data, uint16_t length)
+{
+  if (length < 2)
+  {
+    writeHeader(MYTERM_UNDEFERROR, 0);
+    return;
+  }
+
+  // The frame is built in the first half of txBuffer, while the answers
+  // are read in the second one.
+  uint8_t *frame = TX_ANSWER;
+  uint8_t *readBuffer = TX_SECOND;
+
+  uint8_t flags = data[0];
+  uint8_t *commands = data+2;
+  uint16_t left = length-2;
+  uint16_t timeout = takeDeadline(&commands, &left);
+  uint8_t frameLength = 2;
+  uint8_t frameCount = 0;
+  uint16_t pos = commands-data;
+
+  for (uint8_t i=0; i<data[1] && pos < length; i++)
+  {
+    uint8_t cmdLength = data[pos++];
+    if (pos+cmdLength > length)
+      break;
+
+    uint16_t readBufferLen = READ_BUFFER_LEN-4; // room for a frame header
+    uint8_t rescode = exchange(data+pos, cmdLength, readBuffer, &readBufferLen, timeout);
+    if (rescode != MYTERM_OK)
+      readBufferLen = 0;
+    pos += cmdLength;
+
+    // Not enough room left: send what we have, and start a new frame.
+    if (frameLength+2+readBufferLen > READ_BUFFER_LEN)
+    {
+      frame[0] = MYTERM_BATCH_MORE;
+      frame[1] = frameCount;
+      writeHeader(MYTERM_BATCH, frameLength);
+      writeData(frame, frameLength);
+      frameLength = 2;
+      frameCount = 0;
+    }
+    frame[frameLength++] = rescode;
+    frame[frameLength++] = readBufferLen;
+    memcpy(frame+frameLength, readBuffer, readBufferLen);
+    frameLength += readBufferLen;
+    frameCount++;
+
+    bool success = readBufferLen >= 2 && readBuffer[readBufferLen-2] == 0x90
+      && readBuffer[readBufferLen-1] == 0x00;
+    if (rescode != MYTERM_OK || ((flags & MYTERM_BATCH_STOPONERROR) && !success))
+      break;
+  }
+
+  frame[0] = 0;
+  frame[1] = frameCount;
+  writeHeader(MYTERM_BATCH, frameLength);
+  writeData(frame, frameLength);
+}
+
+// Looks for a tag in BER-TLV data, recursing into constructed objects.
+// Same as scriptFindTag in script.c.
+bool findTag(const uint8_t *data, uint8_t length, uint16_t tag,
+  uint8_t *start, uint8_t *valueStart, uint8_t *valueLength)
+{
+  uint8_t pos = 0;
+  while (pos < length)
+  {
+    uint8_t objStart = pos;
+    if (data[pos] == 0x00 || data[pos] == 0xFF) // padding
+    {
+      pos++;
+      continue;
+    }
+
+    bool constructed = (data[pos] & 0x20) == 0x20;
+    uint16_t t = data[pos++];
+    if ((t & 0x1F) == 0x1F)
+    {
+      if (pos >= length)
+        return false;
+      t = (t << 8) | data[pos];
+      while (pos < length && (data[pos++] & 0x80) == 0x80);
+    }
+
+    if (pos >= length)
+      return false;
+    uint8_t len = data[pos++];
+    if (len == 0x81 && pos < length)
+      len = data[pos++];
+    else if (len > 0x80)
+      return false;
+    if ((unsigned int) pos+len > length)
+      return false;
+
+    if (t == tag)
+    {
+      *start = objStart;
+      *valueStart = pos;
+      *valueLength = len;
+      return true;
+    }
+    if (constructed && findTag(data+pos, len, tag, start, valueStart, valueLength))
+    {
+      *start += pos;
+      *valueStart += pos;
+      return true;
+    }
+    pos += len;
+  }
+  return false;
+}
+
+// Sends an APDU to the card, and fills the SW of the answer, which is
+// removed from resp. Returns false if the script must stop.
+// The InDataExchange header is written in place, over the 2 bytes before
+// the APDU, which are restored afterwards.
+bool scriptExchange(uint8_t *apdu, uint8_t len, uint8_t *resp, uint8_t *respLen,
+  uint8_t *result)
+{
+  uint8_t *cmd = apdu-2;
+  uint8_t saved[2] = {cmd[0], cmd[1]};
+  cmd[0] = 0x40; // InDataExchange
+  cmd[1] = 0x01; // first target
+
+  uint16_t answerLength = READ_BUFFER_LEN;
+  result[0] = exchange(cmd, len+2, resp, &answerLength, ACK_TIMEOUT);
+  cmd[0] = saved[0];
+  cmd[1] = saved[1];
+  if (result[0] == MYTERM_OK && answerLength < 2)
+    result[0] = MYTERM_READERROR;
+  if (result[0] != MYTERM_OK)
+    return false;
+  *respLen = answerLength;
+  result[2] = resp[*respLen-2];
+  result[3] = resp[*respLen-1];
+  *respLen -= 2;
+  return result[2] == 0x90 && result[3] == 0x00;
+}
+
+void scriptEmit(const uint8_t *data, uint8_t len)
+{
+  writeHeader(MYTERM_RECORD, len);
+  writeData(data, len);
+}
+
+// Runs a MYTERM_SCRIPT frame (see script.c for the reference interpreter).
+// Result: rescode, offset of the last instruction, SW1, SW2.
+void runScript(uint8_t *code, uint8_t length)
+{
+  uint8_t result[4] = {MYTERM_OK, 0, 0x90, 0x00};
+  uint8_t *last = TX_ANSWER;
+  uint8_t *rec = TX_SECOND;
+  uint8_t lastLen = 0, recLen;
+  uint16_t filter[SCRIPT_MAX_FILTER];
+  uint8_t filterCount = 0;
+  uint8_t start, vstart, vlen;
+  uint8_t pc = 0;
+
+  while (pc < length)
+  {
+    result[1] = pc;
+    uint8_t op = code[pc++];
+    if (op == SCRIPT_END)
+      break;
+    else if (op == SCRIPT_APDU)
+    {
+      if (pc >= length || (unsigned int) pc+1+code[pc] > length)
+      {
+        result[0] = MYTERM_UNDEFERROR;
+        break;
+      }
+      if (!scriptExchange(code+pc+1, code[pc], last, &lastLen, result))
+        break;
+      pc += 1+code[pc];
+    }
+    else if (op == SCRIPT_SELECTTAG)
+    {
+      if ((unsigned int) pc+2 > length)
+      {
+        result[0] = MYTERM_UNDEFERROR;
+        break;
+      }
+      uint16_t tag = (code[pc] << 8) | code[pc+1];
+      pc += 2;
+      if (!findTag(last, lastLen, tag, &start, &vstart, &vlen) || vlen > 16)
+      {
+        result[0] = MYTERM_NOTFOUND;
+        break;
+      }
+      // 2 bytes of room for the InDataExchange header
+      uint8_t select[2+22] = {0x00, 0x00, 0x00, 0xA4, 0x04, 0x00};
+      select[6] = vlen;
+      memcpy(select+7, last+vstart, vlen);
+      select[7+vlen] = 0x00;
+      if (!scriptExchange(select+2, 6+vlen, last, &lastLen, result))
+        break;
+    }
+    else if (op == SCRIPT_GPO)
+    {
+      // The PDOL only holds tags and lengths: its data is sent as zeros
+      uint8_t pdolLength = 0;
+      if (findTag(last, lastLen, 0x9F38, &start, &vstart, &vlen))
+      {
+        uint8_t pos = vstart;
+        bool tooLong = false;
+        while (pos < vstart+vlen && !tooLong)
+        {
+          if ((last[pos++] & 0x1F) == 0x1F)
+            while (pos < vstart+vlen && (last[pos++] & 0x80) == 0x80);
+          if (pos >= vstart+vlen)
+            break;
+          tooLong = pdolLength+last[pos] > SCRIPT_MAX_PDOL;
+          pdolLength += last[pos++];
+        }
+        if (tooLong)
+        {
+          result[0] = MYTERM_UNDEFERROR;
+          break;
+        }
+      }
+      // 2 bytes of room for the InDataExchange header
+      uint8_t gpo[2+8+SCRIPT_MAX_PDOL] = {0x00, 0x00, 0x80, 0xA8, 0x00, 0x00};
+      gpo[6] = 2+pdolLength;
+      gpo[7] = 0x83;
+      gpo[8] = pdolLength;
+      memset(gpo+9, 0x00, pdolLength+1);
+      if (!scriptExchange(gpo+2, 8+pdolLength, last, &lastLen, result))
+        break;
+    }
+    else if (op == SCRIPT_FILTER)
+    {
+      if (pc >= length || code[pc] > SCRIPT_MAX_FILTER || (unsigned int) pc+1+2*code[pc] > length)
+      {
+        result[0] = MYTERM_UNDEFERROR;
+        break;
+      }
+      filterCount = code[pc++];
+      for (uint8_t i=0; i<filterCount; i++, pc+=2)
+        filter[i] = (code[pc] << 8) | code[pc+1];
+    }
+    else if (op == SCRIPT_READAFL)
+    {
+      // Format 1: 80 { AIP, AFL }. Format 2: 77 { 82 AIP, 94 AFL }
+      uint8_t aflStart, aflLen;
+      if (lastLen > 2 && last[0] == 0x80 && findTag(last, lastLen, 0x80, &start, &vstart, &vlen) && vlen >= 2)
+      {
+        aflStart = vstart+2;
+        aflLen = vlen-2;
+      }
+      else if (findTag(last, lastLen, 0x94, &start, &vstart, &vlen))
+      {
+        aflStart = vstart;
+        aflLen = vlen;
+      }
+      else
+      {
+        result[0] = MYTERM_NOTFOUND;
+        break;
+      }
+      // Records are read into rec, so the AFL stays valid in last.
+      uint8_t *afl = last+aflStart;
+
+      // One bit per filter tag. Once every tag was found, stop reading.
+      uint16_t found = 0;
+      uint16_t all = (1 << filterCount) - 1;
+      bool failed = false;
+      for (uint8_t i=0; i+4 <= aflLen && !failed && (filterCount == 0 || found != all); i+=4)
+      {
+        uint8_t sfi = afl[i] >> 3;
+        for (uint8_t r=afl[i+1]; r<=afl[i+2] && r != 0 && (filterCount == 0 || found != all); r++)
+        {
+          uint8_t readRecord[2+5] = {0x00, 0x00, 0x00, 0xB2, r, (uint8_t) ((sfi << 3) | 0x04), 0x00};
+          if (!scriptExchange(readRecord+2, sizeof(readRecord)-2, rec, &recLen, result))
           {
-            dataBuffer = (uint8_t*) malloc(sizeof(uint8_t)*dataLength);
-            if (dataBuffer == NULL)
-            {
-              dataLength = 0;
-              Serial.write(MYTERM_UNDEFERROR);
-              Serial.write(0x00);
-              return;
-            }
-            
-            int n = Serial.readBytes(dataBuffer, dataLength);
+            failed = true;
+            break;
+          }
 
-            // We receive all the data, start transmitting to the card!
-            if (n == dataLength)
+          if (filterCount == 0)
+          {
+            scriptEmit(rec, recLen);
+            continue;
+          }
+          for (uint8_t f=0; f<filterCount; f++)
+          {
+            if ((found & (1 << f)) == 0 && findTag(rec, recLen, filter[f], &start, &vstart, &vlen))
             {
-              // If the card don't ack, raise an error
-              if (!nfc.sendCommandCheckAck(dataBuffer, dataLength, ACK_TIMEOUT))
-              {
-                Serial.write(MYTERM_WRITEERROR);
-                Serial.write(0x00);
-                return;
-              }
-              // Command was successfully sent, wait for answer.
-              else
-              {
-                uint8_t readBufferLen = READ_BUFFER_LEN;
-                uint8_t *readBuffer = (uint8_t*) malloc(sizeof(uint8_t)*readBufferLen);
-                if (readBuffer == NULL)
-                {
-                  dataLength = 0;
-                  Serial.write(MYTERM_UNDEFERROR);
-                  Serial.write(0x00);
-                  return;
-                }
-                if (!PN532ReadData(readBuffer, &readBufferLen))
-                {
-                  Serial.write(MYTERM_READERROR);
-                  Serial.write(0x00);
-                  free(readBuffer);
-                  return;
-                }
-                Serial.write(MYTERM_OK);
-                Serial.write(readBufferLen);
-                Serial.write(readBuffer,readBufferLen);
-                dataLength = 0;
-                free(readBuffer);
-              }
+              scriptEmit(rec+start, vstart+vlen-start);
+              found |= 1 << f;
             }
           }
         }
       }
+      if (failed)
+        break;
+    }
+    else if (op == SCRIPT_EMIT)
+      scriptEmit(last, lastLen);
+    else
+    {
+      result[0] = MYTERM_UNDEFERROR;
+      break;
+    }
+  }
+
+  writeHeader(MYTERM_SCRIPT, sizeof(result));
+  writeData(result, sizeof(result));
+}
+
+// Sends an InDataExchange frame, and reads the answer, up to *len bytes.
+// With MYTERM_CONFIG_CHAIN, an answer ending with 61xx (more data) is
+// completed with GET RESPONSE, and one ending with 6Cxx (wrong Le) by
+// sending the command again with the right Le, as the computer would
+// have to (ISO 7816-4, section 5.1.3). The chunks are appended. A card
+// which makes no progress (6Cxx asking for the Le just sent, GET RESPONSE
+// bringing no data) is not asked again: its answer is left as it is.
+// The whole exchange must be over within timeout ms: past it, the card is
+// considered hung (cardHung).
+// Returns MYTERM_OK, MYTERM_WRITEERROR, MYTERM_READERROR or MYTERM_TIMEOUT.
+uint8_t exchange(uint8_t *cmd, uint16_t length, uint8_t *answer, uint16_t *len, uint16_t timeout)
+{
+  uint8_t target = cmd[1] & 0x0F;
+  uint8_t getResponse[7] = {0x40, target, 0x00, 0xC0, 0x00, 0x00, 0x00};
+  uint8_t *last = cmd;
+  uint16_t lastLength = length;
+  uint16_t max = *len, offset = 0;
+  unsigned long start = millis();
+
+  for (uint8_t i=0; i<=CHAIN_MAX; i++)
+  {
+    *len = max-offset;
+    bool sent = sendChained(last, lastLength, start, timeout);
+    if (!sent || !readChained(target, answer+offset, len, start, timeout))
+    {
+      cardHung = timeLeft(start, timeout) == 0;
+      return cardHung ? MYTERM_TIMEOUT : !sent ? MYTERM_WRITEERROR : MYTERM_READERROR;
     }
+    *len += offset;
+    if (!(configFlags & MYTERM_CONFIG_CHAIN) || *len < 2)
+      break;
 
-    // Timeout is over. Send an error.
-    Serial.write(MYTERM_TIMEOUT);
-    Serial.write(0x00);
+    // 6Cxx answers carry no data: the chunks so far are kept either way.
+    uint8_t sw1 = answer[*len-2], sw2 = answer[*len-1];
+    if (sw1 == 0x61 && (last != getResponse || *len-2 > offset))
+    {
+      getResponse[6] = sw2;
+      last = getResponse;
+      lastLength = sizeof(getResponse);
+    }
+    else if (sw1 == 0x6C && lastLength > 6 && last[lastLength-1] != sw2)
+      last[lastLength-1] = sw2;
+    else
+      break;
+    offset = *len-2;
   }
-  if (dataBuffer != NULL)
-    free(dataBuffer);
+  return MYTERM_OK;
+}
+
+// Time left before the deadline of an exchange started at start, 0 once
+// it is over.
+uint16_t timeLeft(unsigned long start, uint16_t timeout)
+{
+  unsigned long spent = millis()-start;
+  return spent < timeout ? timeout-spent : 0;
 }
 
-bool PN532ReadData(uint8_t *buffer, uint8_t *len)
+// Sends a frame to the PN532, and waits for its answer to be ready, up to
+// the deadline. A timeout of 0 would make the library wait forever.
+bool sendUntil(uint8_t *cmd, uint8_t length, unsigned long start, uint16_t timeout)
+{
+  uint16_t left = timeLeft(start, timeout);
+  return left > 0 && nfc.sendCommandCheckAck(cmd, length, left);
+}
+
+// Sends an InDataExchange frame to the PN532. APDUs too long for a single
+// PN532 frame are split: the MI bit of the target byte tells that more
+// data follows (PN532 user manual, section 7.3.8).
+bool sendChained(uint8_t *cmd, uint16_t length, unsigned long start, uint16_t timeout)
+{
+  if (length <= 2+PN532_CHUNK_LEN)
+    return sendUntil(cmd, length, start, timeout);
+
+  // Each part is sent in place, with the header written over the 2 bytes
+  // before it, which are restored afterwards.
+  uint8_t code = cmd[0], target = cmd[1];
+  uint16_t pos = 2;
+  while (pos < length)
+  {
+    uint8_t n = length-pos > PN532_CHUNK_LEN ? PN532_CHUNK_LEN : length-pos;
+    uint8_t *chunk = cmd+pos-2;
+    uint8_t saved[2] = {chunk[0], chunk[1]};
+    chunk[0] = code;
+    chunk[1] = target | (pos+n < length ? 0x40 : 0x00);
+    bool sent = sendUntil(chunk, n+2, start, timeout);
+    chunk[0] = saved[0];
+    chunk[1] = saved[1];
+    if (!sent)
+      return false;
+    pos += n;
+
+    // Every part but the last one gets an empty answer
+    uint8_t ack[16];
+    uint8_t ackLen = sizeof(ack)-PN532_HEADER_LEN;
+    if (pos < length && !PN532ReadData(ack+PN532_HEADER_LEN, &ackLen, NULL))
+      return false;
+  }
+  return true;
+}
+
+// Reads the answer to an InDataExchange frame, up to *len bytes. While the
+// PN532 has more of it (MI bit), the rest is asked to target with an empty
+// frame.
+bool readChained(uint8_t target, uint8_t *buffer, uint16_t *len, unsigned long start, uint16_t timeout)
+{
+  uint8_t next[2] = {0x40, target};
+  uint16_t total = 0;
+  bool more = true;
+
+  while (more)
+  {
+    uint8_t n = *len-total > READ_BUFFER_LEN ? READ_BUFFER_LEN : *len-total;
+    if (n == 0 || (total > 0 && !sendUntil(next, sizeof(next), start, timeout))
+      || !PN532ReadData(buffer+total, &n, &more))
+      return false;
+    total += n;
+  }
+  *len = total;
+  return true;
+}
+
+// Reads the data of a PN532 answer in place, up to *len bytes: its header
+// goes in the PN532_HEADER_LEN bytes before buffer (restored afterwards),
+// so that the data lands in buffer, and *len is set to its length.
+// If more is given, a status with the MI bit (more information) is
+// accepted, and reported in it.
+bool PN532ReadData(uint8_t *buffer, uint8_t *len, bool *more)
 {
   if (*len == 0) return false;
-  uint8_t *tmpbuf = (uint8_t*) malloc(*len);
-  if (tmpbuf == NULL) return false;
+  uint8_t size = *len > 255-PN532_HEADER_LEN ? 255 : *len+PN532_HEADER_LEN;
+  uint8_t *frame = buffer-PN532_HEADER_LEN;
+  uint8_t saved[PN532_HEADER_LEN];
+  memcpy(saved, frame, PN532_HEADER_LEN);
 
-  nfc.readdata(tmpbuf, *len);
+  nfc.readdata(frame, size);
 
   // The 8 first bytes are related to the PN532 communication protocol.
   // Useless for us, except the last one: if it is not zero, there were
   // a communication error with the card.
-  if (tmpbuf[7] != 0)
-  {
-    free(tmpbuf);
-    return false;
-  }
-
-  // Data starts at position 8.
-  // tmpbuf[3] is the length of the frame, including the command code byte,
+  // frame[3] is the length of the frame, including the command code byte,
   // the frame identifier byte and the status code byte.
   // So, adding 4 to this field gives us the data end index.
   // See the PN532 user manual, section 6.2.1.1, for more details.
-  uint8_t start_index = 8;
-  uint8_t stop_index = tmpbuf[3] + 4;
+  uint8_t status = frame[7];
+  uint8_t start_index = PN532_HEADER_LEN;
+  uint8_t stop_index = frame[3] + 4;
+  memcpy(frame, saved, PN532_HEADER_LEN);
+
+  if ((more != NULL ? status & ~0x40 : status) != 0)
+    return false;
+  if (more != NULL)
+    *more = (status & 0x40) != 0;
+
+  // Data starts at position 8, already in buffer.
+  if (stop_index >= size) // not read entirely
+    stop_index = size-1;
 
   if (stop_index < start_index)
     *len = 0;
   else
     *len = stop_index-start_index+1;
-  if (*len > 0)
-    memcpy(buffer, tmpbuf+start_index, *len);
-  free(tmpbuf);
   
   return true;
 }
@@ -26,22 +26,201 @@
 #include "apdu.h"
 #include "serial.h"
 #include "mycodes.h"
+#include "stats.h"
+#include "deadline.h"
+#include "statpage.h"
+#include "trace.h"
+#include "probes.h"
+#include "log.h"
+#include "loop.h"
 #include "main.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+// MYTERM_CONFIG flags accepted by the board
+static uint16_t configFlags = 0;
+
+// With MYTERM_CONFIG_PPSE, answer to the SELECT PPSE sent by the board
+// on its own when the last card was detected.
+static struct apduResponse ppseResponse;
+static bool ppsePending = false;
+
+// Card detected while apduConfigure or apduReleaseCard was waiting for
+// its answer, with the MYTERM_CONFIG flags of the board then: before
+// apduConfigure got its answer, the board had none.
+static uint8_t pendingCard[BUFFER_SIZE];
+static uint16_t pendingCardLength = 0;
+static bool cardPending = false;
+static uint16_t pendingCardFlags = 0;
+
+// Card in the field, from the MYTERM_CARDFOUND frame. ATQA, SAK and ATS
+// are only known with MYTERM_CONFIG_TARGETINFO or MYTERM_CONFIG_DUAL.
+struct apduCardInfo
+{
+	uint8_t uidLength;
+	uint8_t uid[APDU_MAX_UID];
+	bool targetInfo;	// atqa, sak and ats are set
+	uint8_t atqa[2];
+	uint8_t sak;
+	uint8_t atsLength;
+	uint8_t ats[APDU_MAX_ATS];
+	bool isoDep;		// can take APDUs
+};
+
+// Cards in the field, from the MYTERM_CARDFOUND frame (two at most, with
+// MYTERM_CONFIG_DUAL). Commands go to the current one.
+static struct apduCardInfo cards[APDU_MAX_CARDS];
+static int cardCount = 0;
+static int currentCard = 0;
+
+// Tagged requests (MYTERM_TAGGED) in flight. Answers may be read while
+// waiting for another request, so they are kept until asked for; those
+// of asynchronous requests (apduSubmit) go to their callback instead.
+struct apduTaggedSlot
+{
+	bool used;
+	bool received;
+	uint8_t tag;
+	bool async;
+	struct apduSession *session;	// NULL once closed: the answer is dropped
+	apduCompletion callback;
+	void *user;
+	struct statsRequest stats;
+	int serialPort;
+	uint8_t ins;
+	uint16_t deadline;
+	bool cut;	// by the session budget
+	struct timespec sent;
+	struct apduResponse response;
+};
+
+// Tagged window of a reader: each one has its own board, which answers
+// its requests one after the other.
+struct apduReader
+{
+	bool used;
+	int serialPort;
+	struct apduTaggedSlot slots[APDU_MAX_WINDOW];
+	struct timespec lastTaggedAnswer;
+	uint8_t nextTag;
+	int inFlight;
+};
+
+static struct apduReader readers[APDU_MAX_READERS];
+static uint8_t boardQueueLength = 0;	// from the MYTERM_CONFIG answer
+static int window = 1;	// of each reader
+
+// Asynchronous requests waiting for room in the window of the board
+struct apduQueued
+{
+	struct apduCommand cmd;
+	uint8_t data[BUFFER_SIZE];
+	apduCompletion callback;
+	void *user;
+};
+
+// Asynchronous requests to a card (see apduSessionOpen). The sessions of a
+// reader share its window, and take turns in it.
+struct apduSession
+{
+	bool used;
+	int serialPort;
+	int card;
+	int inFlight;
+	int queueHead;
+	int queueCount;
+	struct apduQueued queue[APDU_MAX_QUEUED];
+};
+
+static struct apduSession sessions[APDU_MAX_SESSIONS];
+
+// Latency of the command sent by apduSendCommand
+static struct statsRequest commandStats = {-1, {0, 0}};
+
+// Time budget of each session, from card detection, in ms (0 if none)
+static int sessionBudget = 0;
+
+static uint8_t PPSE_NAME[] = "2PAY.SYS.DDF01";
+static struct apduCommand ppseSelect = {0x00, 0xA4, 0x04, 0x00, sizeof(PPSE_NAME)-1, PPSE_NAME, 0x00, true};
+
+static int apduReadResponse(int serialPort, uint8_t *resdata, uint16_t *reslen, uint8_t *sw1,
+uint8_t *sw2, bool printErrors);
+static int apduFollowUp(int serialPort, struct apduCommand *cmd, struct apduResponse *response);
+
+// Sends MYTERM_HELLO at rate, and waits for the answer of a running board
+// or for the banner of a board which just started (forever if timeout is
+// negative). Frames left by the session of the last computer, or garbled
+// by a wrong rate, are skipped.
+static int apduHello(int serialPort, long rate, uint8_t *buffer, uint16_t *buflen, int timeout)
+{
+	uint16_t size = *buflen;
+	int res;
+	
+	if (!serialSetBaudrate(serialPort, rate))
+		return MYTERM_UNDEFERROR;
+	sendFrame(serialPort, MYTERM_HELLO, NULL, 0);
+	do
+	{
+		*buflen = size;
+		res = timeout < 0 ? waitResponse(serialPort, buffer, buflen)
+			: waitResponseTimeout(serialPort, buffer, buflen, timeout);
+	} while (res != MYTERM_HELLO && res != MYTERM_OK && res != MYTERM_NOTFOUND
+		&& res != MYTERM_TIMEOUT && res >= 0);
+	return res;
+}
 
 bool apduInitialize(int serialPort)
 {
+	static const long rates[] = {MYTERM_BAUD_DEFAULT, MYTERM_BAUD_RATES};
 	uint8_t buffer[BUFFER_SIZE];
-	uint8_t buflen = BUFFER_SIZE;
-	int res = 0;
+	uint16_t buflen = BUFFER_SIZE;
+	int res;
+	
+	// The banner of a board which just started may already be there:
+	// MYTERM_HELLO would end the session of a card already detected.
+	do
+	{
+		buflen = BUFFER_SIZE;
+		res = waitResponseTimeout(serialPort, buffer, &buflen, APDU_BANNER_TIMEOUT);
+	} while (res != MYTERM_OK && res != MYTERM_NOTFOUND && res != MYTERM_TIMEOUT && res >= 0);
+	
+	// A board already running answers MYTERM_HELLO right away, at the rate
+	// the last computer left it, then goes back to 115200.
+	for (unsigned int i=0; i<sizeof(rates)/sizeof(rates[0]) && res == MYTERM_TIMEOUT; i++)
+	{
+		buflen = BUFFER_SIZE;
+		res = apduHello(serialPort, rates[i], buffer, &buflen, APDU_HELLO_TIMEOUT);
+		if (res != MYTERM_HELLO && rates[i] != MYTERM_BAUD_DEFAULT)
+			res = MYTERM_TIMEOUT; // garbled
+	}
+	serialSetBaudrate(serialPort, MYTERM_BAUD_DEFAULT);
+	
+	// Otherwise, it is starting: Arduino checks the module connectivity,
+	// and returns an error if not found. Otherwise, it sends the chip
+	// model and version number. Its banner may have been missed while
+	// trying other rates, but then it answers MYTERM_HELLO.
+	if (res == MYTERM_TIMEOUT)
+	{
+		buflen = BUFFER_SIZE;
+		res = apduHello(serialPort, MYTERM_BAUD_DEFAULT, buffer, &buflen, -1);
+	}
 	
-	// When starting, Arduino checks the module connectivity,
-	// and returns an error if not found. Otherwise, it sends
-	// the chip model and version number.
-	switch (res = waitResponse(serialPort, buffer, &buflen))
+	switch (res)
 	{
+		case MYTERM_HELLO:
+			if (buflen < 4)
+			{
+				mycodesPrintStr(res,NULL);
+				return false;
+			}
+			printf("Found a PN5%02x chip. ", buffer[0]);
+			printf("Version %d.%d. ", buffer[1], buffer[2]);
+			printf(buffer[3] == MYTERM_HELLO_SESSION ? "Board interrupted in a session.\n"
+				: "Board already running.\n");
+		break;
 		case MYTERM_NOTFOUND:
 			fprintf(stderr,"No NFC module detected.\n");
 			return false;
@@ -58,93 +237,508 @@ bool apduInitialize(int serialPort)
 	return true;
 }
 
-bool apduWaitForCard(int serialPort)
+// Waits for the answer of the board to a setup frame (opcode). A card
+// may already be there: its frames are skipped until the answer, and its
+// detection is kept for apduWaitForCard. The PPSE answer which follows it
+// is skipped too, so readCard selects the PPSE again.
+static int apduWaitSetupAnswer(int serialPort, uint8_t opcode, uint8_t *buffer, uint16_t *buflen)
 {
-	uint8_t buffer[BUFFER_SIZE];
-	uint8_t buflen = BUFFER_SIZE;
+	uint16_t size = *buflen;
+	int res;
+	
+	do
+	{
+		*buflen = size;
+		res = waitResponseTimeout(serialPort, buffer, buflen, APDU_CONFIG_TIMEOUT);
+		if (res == MYTERM_CARDFOUND && *buflen <= sizeof(pendingCard))
+		{
+			memcpy(pendingCard, buffer, *buflen);
+			pendingCardLength = *buflen;
+			cardPending = true;
+			pendingCardFlags = configFlags & ~MYTERM_CONFIG_PPSE;
+		}
+		else if (res == MYTERM_CARDREMOVED)
+			cardPending = false;
+	} while (res != opcode && res != MYTERM_TIMEOUT && res >= 0);
+	return res;
+}
+
+// Enables optional board features (MYTERM_CONFIG_* flags). Returns the
+// ones the board accepted: older boards don't answer at all.
+uint16_t apduConfigure(int serialPort, uint16_t flags)
+{
+	uint8_t buffer[LONG_BUFFER_SIZE];
+	uint16_t buflen = LONG_BUFFER_SIZE;
+	uint8_t request[2] = {flags & 0xFF, flags >> 8};
+	
+	// The second byte of flags is only sent if needed, for older boards.
+	sendFrame(serialPort, MYTERM_CONFIG, request, (flags >> 8) ? 2 : 1);
+	if (apduWaitSetupAnswer(serialPort, MYTERM_CONFIG, buffer, &buflen) != MYTERM_CONFIG || buflen < 1)
+		return 0;
+	configFlags = buffer[0] | (buflen >= 5 ? buffer[4] << 8 : 0);
+	boardQueueLength = buflen >= 2 ? buffer[1] : 0;
+	
+	// The board uses 16-bit lengths, sequence numbers and CRC from the
+	// frame following its answer.
+	if ((configFlags & MYTERM_CONFIG_LONGFRAMES) && buflen >= 4)
+		serialSetLongFrames((buffer[2] << 8) | buffer[3]);
+	else
+		configFlags &= ~MYTERM_CONFIG_LONGFRAMES;
+	if (configFlags & MYTERM_CONFIG_CRC)
+		serialSetChecksums();
+	return configFlags & flags;
+}
+
+// Asks the board to move to rate, then checks the link at that rate.
+// Returns false if the board refused it, or if the link doesn't work: the
+// board then goes back to the old rate at the end of its probation.
+static bool apduTryBaudrate(int serialPort, long rate, long current)
+{
+	uint8_t request[4] = {rate >> 24, (rate >> 16) & 0xFF, (rate >> 8) & 0xFF, rate & 0xFF};
+	uint8_t buffer[LONG_BUFFER_SIZE];
+	uint16_t buflen = LONG_BUFFER_SIZE;
+	
+	// The board answers at the old rate, with the rate it switched to
+	// (0 if none).
+	sendFrame(serialPort, MYTERM_BAUD, request, sizeof(request));
+	if (apduWaitSetupAnswer(serialPort, MYTERM_BAUD, buffer, &buflen) != MYTERM_BAUD
+		|| buflen < 4 || memcmp(buffer, request, 4) != 0)
+		return false;
+	
+	if (serialSetBaudrate(serialPort, rate) && serialCheckLink(serialPort, APDU_BAUD_CHECK_TIMEOUT))
+	{
+		// An empty echo ends the probation of the board.
+		sendFrame(serialPort, MYTERM_ECHO, NULL, 0);
+		return true;
+	}
+	
+	// Going back right away: once its probation is over, the board may
+	// report a card at the old rate.
+	logMessage(LOG_MODULE_APDU, LOG_WARNING, "Link check failed at %ld baud", rate, 0);
+	serialSetBaudrate(serialPort, current);
+	usleep(MYTERM_BAUD_PROBATION*1000);
+	return false;
+}
+
+// Moves the link to the fastest rate up to maxRate that both the board
+// and the link support. Only done between two cards, with boards which
+// accepted MYTERM_CONFIG_BAUD. Returns the rate in use.
+long apduNegotiateBaudrate(int serialPort, long maxRate)
+{
+	static const long rates[] = {MYTERM_BAUD_RATES};
+	
+	if (!(configFlags & MYTERM_CONFIG_BAUD))
+		return MYTERM_BAUD_DEFAULT;
+	for (unsigned int i=0; i<sizeof(rates)/sizeof(rates[0]); i++)
+	{
+		// A card in the field: the board refuses until its session ends.
+		if (cardPending)
+			break;
+		if (rates[i] > maxRate)
+			continue;
+		if (apduTryBaudrate(serialPort, rates[i], MYTERM_BAUD_DEFAULT))
+			return rates[i];
+	}
+	return MYTERM_BAUD_DEFAULT;
+}
+
+// Reads the information of a card in a MYTERM_CARDFOUND frame, as sent
+// with MYTERM_CONFIG_TARGETINFO. Returns its length, 0 if malformed.
+static uint16_t apduParseTarget(const uint8_t *data, uint16_t length, struct apduCardInfo *c)
+{
+	uint16_t uidEnd = length >= 4 ? 4+data[3] : 0;
+	if (uidEnd == 0 || data[3] > APDU_MAX_UID || uidEnd >= length
+		|| data[uidEnd] > APDU_MAX_ATS || uidEnd+1+data[uidEnd] > length)
+		return 0;
+	
+	memset(c, 0, sizeof(struct apduCardInfo));
+	c->targetInfo = true;
+	c->atqa[0] = data[0];
+	c->atqa[1] = data[1];
+	c->sak = data[2];
+	c->isoDep = (c->sak & MYTERM_SAK_ISODEP) != 0;
+	c->uidLength = data[3];
+	memcpy(c->uid, data+4, c->uidLength);
+	c->atsLength = data[uidEnd];
+	memcpy(c->ats, data+uidEnd+1, c->atsLength);
+	return uidEnd+1+c->atsLength;
+}
+
+// Reads the data of a MYTERM_CARDFOUND frame in cards, sent with the
+// MYTERM_CONFIG flags given. Otherwise, it is only the UID of a single
+// card, which is taken as ISO-DEP. Returns the number of cards.
+static int apduParseCards(const uint8_t *data, uint16_t length, uint16_t flags)
+{
+	if (flags & MYTERM_CONFIG_DUAL)
+	{
+		int count = 0;
+		uint16_t pos = 1;
+		for (int i=0; length > 0 && i<data[0] && i<APDU_MAX_CARDS; i++)
+		{
+			uint16_t n = apduParseTarget(data+pos, length-pos, &cards[count]);
+			if (n == 0)
+				break;
+			pos += n;
+			count++;
+		}
+		if (count > 0)
+			return count;
+	}
+	else if ((flags & MYTERM_CONFIG_TARGETINFO) && apduParseTarget(data, length, &cards[0]) > 0)
+		return 1;
+	
+	if (flags & (MYTERM_CONFIG_TARGETINFO | MYTERM_CONFIG_DUAL))
+		logMessage(LOG_MODULE_APDU, LOG_WARNING, "Malformed card information (%ld bytes)", length, 0);
+	memset(&cards[0], 0, sizeof(struct apduCardInfo));
+	cards[0].isoDep = true;
+	cards[0].uidLength = length <= APDU_MAX_UID ? length : APDU_MAX_UID;
+	memcpy(cards[0].uid, data, cards[0].uidLength);
+	return 1;
+}
+
+// Name of the type of a card, from its SAK (NXP AN10833).
+static const char* apduCardType(const struct apduCardInfo *c)
+{
+	if (c->isoDep)
+		return "ISO-DEP";
+	switch (c->sak)
+	{
+		case 0x00: return "MIFARE Ultralight or NTAG";
+		case 0x08: return "MIFARE Classic 1K";
+		case 0x09: return "MIFARE Mini";
+		case 0x18: return "MIFARE Classic 4K";
+		default:   return "not ISO-DEP";
+	}
+}
+
+// Returns MYTERM_CARDFOUND, or the rescode received instead (negative on
+// serial port errors). Cards which are not ISO-DEP are found too, but
+// can't take APDUs (see apduCardIsoDep). With MYTERM_CONFIG_DUAL, two
+// cards may be found at once (see apduCardCount): commands go to the first
+// one until apduSelectCard.
+int apduWaitForCard(int serialPort)
+{
+	uint8_t buffer[LONG_BUFFER_SIZE];
+	uint16_t buflen = LONG_BUFFER_SIZE;
 	int res;
-	switch (res = waitResponse(serialPort, buffer, &buflen))
+	
+	statpageSetState(serialPort, STATPAGE_WAITCARD);
+	traceBegin("card detection");
+	APDU_PROBE1(card_wait, serialPort);
+	
+	// The frame follows the flags the board had when it found the card:
+	// before apduConfigure, no PPSE answer follows.
+	uint16_t flags = cardPending ? pendingCardFlags : configFlags;
+	if (cardPending)
+	{
+		res = MYTERM_CARDFOUND;
+		buflen = pendingCardLength;
+		memcpy(buffer, pendingCard, buflen);
+		cardPending = false;
+	}
+	else
+	{
+		// The previous card leaving, or a late answer to apduReleaseCard
+		do
+		{
+			buflen = LONG_BUFFER_SIZE;
+			res = waitResponse(serialPort, buffer, &buflen);
+			if (res == MYTERM_CARDREMOVED)
+				logMessage(LOG_MODULE_APDU, LOG_INFO, "Card removed", 0, 0);
+		} while (res == MYTERM_CARDREMOVED || res == MYTERM_RELEASE);
+	}
+	APDU_PROBE3(card_found, serialPort, res, buflen);
+	traceEnd("card detection");
+	
+	switch (res)
 	{
 		case MYTERM_CARDFOUND:
-			printf("Card detected! UID: ");
-			for (uint8_t i=0; i<buflen; i++)
-				printf("%02x",buffer[i]);
-			printf("\n");
+			deadlineSessionStart(sessionBudget);
+			cardCount = apduParseCards(buffer, buflen, flags);
+			currentCard = 0;
+			for (int c=0; c<cardCount; c++)
+			{
+				struct apduCardInfo *card = &cards[c];
+				statpageCardFound(serialPort, card->uid, card->uidLength);
+				printf("Card detected! UID: ");
+				for (uint16_t i=0; i<card->uidLength; i++)
+					printf("%02x",card->uid[i]);
+				printf("\n");
+				if (card->targetInfo)
+					printf("Card type: %s (ATQA %02x%02x, SAK %02x)\n", apduCardType(card),
+						card->atqa[0], card->atqa[1], card->sak);
+			}
+			
+			// The board already selected the PPSE on the first card, its
+			// answer follows, unless the card can't take APDUs.
+			if ((flags & MYTERM_CONFIG_PPSE) && cards[0].isoDep)
+			{
+				ppseResponse.length = LONG_BUFFER_SIZE;
+				ppseResponse.rescode = apduReadResponse(serialPort, ppseResponse.data,
+					&ppseResponse.length, &ppseResponse.sw1, &ppseResponse.sw2, false);
+				apduFollowUp(serialPort, &ppseSelect, &ppseResponse);
+				ppsePending = true;
+			}
 		break;
 		default:
 			mycodesPrintStr(res,NULL);
-			return false;
 		break;
 	}
+	return res;
+}
+
+// Sets the time budget of the next sessions, from card detection to
+// apduReleaseCard, in ms (0 for none). Commands get what is left of it at
+// most as their deadline, and are not sent any more once it is spent:
+// they fail with MYTERM_TIMEOUT, and the caller keeps what it got so far.
+void apduSetSessionBudget(int budget)
+{
+	sessionBudget = budget > 0 ? budget : 0;
+}
+
+// Whether the budget of the current session ran out before its end: the
+// results of the caller are then partial.
+bool apduSessionExpired(void)
+{
+	return deadlineSessionCut();
+}
+
+// Gets the answer to the SELECT PPSE sent by the board for the last card,
+// if any (the first one, with two cards). It can be taken only once.
+bool apduTakePpseResponse(struct apduResponse *response)
+{
+	if (!ppsePending || currentCard != 0)
+		return false;
+	memcpy(response, &ppseResponse, sizeof(struct apduResponse));
+	ppsePending = false;
 	return true;
 }
 
-void apduSendCommand(int serialPort, uint8_t cla, uint8_t ins, uint8_t p1,
-uint8_t p2, uint8_t lc, uint8_t *data, uint8_t le, bool isLePresent)
+// Copies the UID of the current card in uid (size bytes at most).
+// Returns its length, 0 if it doesn't fit.
+uint16_t apduCardUid(uint8_t *uid, uint16_t size)
+{
+	struct apduCardInfo *card = &cards[currentCard];
+	if (card->uidLength > size)
+		return 0;
+	memcpy(uid, card->uid, card->uidLength);
+	return card->uidLength;
+}
+
+// Whether the current card can take APDUs (ISO/IEC 14443-4). Only boards
+// supporting MYTERM_CONFIG_TARGETINFO tell: otherwise, it is taken as
+// such.
+bool apduCardIsoDep(void)
 {
-	const uint8_t PN532_WRITE_CMD[2] = {0x40,0x01};
-	int cmdlen = sizeof(PN532_WRITE_CMD)+4+lc;
-	if (isLePresent) cmdlen++;
-	if (lc > 0) cmdlen++;
+	return cards[currentCard].isoDep;
+}
 
-	uint8_t *buffer = (uint8_t*) malloc(sizeof(uint8_t)*cmdlen);
-	if (buffer == NULL)
-		return;
+// Number of cards found by the last apduWaitForCard.
+int apduCardCount(void)
+{
+	return cardCount;
+}
+
+// Sends the next commands to card index (from 0) of the last detection.
+// Requests already submitted keep their card: those of both cards may be
+// in flight together. Returns false if there is no such card.
+bool apduSelectCard(int index)
+{
+	if (index < 0 || index >= cardCount)
+		return false;
+	currentCard = index;
+	return true;
+}
+
+// Ends the session with the current card, so that the board looks for the
+// next one as soon as this one leaves (MYTERM_CARDREMOVED), instead of
+// waiting for its timeout. Returns false on serial port errors.
+bool apduReleaseCard(int serialPort)
+{
+	uint8_t buffer[LONG_BUFFER_SIZE];
+	uint16_t buflen;
+	int res;
+	
+	traceBegin("apduReleaseCard");
+	sendFrame(serialPort, MYTERM_RELEASE, NULL, 0);
+	
+	// Answers to commands are not expected any more. Older boards don't
+	// answer, but end the session with MYTERM_TIMEOUT. If frames were lost
+	// (MYTERM_READERROR), the answer may be among them: the next card
+	// must not be waited for here. apduWaitForCard skips a late answer.
+	// The session may also have ended already, as the board drops a card
+	// past its deadline: the next card is kept for apduWaitForCard.
+	do
+	{
+		buflen = LONG_BUFFER_SIZE;
+		res = waitResponseTimeout(serialPort, buffer, &buflen, APDU_RELEASE_TIMEOUT);
+		logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduReleaseCard buffer", buffer, buflen);
+	} while (res >= 0 && res != MYTERM_RELEASE && res != MYTERM_TIMEOUT
+		&& res != MYTERM_CARDREMOVED && res != MYTERM_READERROR && res != MYTERM_CARDFOUND);
+	if (res == MYTERM_CARDFOUND && buflen <= sizeof(pendingCard))
+	{
+		memcpy(pendingCard, buffer, buflen);
+		pendingCardLength = buflen;
+		cardPending = true;
+		pendingCardFlags = configFlags;
+	}
+	traceEndArg("apduReleaseCard", "rescode", res);
+	
+	deadlineSessionEnd();
+	statpageSetState(serialPort, STATPAGE_IDLE);
+	return res >= 0;
+}
+
+// Extended length fields are needed for more than 255 bytes of data, or
+// more than 256 bytes expected (ISO 7816-4, section 5.1).
+static bool apduIsExtended(struct apduCommand *cmd)
+{
+	return cmd->lc > 255 || (cmd->isLePresent && cmd->le > 256);
+}
+
+// Length of a command once encoded for the PN532
+static int apduCommandLength(struct apduCommand *cmd)
+{
+	bool extended = apduIsExtended(cmd);
+	int cmdlen = 2+4+cmd->lc; // PN532 InDataExchange header, then APDU
+	if (cmd->lc > 0)
+		cmdlen += extended ? 3 : 1;
+	if (cmd->isLePresent)
+		cmdlen += !extended ? 1 : cmd->lc > 0 ? 2 : 3;
+	return cmdlen;
+}
+
+// Time the card took to answer a command sent at sent, in ms. The board
+// runs the commands one after the other: it started on this one when it
+// was sent, or once the answer before came (lastAnswer), if later.
+static double apduServiceMs(const struct timespec *sent, const struct timespec *lastAnswer,
+const struct timespec *now)
+{
+	double fromSent = (now->tv_sec-sent->tv_sec)*1000.0 + (now->tv_nsec-sent->tv_nsec)/1e6;
+	double fromLast = (now->tv_sec-lastAnswer->tv_sec)*1000.0 + (now->tv_nsec-lastAnswer->tv_nsec)/1e6;
+	return fromLast < fromSent ? fromLast : fromSent;
+}
+
+// With MYTERM_CONFIG_DEADLINE, commands start with the time the card may
+// take, in ms (see deadline.c). Returns the length written in buffer.
+static int apduEncodeDeadline(uint16_t deadline, uint8_t *buffer)
+{
+	if (!(configFlags & MYTERM_CONFIG_DEADLINE))
+		return 0;
+	buffer[0] = deadline >> 8;
+	buffer[1] = deadline & 0xFF;
+	return 2;
+}
+
+// Encodes a command as an InDataExchange frame for the PN532, to card
+// (from 0; target number from 1).
+static void apduEncodeCommand(struct apduCommand *cmd, int card, uint8_t *buffer, int cmdlen)
+{
+	const uint8_t PN532_WRITE_CMD[2] = {0x40,card+1};
 	uint8_t *bufferApduCmd = buffer+sizeof(PN532_WRITE_CMD);
 
 	memcpy(buffer,PN532_WRITE_CMD,sizeof(PN532_WRITE_CMD));
-	bufferApduCmd[0] = cla;
-	bufferApduCmd[1] = ins;
-	bufferApduCmd[2] = p1;
-	bufferApduCmd[3] = p2;
+	bufferApduCmd[0] = cmd->cla;
+	bufferApduCmd[1] = cmd->ins;
+	bufferApduCmd[2] = cmd->p1;
+	bufferApduCmd[3] = cmd->p2;
 
-	if (lc > 0 && data != NULL)
+	bool extended = apduIsExtended(cmd);
+	int pos = 4;
+	if (cmd->lc > 0 && cmd->data != NULL)
 	{
-		bufferApduCmd[4] = lc;
-		memcpy(bufferApduCmd + 5, data, lc);
+		if (extended)
+		{
+			bufferApduCmd[pos++] = 0x00;
+			bufferApduCmd[pos++] = cmd->lc >> 8;
+		}
+		bufferApduCmd[pos++] = cmd->lc & 0xFF;
+		memcpy(bufferApduCmd + pos, cmd->data, cmd->lc);
 	}
 
-	if (isLePresent)
-		buffer[cmdlen-1] = le;
+	// Le = 256 (or 65536 when extended) is encoded as 0
+	if (cmd->isLePresent && extended)
+	{
+		if (cmd->lc == 0)
+			buffer[cmdlen-3] = 0x00;
+		buffer[cmdlen-2] = (cmd->le >> 8) & 0xFF;
+		buffer[cmdlen-1] = cmd->le & 0xFF;
+	}
+	else if (cmd->isLePresent)
+		buffer[cmdlen-1] = cmd->le & 0xFF;
+}
 
-	#ifdef LOGLEVEL_DEBUG
-	if (cmdlen == 0)
-		printf("Debug message: apduSendCommand buffer is empty!\n\n");
-	else
+// Sends a command. Returns false if it was not sent: there is no answer
+// to wait for then.
+bool apduSendCommand(int serialPort, uint8_t cla, uint8_t ins, uint8_t p1,
+uint8_t p2, uint16_t lc, uint8_t *data, unsigned int le, bool isLePresent)
+{
+	struct apduCommand cmd = {cla, ins, p1, p2, lc, data, le, isLePresent};
+	int cmdlen = apduCommandLength(&cmd);
+	int framelen = cmdlen + ((configFlags & MYTERM_CONFIG_DEADLINE) ? 2 : 0);
+	if (framelen > serialMaxFrameLength())
 	{
-		printf("Debug message: apduSendCommand buffer content\n\n");
-		printf("\t");
-		for (int x=0; x<cmdlen; x++)
-			printf("0x%02X ",buffer[x]);
-		printf("\n\n");
+		fprintf(stderr, "APDU too long for the board (%d bytes)!\n", cmdlen);
+		return false;
 	}
-	#endif
+	uint8_t *buffer = (uint8_t*) malloc(sizeof(uint8_t)*framelen);
+	if (buffer == NULL)
+		return false;
+
+	// Nothing is sent once the session budget is spent
+	uint16_t deadline = deadlineBegin(serialPort, ins);
+	if (deadline == 0)
+	{
+		logMessage(LOG_MODULE_APDU, LOG_INFO, "Session budget spent, INS %02lx not sent", ins, 0);
+		deadlineEnd(serialPort, MYTERM_TIMEOUT);
+		free(buffer);
+		return false;
+	}
+	
+	traceBeginArg("apduSendCommand", "ins", ins);
+	int pos = apduEncodeDeadline(deadline, buffer);
+	apduEncodeCommand(&cmd, currentCard, buffer+pos, cmdlen);
+
+	logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduSendCommand buffer", buffer, framelen);
 	
-	sendCommand(serialPort, buffer, cmdlen);
+	statsRecordCommand(&commandStats, ins);
+	statpageCommandSent(serialPort, ins);
+	APDU_PROBE6(apdu_command, serialPort, cla, ins, p1, p2, lc);
+	sendCommand(serialPort, buffer, framelen);
 	free(buffer);
+	traceEnd("apduSendCommand");
+	return true;
 }
 
-int apduWaitForResponse(int serialPort, uint8_t *resdata, uint8_t *reslen, uint8_t *sw1, uint8_t *sw2)
+// Reads the answer to a command. Status words other than 9000 are
+// printed if printErrors is set. With MYTERM_CONFIG_DEADLINE, the board
+// gives up on the card at the deadline of the command, so the answer is
+// not waited for much longer; nor past the session budget, if any.
+static int apduReadResponse(int serialPort, uint8_t *resdata, uint16_t *reslen, uint8_t *sw1,
+uint8_t *sw2, bool printErrors)
 {
-	uint8_t buffer[BUFFER_SIZE];
-	uint8_t buflen = BUFFER_SIZE;
-	int res = waitResponse(serialPort, buffer, &buflen);
-	
-	#ifdef LOGLEVEL_DEBUG
-	if (buflen == 0)
-		printf("Debug message: apduWaitForResponse buffer is empty!\n\n");
+	uint8_t buffer[LONG_BUFFER_SIZE];
+	uint16_t buflen = LONG_BUFFER_SIZE;
+	int timeout = deadlineWaitTimeout();
+	if (!(configFlags & MYTERM_CONFIG_DEADLINE) && deadlineSessionLeft() < 0)
+		timeout = -1;
+	traceBegin("apduWaitForResponse");
+	int res = MYTERM_TIMEOUT;
+	if (timeout == 0) // not sent
+		buflen = 0;
 	else
-	{
-		printf("Debug message: apduWaitForResponse buffer content\n\n");
-		printf("\t");
-		for (uint8_t j=0; j<buflen; j++)
-			printf("0x%02X ",buffer[j]);
-		printf("\n\n");
-	}
-	#endif
+		res = timeout < 0 ? waitResponse(serialPort, buffer, &buflen)
+			: waitResponseTimeout(serialPort, buffer, &buflen, timeout);
+	deadlineEnd(serialPort, res);
+	
+	logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduWaitForResponse buffer", buffer, buflen);
 	
 	if (res != MYTERM_OK)
 	{
+		statsRecordResponse(&commandStats, res, false, 0, 0);
+		statpageResponse(serialPort, res, false, 0, 0);
+		traceEndArg("apduWaitForResponse", "rescode", res);
+		APDU_PROBE4(apdu_response, serialPort, res, buflen, -1);
 		mycodesPrintStr(res,NULL);
 		if (reslen != NULL) *reslen = 0;
 		return res;
@@ -154,7 +748,12 @@ int apduWaitForResponse(int serialPort, uint8_t *resdata, uint8_t *reslen, uint8
 	uint8_t _sw1 = buffer[buflen-2];
 	uint8_t _sw2 = buffer[buflen-1];
 	
-	if (_sw1 != APDU_SW1_OK || _sw2 != APDU_SW2_OK)
+	statsRecordResponse(&commandStats, res, true, _sw1, _sw2);
+	statpageResponse(serialPort, res, true, _sw1, _sw2);
+	traceEndArg("apduWaitForResponse", "sw", (_sw1 << 8) | _sw2);
+	APDU_PROBE4(apdu_response, serialPort, res, buflen, (_sw1 << 8) | _sw2);
+	
+	if (printErrors && (_sw1 != APDU_SW1_OK || _sw2 != APDU_SW2_OK))
 		apduPrintError(_sw1,_sw2);
 	
 	// Copy the response code if needed
@@ -168,9 +767,820 @@ int apduWaitForResponse(int serialPort, uint8_t *resdata, uint8_t *reslen, uint8
 		*reslen = buflen-2;
 		memcpy(resdata, buffer, *reslen);
 	}
+	else if (reslen != NULL) // doesn't fit
+		*reslen = 0;
 	return res;
 }
 
+int apduWaitForResponse(int serialPort, uint8_t *resdata, uint16_t *reslen, uint8_t *sw1, uint8_t *sw2)
+{
+	return apduReadResponse(serialPort, resdata, reslen, sw1, sw2, true);
+}
+
+// Completes a response ending with 61xx (more data, fetched with GET
+// RESPONSE) or 6Cxx (wrong Le, the last command is sent again with the
+// right one), as T=0 cards require (ISO 7816-4, section 5.1.3). The data
+// chunks are appended to the response. Boards with MYTERM_CONFIG_CHAIN
+// do it by themselves. Final status words other than 9000 are printed.
+// It stops when the card makes no progress: a 6Cxx asking for the Le just
+// sent, or a GET RESPONSE bringing no data, leaves the answer as it is.
+// Returns the rescode of the last answer.
+static int apduFollowUp(int serialPort, struct apduCommand *cmd, struct apduResponse *response)
+{
+	struct apduCommand last = *cmd;
+	
+	for (int i=0; i<APDU_MAX_CHAINING && response->rescode == MYTERM_OK; i++)
+	{
+		unsigned int le = response->sw2 == 0 ? 256 : response->sw2;
+		if (response->sw1 == 0x61)
+		{
+			struct apduCommand getResponse = {cmd->cla & 0x03, 0xC0, 0x00, 0x00, 0, NULL, le, true};
+			last = getResponse;
+		}
+		else if (response->sw1 == 0x6C && (!last.isLePresent || (last.le == 0 ? 256 : last.le) != le))
+		{
+			last.le = le;
+			last.isLePresent = true;
+		}
+		else
+			break;
+		
+		// 6Cxx answers carry no data: the chunks so far are kept either way.
+		uint16_t offset = response->length;
+		uint16_t chunk = LONG_BUFFER_SIZE-offset;
+		traceBeginArg("apduFollowUp", "sw", (response->sw1 << 8) | response->sw2);
+		if (!apduSendCommand(serialPort, last.cla, last.ins, last.p1, last.p2, last.lc, last.data,
+			last.le, last.isLePresent))
+		{
+			response->rescode = apduSessionExpired() ? MYTERM_TIMEOUT : MYTERM_WRITEERROR;
+			mycodesPrintStr(response->rescode, NULL);
+			traceEnd("apduFollowUp");
+			break;
+		}
+		response->rescode = apduReadResponse(serialPort, response->data+offset, &chunk,
+			&response->sw1, &response->sw2, false);
+		response->length = offset + (response->rescode == MYTERM_OK ? chunk : 0);
+		traceEnd("apduFollowUp");
+		if (response->rescode == MYTERM_OK && last.ins == 0xC0 && chunk == 0)
+			break;
+	}
+	
+	if (response->rescode == MYTERM_OK
+		&& (response->sw1 != APDU_SW1_OK || response->sw2 != APDU_SW2_OK))
+		apduPrintError(response->sw1, response->sw2);
+	return response->rescode;
+}
+
+// Sends a command and waits for the whole answer, following 61xx and
+// 6Cxx status words (see apduFollowUp). Returns the rescode.
+int apduTransceive(int serialPort, struct apduCommand *cmd, struct apduResponse *response)
+{
+	response->length = LONG_BUFFER_SIZE;
+	response->sw1 = 0;
+	response->sw2 = 0;
+	if (!apduSendCommand(serialPort, cmd->cla, cmd->ins, cmd->p1, cmd->p2, cmd->lc, cmd->data,
+		cmd->le, cmd->isLePresent))
+	{
+		response->rescode = apduSessionExpired() ? MYTERM_TIMEOUT : MYTERM_WRITEERROR;
+		response->length = 0;
+		mycodesPrintStr(response->rescode, NULL);
+		return response->rescode;
+	}
+	response->rescode = apduReadResponse(serialPort, response->data, &response->length,
+		&response->sw1, &response->sw2, false);
+	return apduFollowUp(serialPort, cmd, response);
+}
+
+// Sends several commands in MYTERM_BATCH frames: the board runs them
+// back to back, and returns their responses packed together, saving one
+// serial round trip per command. Commands are split in as many frames
+// as needed. With MYTERM_BATCH_STOPONERROR, the batch stops after the
+// first response which is not 9000.
+// Returns the number of responses filled, which is lower than count if
+// the batch was stopped or failed (see the rescode of the last one).
+int apduSendBatch(int serialPort, struct apduCommand *commands, int count,
+uint8_t flags, struct apduResponse *responses)
+{
+	int done = 0;
+	
+	traceBeginArg("apduSendBatch", "count", count);
+	while (done < count)
+	{
+		if (deadlineSessionOver())
+		{
+			responses[done].rescode = MYTERM_TIMEOUT;
+			responses[done].length = 0;
+			done++;
+			break;
+		}
+		
+		uint8_t frame[LONG_BUFFER_SIZE];
+		uint16_t header = 2 + apduEncodeDeadline(0, frame+2);
+		uint16_t framelen = header;
+		uint16_t deadline = 0;
+		bool cut = false;	// by the session budget
+		int sent = 0;
+		
+		// Pack as many commands as possible in the frame. They all get
+		// the longest of their deadlines.
+		while (done+sent < count)
+		{
+			struct apduCommand *cmd = &commands[done+sent];
+			int cmdlen = apduCommandLength(cmd);
+			if (framelen+1+cmdlen > BUFFER_SIZE)
+				break;
+			
+			frame[framelen++] = cmdlen;
+			apduEncodeCommand(cmd, currentCard, frame+framelen, cmdlen);
+			framelen += cmdlen;
+			
+			bool c;
+			uint16_t d = deadlineFor(serialPort, cmd->ins, &c);
+			if (d > deadline)
+				deadline = d;
+			cut = cut || c;
+			statpageCommandSent(serialPort, cmd->ins);
+			APDU_PROBE6(apdu_command, serialPort, cmd->cla, cmd->ins, cmd->p1, cmd->p2, cmd->lc);
+			sent++;
+		}
+		if (sent == 0) // command too long for a frame
+			break;
+		
+		frame[0] = flags;
+		frame[1] = sent;
+		apduEncodeDeadline(deadline, frame+2);
+		logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduSendBatch buffer", frame, framelen);
+		// The latency of each command is taken from the frame sent. The
+		// deadlines learn the time each took, from the answer frames.
+		struct statsRequest frameStats;
+		statsRecordCommand(&frameStats, 0);
+		struct timespec lastFrame = frameStats.start;
+		sendFrame(serialPort, MYTERM_BATCH, frame, framelen);
+		
+		// Responses may come in several frames
+		int received = 0;
+		bool more = true;
+		while (more)
+		{
+			uint16_t buflen = LONG_BUFFER_SIZE;
+			int res = waitResponse(serialPort, frame, &buflen);
+			logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduSendBatch response", frame, buflen);
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double ms = apduServiceMs(&frameStats.start, &lastFrame, &now);
+			lastFrame = now;
+			
+			if (res != MYTERM_BATCH || buflen < 2)
+			{
+				statpageResponse(serialPort, res, false, 0, 0);
+				mycodesPrintStr(res,NULL);
+				if (done+received < count)
+				{
+					struct statsRequest req = {commands[done+received].ins, frameStats.start};
+					statsRecordResponse(&req, res, false, 0, 0);
+					deadlineRecord(serialPort, commands[done+received].ins, deadline, cut, res, ms);
+					responses[done+received].rescode = res;
+					responses[done+received].length = 0;
+					received++;
+				}
+				else
+					statsRecordResponse(NULL, res, false, 0, 0);
+				traceEnd("apduSendBatch");
+				return done+received;
+			}
+			
+			more = (frame[0] & MYTERM_BATCH_MORE) != 0;
+			uint16_t pos = 2;
+			for (uint8_t i=0; i<frame[1] && done+received < count; i++)
+			{
+				if (pos+2 > buflen || pos+2+frame[pos+1] > buflen) // truncated frame
+					break;
+				
+				struct apduResponse *r = &responses[done+received];
+				uint8_t len = frame[pos+1];
+				r->rescode = frame[pos];
+				r->sw1 = 0;
+				r->sw2 = 0;
+				r->length = 0;
+				if (r->rescode == MYTERM_OK && len >= 2)
+				{
+					r->sw1 = frame[pos+2+len-2];
+					r->sw2 = frame[pos+2+len-1];
+					r->length = len-2;
+					memcpy(r->data, frame+pos+2, r->length);
+				}
+				pos += 2+len;
+				received++;
+				
+				bool hasSw = r->rescode == MYTERM_OK && len >= 2;
+				struct statsRequest req = {commands[done+received-1].ins, frameStats.start};
+				statsRecordResponse(&req, r->rescode, hasSw, r->sw1, r->sw2);
+				deadlineRecord(serialPort, commands[done+received-1].ins, deadline, cut,
+					r->rescode, ms/frame[1]);
+				statpageResponse(serialPort, r->rescode, hasSw, r->sw1, r->sw2);
+				APDU_PROBE4(apdu_response, serialPort, r->rescode, len, hasSw ? (r->sw1 << 8) | r->sw2 : -1);
+			}
+		}
+		
+		done += received;
+		
+		// Boards without MYTERM_CONFIG_CHAIN leave 61xx and 6Cxx answers.
+		// Only the last one can be followed: the card dropped the others.
+		if (received > 0 && responses[done-1].rescode == MYTERM_OK
+			&& (responses[done-1].sw1 == 0x61 || responses[done-1].sw1 == 0x6C))
+		{
+			struct apduResponse *r = &responses[done-1];
+			apduFollowUp(serialPort, &commands[done-1], r);
+			if (received < sent && r->rescode == MYTERM_OK && r->sw1 == APDU_SW1_OK && r->sw2 == APDU_SW2_OK)
+				continue; // stopped on it
+		}
+		if (received < sent)
+			break;
+	}
+	traceEnd("apduSendBatch");
+	return done;
+}
+
+// Sets how many tagged requests may be in flight, on each reader. It is bounded by the
+// queue of the board, and is 1 if the board doesn't accept MYTERM_TAGGED
+// frames (see apduConfigure). Returns the window actually used.
+int apduSetWindow(int requested)
+{
+	window = requested;
+	if (window > APDU_MAX_WINDOW)
+		window = APDU_MAX_WINDOW;
+	if (window > boardQueueLength)
+		window = boardQueueLength;
+	if (window < 1 || (configFlags & MYTERM_CONFIG_TAGGED) == 0)
+		window = 1;
+	return window;
+}
+
+// Finds the tagged window of a reader, claiming a free one the first
+// time. Returns NULL if there are too many readers.
+static struct apduReader* apduFindReader(int serialPort)
+{
+	struct apduReader *free_reader = NULL;
+	for (int i=0; i<APDU_MAX_READERS; i++)
+	{
+		if (readers[i].used && readers[i].serialPort == serialPort)
+			return &readers[i];
+		if (!readers[i].used && free_reader == NULL)
+			free_reader = &readers[i];
+	}
+	if (free_reader != NULL)
+	{
+		memset(free_reader, 0, sizeof(struct apduReader));
+		free_reader->used = true;
+		free_reader->serialPort = serialPort;
+	}
+	return free_reader;
+}
+
+static struct apduTaggedSlot* apduFindTag(int serialPort, int tag)
+{
+	struct apduReader *reader = apduFindReader(serialPort);
+	for (int i=0; reader != NULL && i<APDU_MAX_WINDOW; i++)
+		if (reader->slots[i].used && reader->slots[i].tag == tag)
+			return &reader->slots[i];
+	return NULL;
+}
+
+// Sends a tagged request to card. Returns its slot, or NULL if the
+// window is full or the session budget spent.
+static struct apduTaggedSlot* apduSendTagged(int serialPort, int card, struct apduCommand *cmd)
+{
+	uint8_t frame[BUFFER_SIZE];
+	int cmdlen = apduCommandLength(cmd);
+	int header = 1 + ((configFlags & MYTERM_CONFIG_DEADLINE) ? 2 : 0); // tag, deadline
+	struct apduReader *reader = apduFindReader(serialPort);
+	struct apduTaggedSlot *slot = NULL;
+	
+	if (reader == NULL || reader->inFlight >= window || header+cmdlen > BUFFER_SIZE || deadlineSessionOver())
+		return NULL;
+	for (int i=0; i<APDU_MAX_WINDOW && slot == NULL; i++)
+		if (!reader->slots[i].used)
+			slot = &reader->slots[i];
+	if (slot == NULL)
+		return NULL;
+	
+	slot->used = true;
+	slot->received = false;
+	slot->async = false;
+	slot->session = NULL;
+	slot->callback = NULL;
+	slot->tag = reader->nextTag++;
+	reader->inFlight++;
+	
+	slot->serialPort = serialPort;
+	slot->ins = cmd->ins;
+	slot->deadline = deadlineFor(serialPort, cmd->ins, &slot->cut);
+	clock_gettime(CLOCK_MONOTONIC, &slot->sent);
+	
+	frame[0] = slot->tag;
+	apduEncodeDeadline(slot->deadline, frame+1);
+	apduEncodeCommand(cmd, card, frame+header, cmdlen);
+	logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduSubmitCommand buffer", frame, header+cmdlen);
+	
+	statsRecordCommand(&slot->stats, cmd->ins);
+	statpageCommandSent(serialPort, cmd->ins);
+	APDU_PROBE6(apdu_command, serialPort, cmd->cla, cmd->ins, cmd->p1, cmd->p2, cmd->lc);
+	sendFrame(serialPort, MYTERM_TAGGED, frame, header+cmdlen);
+	return slot;
+}
+
+// Sends a command without waiting for its answer. Returns the tag to give
+// to apduWaitForTagged, or -1 if the window is full or the session budget
+// spent.
+int apduSubmitCommand(int serialPort, struct apduCommand *cmd)
+{
+	struct apduTaggedSlot *slot = apduSendTagged(serialPort, currentCard, cmd);
+	return slot != NULL ? slot->tag : -1;
+}
+
+// Fills an answer, and counts it. req is the latency measure of its
+// command, if any.
+static void apduFillTagged(int serialPort, struct statsRequest *req, struct apduResponse *r,
+int rescode, uint8_t *data, uint16_t len)
+{
+	bool hasSw = rescode == MYTERM_OK && len >= 2;
+	
+	r->rescode = rescode;
+	r->length = 0;
+	r->sw1 = 0;
+	r->sw2 = 0;
+	if (hasSw)
+	{
+		r->sw1 = data[len-2];
+		r->sw2 = data[len-1];
+		r->length = len-2;
+		memcpy(r->data, data, r->length);
+	}
+	statsRecordResponse(req, rescode, hasSw, r->sw1, r->sw2);
+	statpageResponse(serialPort, rescode, hasSw, r->sw1, r->sw2);
+	APDU_PROBE4(apdu_response, serialPort, rescode, len, hasSw ? (r->sw1 << 8) | r->sw2 : -1);
+}
+
+// Fills the answer to a tagged request. Asynchronous ones are completed at
+// once, and their slot freed.
+static void apduDeliverTagged(int serialPort, struct apduTaggedSlot *slot, int rescode,
+uint8_t *data, uint16_t len)
+{
+	struct apduReader *reader = apduFindReader(serialPort);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	deadlineRecord(serialPort, slot->ins, slot->deadline, slot->cut, rescode,
+		apduServiceMs(&slot->sent, &reader->lastTaggedAnswer, &now));
+	reader->lastTaggedAnswer = now;
+	
+	apduFillTagged(serialPort, &slot->stats, &slot->response, rescode, data, len);
+	slot->received = true;
+	if (!slot->async)
+		return;
+	
+	struct apduSession *session = slot->session;
+	if (session != NULL)
+		session->inFlight--;
+	if (slot->callback != NULL)
+		slot->callback(&slot->response, slot->user);
+	slot->used = false;
+	reader->inFlight--;
+}
+
+// Completes the queued asynchronous requests of the reader with rescode.
+static void apduFailQueued(int serialPort, int rescode)
+{
+	for (int i=0; i<APDU_MAX_SESSIONS; i++)
+	{
+		struct apduSession *session = &sessions[i];
+		while (session->used && session->serialPort == serialPort && session->queueCount > 0)
+		{
+			struct apduQueued *q = &session->queue[session->queueHead];
+			session->queueHead = (session->queueHead+1) % APDU_MAX_QUEUED;
+			session->queueCount--;
+			struct apduResponse response;
+			apduFillTagged(serialPort, NULL, &response, rescode, NULL, 0);
+			q->callback(&response, q->user);
+		}
+	}
+}
+
+// Anything else than a tagged answer ends the session: no more answer
+// will come, to the requests of the reader in flight or queued.
+static void apduFailTagged(int serialPort, int rescode)
+{
+	struct apduReader *reader = apduFindReader(serialPort);
+	mycodesPrintStr(rescode,NULL);
+	for (int i=0; reader != NULL && i<APDU_MAX_WINDOW; i++)
+		if (reader->slots[i].used && !reader->slots[i].received)
+			apduDeliverTagged(serialPort, &reader->slots[i], rescode, NULL, 0);
+	apduFailQueued(serialPort, rescode);
+}
+
+// Reads the next frame, and hands it out to its tagged request. Returns
+// its rescode (negative on serial port errors).
+static int apduReadTagged(int serialPort, int timeout)
+{
+	uint8_t buffer[LONG_BUFFER_SIZE];
+	uint16_t buflen = LONG_BUFFER_SIZE;
+	int res = timeout < 0 ? waitResponse(serialPort, buffer, &buflen)
+		: waitResponseTimeout(serialPort, buffer, &buflen, timeout);
+	logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduWaitForTagged buffer", buffer, buflen);
+	
+	if (res == MYTERM_TAGGED && buflen >= 2)
+	{
+		struct apduTaggedSlot *s = apduFindTag(serialPort, buffer[0]);
+		if (s != NULL && !s->received) // else, answer to nothing
+			apduDeliverTagged(serialPort, s, buffer[1], buffer+2, buflen-2);
+		return res;
+	}
+	apduFailTagged(serialPort, res);
+	return res;
+}
+
+// Sends the queued asynchronous requests of the reader while its window
+// has room, one session after the other. Once the session budget is
+// spent, they fail with MYTERM_TIMEOUT, as nothing would be sent.
+static void apduSendQueued(int serialPort)
+{
+	bool sent = true;
+	while (sent)
+	{
+		sent = false;
+		for (int i=0; i<APDU_MAX_SESSIONS; i++)
+		{
+			struct apduSession *session = &sessions[i];
+			if (!session->used || session->serialPort != serialPort || session->queueCount == 0)
+				continue;
+			if (deadlineSessionOver())
+			{
+				apduFailQueued(serialPort, MYTERM_TIMEOUT);
+				return;
+			}
+			
+			struct apduQueued *q = &session->queue[session->queueHead];
+			struct apduTaggedSlot *slot = apduSendTagged(serialPort, session->card, &q->cmd);
+			if (slot == NULL)
+				return;
+			slot->async = true;
+			slot->session = session;
+			slot->callback = q->callback;
+			slot->user = q->user;
+			session->inFlight++;
+			session->queueHead = (session->queueHead+1) % APDU_MAX_QUEUED;
+			session->queueCount--;
+			sent = true;
+		}
+	}
+}
+
+// How long the answer to a tagged request may still be waited for, in ms.
+// As for apduReadResponse, it is not much longer than the deadline of the
+// command, counted from when the board could start on it. -1 if the board
+// doesn't give up on the card, and there is no session budget.
+static int apduTaggedTimeout(struct apduTaggedSlot *slot)
+{
+	if (!(configFlags & MYTERM_CONFIG_DEADLINE) && deadlineSessionLeft() < 0)
+		return -1;
+	
+	struct apduReader *reader = apduFindReader(slot->serialPort);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double left = slot->deadline + DEADLINE_MARGIN - apduServiceMs(&slot->sent, &reader->lastTaggedAnswer, &now);
+	return left > 0 ? (int) left : 0;
+}
+
+// Waits for the answer to a tagged request. Answers to other requests
+// read meanwhile are kept for later. Past its timeout (see
+// apduTaggedTimeout), no more answer is expected, to any request. Returns
+// the rescode of the answer.
+int apduWaitForTagged(int serialPort, int tag, struct apduResponse *response)
+{
+	struct apduTaggedSlot *slot = apduFindTag(serialPort, tag);
+	if (slot == NULL || slot->async)
+		return MYTERM_UNDEFERROR;
+	
+	traceBeginArg("apduWaitForTagged", "tag", tag);
+	while (!slot->received)
+		apduReadTagged(serialPort, apduTaggedTimeout(slot));
+	
+	memcpy(response, &slot->response, sizeof(struct apduResponse));
+	slot->used = false;
+	apduFindReader(serialPort)->inFlight--;
+	apduSendQueued(serialPort);
+	traceEndArg("apduWaitForTagged", "rescode", response->rescode);
+	return response->rescode;
+}
+
+static void apduLoopHandler(int fd, void *ctx)
+{
+	(void) ctx;
+	apduPoll(fd);
+}
+
+// Opens a session of asynchronous requests to the current card (see
+// apduSelectCard) of the reader on serialPort, which the event loop (see
+// loopOpen) then watches. Requests go through the tagged window (see
+// apduSetWindow), so the board must accept MYTERM_CONFIG_TAGGED. Returns
+// NULL if there is no room for it.
+struct apduSession* apduSessionOpen(int serialPort)
+{
+	struct apduSession *session = NULL;
+	bool watched = false;
+	
+	for (int i=0; i<APDU_MAX_SESSIONS; i++)
+	{
+		if (sessions[i].used && sessions[i].serialPort == serialPort)
+			watched = true;
+		else if (!sessions[i].used && session == NULL)
+			session = &sessions[i];
+	}
+	if (session == NULL || (configFlags & MYTERM_CONFIG_TAGGED) == 0)
+		return NULL;
+	if (!watched && !loopWatch(serialPort, apduLoopHandler, NULL))
+		return NULL;
+	
+	memset(session, 0, sizeof(struct apduSession));
+	session->used = true;
+	session->serialPort = serialPort;
+	session->card = currentCard;
+	return session;
+}
+
+// Closes a session. Its queued requests are dropped without completion,
+// and the answers to those in flight, when they come.
+void apduSessionClose(struct apduSession *session)
+{
+	if (session == NULL || !session->used)
+		return;
+	struct apduReader *reader = apduFindReader(session->serialPort);
+	for (int i=0; reader != NULL && i<APDU_MAX_WINDOW; i++)
+	{
+		if (reader->slots[i].used && reader->slots[i].session == session)
+		{
+			reader->slots[i].session = NULL;
+			reader->slots[i].callback = NULL;
+		}
+	}
+	session->used = false;
+	
+	for (int i=0; i<APDU_MAX_SESSIONS; i++)
+		if (sessions[i].used && sessions[i].serialPort == session->serialPort)
+			return;
+	loopUnwatch(session->serialPort);
+}
+
+// Requests of a session which were not completed yet.
+int apduSessionPending(struct apduSession *session)
+{
+	return session->inFlight + session->queueCount;
+}
+
+// Submits a command, without waiting: callback gets its answer later, from
+// the event loop (see loopRun), with user. The command is copied; it
+// waits in the queue of the session while the window is full. Returns
+// false if it can't be queued, or if the session budget is spent.
+bool apduSubmit(struct apduSession *session, struct apduCommand *cmd, apduCompletion callback, void *user)
+{
+	if (session == NULL || !session->used || callback == NULL || cmd->lc > BUFFER_SIZE
+		|| 3+apduCommandLength(cmd) > BUFFER_SIZE // tag, deadline
+		|| session->queueCount == APDU_MAX_QUEUED || deadlineSessionOver())
+		return false;
+	
+	struct apduQueued *q = &session->queue[(session->queueHead+session->queueCount) % APDU_MAX_QUEUED];
+	q->cmd = *cmd;
+	if (cmd->lc > 0)
+		memcpy(q->data, cmd->data, cmd->lc);
+	q->cmd.data = q->data;
+	q->callback = callback;
+	q->user = user;
+	session->queueCount++;
+	apduSendQueued(session->serialPort);
+	return true;
+}
+
+// Reads the frames already received from the board, and completes the
+// asynchronous requests they answer. Queued requests then take the room
+// left in the window. Returns the number of frames read, -1 on serial
+// port errors.
+int apduPoll(int serialPort)
+{
+	int frames = 0;
+	while (serialReadable(serialPort))
+	{
+		if (apduReadTagged(serialPort, APDU_FRAME_TIMEOUT) < 0)
+			return -1;
+		frames++;
+	}
+	apduSendQueued(serialPort);
+	return frames;
+}
+
+// Runs the event loop once (see loopRun), no longer than the answers to
+// the asynchronous requests in flight may still be waited for. Once one
+// of them is late, those of its reader are all completed with
+// MYTERM_TIMEOUT, as in apduWaitForTagged. Returns as loopRun.
+int apduRunLoop(void)
+{
+	struct apduTaggedSlot *late = NULL;
+	int timeout = -1;
+	for (int r=0; r<APDU_MAX_READERS; r++)
+	{
+		for (int i=0; readers[r].used && i<APDU_MAX_WINDOW; i++)
+		{
+			struct apduTaggedSlot *slot = &readers[r].slots[i];
+			if (!slot->used || slot->received || !slot->async)
+				continue;
+			int t = apduTaggedTimeout(slot);
+			if (t >= 0 && (timeout < 0 || t < timeout))
+			{
+				timeout = t;
+				late = slot;
+			}
+		}
+	}
+	
+	int n = loopRun(timeout);
+	if (n == 0 && late != NULL && late->used && !late->received && apduTaggedTimeout(late) == 0)
+		apduFailTagged(late->serialPort, MYTERM_TIMEOUT);
+	return n;
+}
+
+// READ BINARY of size bytes at offset. The first command of a read by
+// SFI selects the file, the next ones read the current EF.
+static void apduBinaryCommand(struct apduCommand *cmd, uint8_t sfi, unsigned int offset,
+unsigned int size)
+{
+	bool bySfi = sfi != 0 && offset == 0;
+	struct apduCommand c = {0x00, 0xB0, bySfi ? 0x80 | sfi : (offset >> 8) & 0x7F, offset & 0xFF,
+		0, NULL, size, true};
+	*cmd = c;
+}
+
+// Reads a transparent EF with READ BINARY, by chunks as large as the
+// frames allow, and gives each chunk to callback as soon as it comes:
+// the file is never buffered as a whole. With a SFI (1 to 30), the file
+// is selected by the first command, else the current EF is read. Reads
+// until the end of the file if length is 0.
+// With a window above 1 (see apduSetWindow), the next chunks are asked
+// for before the callback processes the current one.
+// Returns the number of bytes read, or -1 if a command failed before the
+// end of the file.
+int apduReadBinary(int serialPort, uint8_t sfi, unsigned int length, apduBinaryCallback callback,
+void *user)
+{
+	struct apduResponse response;
+	struct apduCommand cmd;
+	bool tagged = window > 1;
+	int tags[APDU_MAX_WINDOW];
+	unsigned int sizes[APDU_MAX_WINDOW];
+	unsigned int requested = 0, received = 0;
+	int sent = 0, done = 0;
+	bool end = false, failed = false;
+	
+	// Frame data: the answer and its SW, after the tag and the rescode
+	// for tagged commands. Above 256 bytes, Le is extended.
+	unsigned int chunk = tagged ? BUFFER_SIZE-4 : serialMaxFrameLength()-2;
+	
+	traceBeginArg("apduReadBinary", "sfi", sfi);
+	while (1)
+	{
+		unsigned int size;
+		int res;
+		
+		if (tagged)
+		{
+			// Keep the window full, without asking past the end
+			while (!end && sent-done < window && requested <= APDU_MAX_OFFSET
+				&& (length == 0 || requested < length))
+			{
+				size = length == 0 || length-requested > chunk ? chunk : length-requested;
+				apduBinaryCommand(&cmd, sfi, requested, size);
+				int tag = apduSubmitCommand(serialPort, &cmd);
+				// Refused (session budget spent): once the answers in
+				// flight are in, the file is not read entirely.
+				if (tag < 0)
+				{
+					if (done == sent)
+						end = failed = true;
+					break;
+				}
+				tags[sent % APDU_MAX_WINDOW] = tag;
+				sizes[sent % APDU_MAX_WINDOW] = size;
+				requested += size;
+				sent++;
+			}
+			if (done == sent)
+				break;
+			size = sizes[done % APDU_MAX_WINDOW];
+			res = apduWaitForTagged(serialPort, tags[done % APDU_MAX_WINDOW], &response);
+			done++;
+			if (end) // answers past the end, or after an error
+				continue;
+		}
+		else
+		{
+			if (end || received > APDU_MAX_OFFSET || (length > 0 && received >= length))
+				break;
+			size = length == 0 || length-received > chunk ? chunk : length-received;
+			apduBinaryCommand(&cmd, sfi, received, size);
+			res = apduTransceive(serialPort, &cmd, &response);
+			
+			// The card may not support extended lengths
+			if (res == MYTERM_OK && response.sw1 == 0x67 && chunk > 256)
+			{
+				chunk = 256;
+				continue;
+			}
+		}
+		
+		// 6282: end of file reached before reading Le bytes.
+		// 6B00: offset past the end of the file, which was a multiple of
+		// the chunk size.
+		bool eof = res == MYTERM_OK && response.sw1 == 0x62 && response.sw2 == 0x82;
+		if (res == MYTERM_OK && response.sw1 == 0x6B && response.sw2 == 0x00)
+		{
+			end = true;
+			continue;
+		}
+		if (res != MYTERM_OK || (!eof && (response.sw1 != APDU_SW1_OK || response.sw2 != APDU_SW2_OK)))
+		{
+			end = failed = true;
+			continue;
+		}
+		
+		if (response.length > 0 && callback != NULL)
+			callback(received, response.data, response.length, user);
+		received += response.length;
+		if (eof || response.length < size)
+			end = true;
+	}
+	traceEndArg("apduReadBinary", "bytes", received);
+	return failed ? -1 : (int) received;
+}
+
+// Uploads a script (see script.h) to the board, which runs it without
+// any round trip with the computer. Every MYTERM_RECORD frame streamed
+// by the script is given to callback. Returns the rescode of the script,
+// and fills result with where it stopped.
+int apduRunScript(int serialPort, struct script *s, apduRecordCallback callback,
+void *user, struct scriptResult *result)
+{
+	uint8_t buffer[LONG_BUFFER_SIZE];
+	
+	if (s->overflow)
+		return MYTERM_UNDEFERROR;
+	
+	traceBeginArg("apduRunScript", "length", s->length);
+	logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduRunScript bytecode", s->code, s->length);
+	statpageSetState(serialPort, STATPAGE_READING);
+	sendFrame(serialPort, MYTERM_SCRIPT, s->code, s->length);
+	
+	while (1)
+	{
+		uint16_t buflen = LONG_BUFFER_SIZE;
+		int left = deadlineSessionLeft();
+		int res = left < 0 ? waitResponse(serialPort, buffer, &buflen)
+			: waitResponseTimeout(serialPort, buffer, &buflen, left+DEADLINE_MARGIN);
+		logHex(LOG_MODULE_APDU, LOG_DEBUG, "apduRunScript response", buffer, buflen);
+		
+		if (res == MYTERM_RECORD)
+		{
+			if (callback != NULL)
+				callback(buffer, buflen, user);
+			continue;
+		}
+		
+		// The commands run by the board are not timed one by one: the
+		// script end is only counted.
+		if (res != MYTERM_SCRIPT || buflen < 4)
+		{
+			statsRecordResponse(NULL, res, false, 0, 0);
+			statpageResponse(serialPort, res, false, 0, 0);
+			traceEndArg("apduRunScript", "rescode", res);
+			mycodesPrintStr(res,NULL);
+			return res;
+		}
+		
+		if (result != NULL)
+		{
+			result->rescode = buffer[0];
+			result->pc = buffer[1];
+			result->sw1 = buffer[2];
+			result->sw2 = buffer[3];
+		}
+		statsRecordResponse(NULL, buffer[0], true, buffer[2], buffer[3]);
+		statpageResponse(serialPort, buffer[0], true, buffer[2], buffer[3]);
+		traceEndArg("apduRunScript", "rescode", buffer[0]);
+		
+		if (buffer[0] != MYTERM_OK)
+			mycodesPrintStr(buffer[0],NULL);
+		else if (buffer[2] != APDU_SW1_OK || buffer[3] != APDU_SW2_OK)
+			apduPrintError(buffer[2],buffer[3]);
+		return buffer[0];
+	}
+}
+
 // APDU response code to readable string
 
 void apduPrintError(uint8_t sw1, uint8_t sw2)
@@ -604,6 +2014,7 @@ void apduPrintError(uint8_t sw1, uint8_t sw2)
 				printf("Unknown code.\n");
 				break;
 			}
+		break;
 		case 0x92:
 			if (sw2 < 0x10)
 				printf("Information: Writing to EEPROM successful after %d attempts.\n", sw2 & 0xF);
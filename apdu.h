@@ -28,16 +28,97 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "mycodes.h"
+#include "script.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define APDU_SW1_OK 0x90
 #define APDU_SW2_OK 0x00
 
+#define APDU_CONFIG_TIMEOUT 1500 // ms
+#define APDU_MAX_WINDOW     8    // tagged requests in flight, per reader
+#define APDU_MAX_READERS    4    // with tagged requests, at once
+#define APDU_RELEASE_TIMEOUT 1500 // ms
+#define APDU_MAX_CHAINING   16   // GET RESPONSE / 6Cxx retries per command
+#define APDU_MAX_OFFSET     0x7FFF // of READ BINARY, without odd instruction
+#define APDU_BAUD_CHECK_TIMEOUT 200 // ms for the echo of the link check
+#define APDU_HELLO_TIMEOUT  100  // ms for a running board to answer MYTERM_HELLO
+#define APDU_BANNER_TIMEOUT 10   // ms for a banner sent before the port was opened
+#define APDU_MAX_UID        10   // triple size UIDs
+#define APDU_MAX_ATS        32   // ATS bytes, without its length byte
+#define APDU_MAX_CARDS      2    // found at once, with MYTERM_CONFIG_DUAL
+#define APDU_MAX_SESSIONS   4    // of asynchronous requests, open at once
+#define APDU_MAX_QUEUED     64   // asynchronous requests waiting for the window, per session
+#define APDU_FRAME_TIMEOUT  100  // ms for the rest of a frame, once it started
+
+struct apduCommand
+{
+	uint8_t cla;
+	uint8_t ins;
+	uint8_t p1;
+	uint8_t p2;
+	uint16_t lc;		// extended length above 255
+	uint8_t *data;		// lc bytes
+	unsigned int le;	// up to 65536, extended length above 256
+	bool isLePresent;
+};
+
+struct apduResponse
+{
+	int rescode;		// MYTERM rescode
+	uint8_t data[LONG_BUFFER_SIZE];
+	uint16_t length;	// without SW1 and SW2
+	uint8_t sw1;
+	uint8_t sw2;
+};
+
 bool apduInitialize(int serialPort);
-bool apduWaitForCard(int serialPort);
-void apduSendCommand(int serialPort, uint8_t cla, uint8_t ins, uint8_t p1,
-uint8_t p2,uint8_t lc, uint8_t *data, uint8_t le, bool isLePresent);
-int apduWaitForResponse(int serialPort, uint8_t *resdata, uint8_t *reslen, uint8_t *sw1, uint8_t *sw2);
+uint16_t apduConfigure(int serialPort, uint16_t flags);
+long apduNegotiateBaudrate(int serialPort, long maxRate);
+int apduWaitForCard(int serialPort);
+bool apduTakePpseResponse(struct apduResponse *response);
+uint16_t apduCardUid(uint8_t *uid, uint16_t size);
+bool apduCardIsoDep(void);
+int apduCardCount(void);
+bool apduSelectCard(int index);
+bool apduReleaseCard(int serialPort);
+void apduSetSessionBudget(int budget);
+bool apduSessionExpired(void);
+bool apduSendCommand(int serialPort, uint8_t cla, uint8_t ins, uint8_t p1,
+uint8_t p2, uint16_t lc, uint8_t *data, unsigned int le, bool isLePresent);
+int apduWaitForResponse(int serialPort, uint8_t *resdata, uint16_t *reslen, uint8_t *sw1, uint8_t *sw2);
+int apduTransceive(int serialPort, struct apduCommand *cmd, struct apduResponse *response);
+int apduSendBatch(int serialPort, struct apduCommand *commands, int count,
+uint8_t flags, struct apduResponse *responses);
+
+int apduSetWindow(int window);
+int apduSubmitCommand(int serialPort, struct apduCommand *cmd);
+int apduWaitForTagged(int serialPort, int tag, struct apduResponse *response);
+
+struct apduSession;
+typedef void (*apduCompletion)(struct apduResponse *response, void *user);
+struct apduSession* apduSessionOpen(int serialPort);
+void apduSessionClose(struct apduSession *session);
+int apduSessionPending(struct apduSession *session);
+bool apduSubmit(struct apduSession *session, struct apduCommand *cmd, apduCompletion callback, void *user);
+int apduPoll(int serialPort);
+int apduRunLoop(void);
+
+typedef void (*apduBinaryCallback)(unsigned int offset, uint8_t *data, uint16_t length, void *user);
+int apduReadBinary(int serialPort, uint8_t sfi, unsigned int length, apduBinaryCallback callback,
+void *user);
+
+typedef void (*apduRecordCallback)(uint8_t *data, uint16_t length, void *user);
+int apduRunScript(int serialPort, struct script *s, apduRecordCallback callback,
+void *user, struct scriptResult *result);
 
 void apduPrintError(uint8_t sw1, uint8_t sw2);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * 
+ * apduflow.cpp: Reads the cards in the field with coroutine card flows.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <memory>
+#include <optional>
+#include "cardflow.hpp"
+#include "serial.h"
+#include "mycodes.h"
+#include "apdu.h"
+#include "loop.h"
+#include "tlv.h"
+#include "log.h"
+
+#define MAX_RECORDS 31
+
+struct TlvFree
+{
+	void operator()(struct TLVobject *obj) const { tlvObjectFree(obj); }
+};
+typedef std::unique_ptr<struct TLVobject, TlvFree> TlvPtr;
+
+static bool answered(int rescode, const struct apduResponse &response)
+{
+	return rescode == MYTERM_OK && response.sw1 == APDU_SW1_OK && response.sw2 == APDU_SW2_OK;
+}
+
+// Prints card number and expiration date if the record contains them.
+// Lines start with the card, as two cards may be read together.
+static bool printCardData(int card, uint8_t *data, uint16_t length)
+{
+	TlvPtr rec(tlvParseData(data, length));
+	struct TLVobject *pan = tlvObjectLookForTag(rec.get(), 0x5A);
+	struct TLVobject *expiry = tlvObjectLookForTag(rec.get(), 0x5F24);
+	
+	if (pan != NULL)
+	{
+		printf("Card %d number: ", card+1);
+		for (unsigned int i=0; i<pan->length; i++)
+			printf("%02x", ((uint8_t*) pan->data[0])[i]);
+		printf("\n");
+	}
+	if (expiry != NULL && expiry->length >= 2)
+	{
+		uint8_t *date = (uint8_t*) expiry->data[0];
+		printf("Card %d expiration date: %02x/%02x\n", card+1, date[1], date[0]);
+	}
+	return pan != NULL || expiry != NULL;
+}
+
+// Same as readCard in main.c, without checkpoints nor cache: SELECT PPSE,
+// then SELECT of each AID, and its records, SFI by SFI, until the card
+// number is found.
+static cardflow::Flow readCard(cardflow::Session &session, int card)
+{
+	struct apduResponse response;
+	struct apduCommand selectPpse = {0x00,0xA4,0x04,0x00,0x0E,(uint8_t*) "2PAY.SYS.DDF01",0x00,true};
+	
+	if (!answered(co_await session.transceive(selectPpse, response), response))
+	{
+		printf("Card %d: no PPSE.\n", card+1);
+		co_return;
+	}
+	TlvPtr ppse(tlvParseData(response.data, response.length));
+	struct TLVobject *fci = tlvObjectLookForTag(ppse.get(), 0xBF0C);
+	if (fci == NULL)
+	{
+		printf("Card %d: no FCI found.\n", card+1);
+		co_return;
+	}
+	
+	for (int i=0; i<255 && fci->data[i] != NULL; i++)
+	{
+		struct TLVobject *aid = tlvObjectLookForTag((struct TLVobject*) fci->data[i], 0x4F);
+		if (aid == NULL)
+			continue;
+		struct apduCommand select = {0x00,0xA4,0x04,0x00,(uint16_t) aid->length,(uint8_t*) aid->data[0],0x00,true};
+		if (!answered(co_await session.transceive(select, response), response))
+			continue;
+		
+		for (uint8_t sfi=1; sfi<16; sfi++)
+		{
+			for (uint8_t record=1; record<=MAX_RECORDS; record++)
+			{
+				struct apduCommand read = {0x00,0xB2,record,(uint8_t) ((sfi << 3)|04),0x00,NULL,0x00,true};
+				int res = co_await session.transceive(read, response);
+				if (res == MYTERM_TIMEOUT || res == MYTERM_READERROR || res == MYTERM_WRITEERROR)
+				{
+					printf("Card %d: session interrupted.\n", card+1);
+					co_return;
+				}
+				// Stop at the end of the file
+				if (!answered(res, response))
+					break;
+				if (printCardData(card, response.data, response.length))
+					co_return;
+			}
+		}
+	}
+	printf("Card %d: no card number found.\n", card+1);
+}
+
+int main(int argc, char *argv[])
+{
+	char *logSpec = NULL;
+	int windowSize = 4;
+	bool dualCards = false;
+	long maxBaudrate = 2000000;
+	int sessionBudget = 0;
+	int opt;
+	
+	while ((opt = getopt(argc, argv, "l:w:DB:T:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l': // log levels, per module
+				logSpec = optarg;
+			break;
+			case 'w': // tagged requests in flight
+				windowSize = atoi(optarg);
+			break;
+			case 'D': // read two cards in the field at once
+				dualCards = true;
+			break;
+			case 'B': // fastest serial rate
+				maxBaudrate = atol(optarg);
+			break;
+			case 'T': // time budget of each card session, ms
+				sessionBudget = atoi(optarg);
+			break;
+			default:
+				optind = argc;
+			break;
+		}
+	}
+	
+	if (optind >= argc)
+	{
+		printf("Usage: %s [-l log_levels] [-w window] [-D] [-B max_baudrate] [-T budget_ms] <serial_port>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	
+	if (!logStart(logSpec))
+		return EXIT_FAILURE;
+	
+	int serial_port = open(argv[optind],O_RDWR);
+	if (serial_port < 0)
+	{
+		perror("Error while opening serial port : ");
+		return EXIT_FAILURE;
+	}
+	
+	if (!serialInitialize(serial_port) || !apduInitialize(serial_port) || !loopOpen())
+	{
+		close(serial_port);
+		return EXIT_FAILURE;
+	}
+	
+	// Flows are asynchronous: they need tagged requests.
+	uint16_t configFlags = MYTERM_CONFIG_TAGGED | (dualCards ? MYTERM_CONFIG_DUAL : 0);
+	uint16_t accepted = apduConfigure(serial_port, configFlags | MYTERM_CONFIG_LONGFRAMES
+		| MYTERM_CONFIG_CHAIN | MYTERM_CONFIG_BAUD | MYTERM_CONFIG_DEADLINE | MYTERM_CONFIG_CRC
+		| MYTERM_CONFIG_TARGETINFO);
+	if (!(accepted & MYTERM_CONFIG_TAGGED))
+	{
+		fprintf(stderr, "The board doesn't support tagged requests.\n");
+		close(serial_port);
+		return EXIT_FAILURE;
+	}
+	if ((accepted & configFlags) != configFlags)
+		fprintf(stderr, "The board doesn't support all the requested features.\n");
+	if (maxBaudrate > MYTERM_BAUD_DEFAULT)
+		printf("Serial link at %ld baud.\n", apduNegotiateBaudrate(serial_port, maxBaudrate));
+	apduSetWindow(windowSize);
+	apduSetSessionBudget(sessionBudget);
+	
+	while (1)
+	{
+		int found = apduWaitForCard(serial_port);
+		if (found < 0)
+			return EXIT_FAILURE;
+		if (found != MYTERM_CARDFOUND)
+			continue;
+		
+		// One flow per card in the field, run together. Sessions are
+		// closed after their flows are destroyed.
+		{
+			std::optional<cardflow::Session> sessions[APDU_MAX_CARDS];
+			cardflow::Flow flows[APDU_MAX_CARDS];
+			for (int c=0; c<apduCardCount(); c++)
+			{
+				apduSelectCard(c);
+				if (!apduCardIsoDep())
+				{
+					printf("Card %d: not an ISO-DEP card, skipped.\n", c+1);
+					continue;
+				}
+				sessions[c].emplace(serial_port);
+				if (sessions[c]->isOpen())
+					flows[c] = readCard(*sessions[c], c);
+			}
+			if (!cardflow::runFlows(flows))
+				return EXIT_FAILURE;
+		}
+		if (apduSessionExpired())
+			printf("Session budget of %d ms spent: results are partial.\n", sessionBudget);
+		printf("\n");
+		
+		if (!apduReleaseCard(serial_port))
+			return EXIT_FAILURE;
+	}
+	
+	loopClose();
+	close(serial_port);
+	return EXIT_SUCCESS;
+}
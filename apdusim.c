@@ -0,0 +1,982 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * apdusim.c: Simulates the Arduino board (APDU_TERMINAL.ino) and a
+ * contactless EMV card on a pseudo-terminal, so that the host program
+ * can be run and benchmarked without hardware. Serial wire time and card
+ * processing time are modelled with delays.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include "mycodes.h"
+#include "script.h"
+#include "crc.h"
+
+#define SIM_TIMEOUT     1000 // ms, as TIMEOUT in APDU_TERMINAL.ino
+#define SIM_UID_LENGTH  7
+#define SIM_CONFIG_SUPPORTED (MYTERM_CONFIG_PPSE | MYTERM_CONFIG_TAGGED | MYTERM_CONFIG_LONGFRAMES \
+	| MYTERM_CONFIG_CHAIN | MYTERM_CONFIG_BAUD | MYTERM_CONFIG_DEADLINE | MYTERM_CONFIG_CRC \
+	| MYTERM_CONFIG_TARGETINFO | MYTERM_CONFIG_DUAL)
+#define SIM_ACK_TIMEOUT 10000 // ms, as ACK_TIMEOUT in APDU_TERMINAL.ino
+#define SIM_TAG_QUEUE   4    // as TAG_QUEUE_LEN in APDU_TERMINAL.ino
+#define SIM_MAX_FRAME   512  // as LONG_READ_LEN in APDU_TERMINAL.ino
+#define SIM_CERT_LENGTH 248  // of the certificate in long records (-L)
+#define SIM_MAX_CHAINING 16  // as CHAIN_MAX in APDU_TERMINAL.ino
+#define SIM_FILE_ID     0x0102 // transparent EF, also SFI 2
+#define SIM_FILE_LENGTH 1500
+#define SIM_FRAME_GAP   100  // ms, as FRAME_GAP in APDU_TERMINAL.ino
+#define SIM_SENT_FRAMES 4    // as SENT_FRAMES in APDU_TERMINAL.ino
+#define SIM_SENT_RING   128  // as SENT_RING_LEN in APDU_TERMINAL.ino
+
+struct simOptions
+{
+	int cards;				// number of cards presented, 0 = infinite
+	int cardDelay;			// ms between two cards
+	int cardLatency;		// ms of card processing per command
+	long baudrate;			// modelled serial rate at startup
+	long maxBaudrate;		// fastest rate the modelled link supports
+	bool longRecords;		// first record too long for 1-byte frame lengths
+	bool t0;				// answers through GET RESPONSE and 6Cxx
+	int hungIns;			// instruction every other card never answers, -1 if none
+	int garbleEvery;		// one checked frame in garbleEvery is garbled on the wire, 0 if none
+	int mifareEvery;		// one card in mifareEvery is a MIFARE Classic tag, 0 if none
+	bool dual;				// a second card is in the field with each one
+};
+
+static struct simOptions options = {0, 500, 5, MYTERM_BAUD_DEFAULT, 2000000, false, false, -1, 0, 0, false};
+static uint16_t configFlags = 0;	// set by MYTERM_CONFIG
+static long baudrate;			// set by MYTERM_BAUD
+static bool cardHung = false;	// a command went past its deadline
+static int cardIndex = 0;		// of the card in the field
+static int simTarget = 0;		// card the last command went to, from 0
+
+// With MYTERM_CONFIG_CRC, as in APDU_TERMINAL.ino: the last frame sent is
+// kept, and the ones before it only as long as the board would keep their
+// copy in its ring. They are kept by sequence number.
+static uint8_t txSeq = 0;		// of the next frame sent
+static uint8_t rxSeq = 0;		// expected for the next frame received
+static uint8_t sentFrames[SIM_SENT_FRAMES][LONG_BUFFER_SIZE+6];
+static int sentLengths[SIM_SENT_FRAMES];	// 0 if the frame isn't kept
+static uint8_t sentSeqs[SIM_SENT_FRAMES];
+static int sentStarts[SIM_SENT_FRAMES];	// in the ring of the board, -1 if too long for it
+static int sentEnd = 0;			// where the next copy goes in that ring
+static int checkedFrames = 0;	// sent so far, for options.garbleEvery
+
+static const uint8_t VERSION[3] = {0x32, 0x01, 0x06}; // PN532 firmware 1.6
+static const uint8_t UID[SIM_UID_LENGTH] = {0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66};
+static const uint8_t ATQA[2] = {0x00, 0x44};
+static const uint8_t ATS[] = {0x05, 0x78, 0x80, 0x70, 0x02}; // from its length byte
+static const uint8_t UID2[SIM_UID_LENGTH] = {0x04, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC}; // second card (-D)
+static const uint8_t MIFARE_UID[4] = {0x1A, 0x2B, 0x3C, 0x4D};
+static const uint8_t MIFARE_ATQA[2] = {0x00, 0x04};
+#define SIM_MIFARE_SAK  0x08 // MIFARE Classic 1K
+static const uint8_t PPSE[] = "2PAY.SYS.DDF01";
+static const uint8_t AID[] = {0xA0, 0x00, 0x00, 0x00, 0x04, 0x10, 0x10};
+// TTQ, amount, unpredictable number: 14 bytes of GPO data
+static const uint8_t PDOL[] = {0x9F, 0x66, 0x04, 0x9F, 0x02, 0x06, 0x9F, 0x37, 0x04};
+#define SIM_PDOL_LENGTH 14
+static bool fileSelected[2] = {false, false};	// current EF of each card is SIM_FILE_ID
+
+/*
+ * Virtual card
+ */
+
+// Appends a TLV object to out, returns its length.
+static uint16_t simTlv(uint8_t *out, unsigned int tag, const uint8_t *value, uint16_t len)
+{
+	uint16_t n = 0;
+	if (tag > 0xFF)
+		out[n++] = tag >> 8;
+	out[n++] = tag & 0xFF;
+	if (len > 0xFF)
+	{
+		out[n++] = 0x82;
+		out[n++] = len >> 8;
+	}
+	else if (len > 0x7F)
+		out[n++] = 0x81;
+	out[n++] = len & 0xFF;
+	memmove(out+n, value, len);
+	return n+len;
+}
+
+static uint16_t simStatus(uint8_t *resp, uint16_t len, uint8_t sw1, uint8_t sw2)
+{
+	resp[len++] = sw1;
+	resp[len++] = sw2;
+	return len;
+}
+
+// Processes an APDU. The response, followed by SW1 SW2, goes in resp.
+// Returns the response length.
+static uint16_t simCardProcess(const uint8_t *apdu, uint16_t len, uint8_t *resp)
+{
+	uint8_t tmp[LONG_BUFFER_SIZE], tmp2[LONG_BUFFER_SIZE];
+	uint16_t n;
+
+	if (len < 4)
+		return simStatus(resp, 0, 0x67, 0x00);
+
+	// Lc is 00 Lc1 Lc2 with extended lengths
+	uint8_t ins = apdu[1], p1 = apdu[2], p2 = apdu[3];
+	uint16_t lc = 0;
+	const uint8_t *data = apdu+5;
+	if (len > 7 && apdu[4] == 0x00)
+	{
+		lc = (apdu[5] << 8) | apdu[6];
+		data = apdu+7;
+	}
+	else if (len > 5)
+		lc = apdu[4];
+
+	switch (ins)
+	{
+		case 0xA4: // SELECT
+			if ((p1 == 0x00 || p1 == 0x02) && lc == 2)
+			{
+				fileSelected[simTarget] = ((data[0] << 8) | data[1]) == SIM_FILE_ID;
+				return fileSelected[simTarget] ? simStatus(resp, 0, 0x90, 0x00) : simStatus(resp, 0, 0x6A, 0x82);
+			}
+			if (lc == sizeof(PPSE)-1 && memcmp(data, PPSE, lc) == 0)
+			{
+				// 6F { 84 PPSE, A5 { BF0C { 61 { 4F AID, 87 01 } } } }
+				const uint8_t priority = 0x01;
+				n = simTlv(tmp, 0x4F, AID, sizeof(AID));
+				n += simTlv(tmp+n, 0x87, &priority, 1);
+				n = simTlv(tmp2, 0x61, tmp, n);
+				n = simTlv(tmp, 0xBF0C, tmp2, n);
+				n = simTlv(tmp2, 0xA5, tmp, n);
+				uint16_t m = simTlv(tmp, 0x84, PPSE, sizeof(PPSE)-1);
+				memcpy(tmp+m, tmp2, n);
+				n = simTlv(resp, 0x6F, tmp, m+n);
+				return simStatus(resp, n, 0x90, 0x00);
+			}
+			if (lc == sizeof(AID) && memcmp(data, AID, lc) == 0)
+			{
+				// 6F { 84 AID, A5 { 50 label, 9F38 PDOL } }
+				n = simTlv(tmp2, 0x50, (const uint8_t*) "SIMULATED", 9);
+				n += simTlv(tmp2+n, 0x9F38, PDOL, sizeof(PDOL));
+				n = simTlv(tmp, 0xA5, tmp2, n);
+				uint16_t m = simTlv(tmp2, 0x84, AID, sizeof(AID));
+				memcpy(tmp2+m, tmp, n);
+				n = simTlv(resp, 0x6F, tmp2, m+n);
+				return simStatus(resp, n, 0x90, 0x00);
+			}
+			return simStatus(resp, 0, 0x6A, 0x82);
+		case 0xA8: // GET PROCESSING OPTIONS, format 1: AIP, then AFL
+		{
+			// 83 { PDOL data }
+			if (lc != 2+SIM_PDOL_LENGTH || data[0] != 0x83 || data[1] != SIM_PDOL_LENGTH)
+				return simStatus(resp, 0, 0x67, 0x00);
+			const uint8_t gpo[] = {0x19, 0x80, 0x08, 0x01, 0x02, 0x00};
+			n = simTlv(resp, 0x80, gpo, sizeof(gpo));
+			return simStatus(resp, n, 0x90, 0x00);
+		}
+		case 0xB2: // READ RECORD, only SFI 1 has records
+			if ((p2 >> 3) != 1)
+				return simStatus(resp, 0, 0x6A, 0x82);
+			if (p1 == 1)
+			{
+				const uint8_t currency[] = {0x09, 0x78};
+				const uint8_t effective[] = {0x20, 0x01, 0x01};
+				n = simTlv(tmp, 0x9F42, currency, sizeof(currency));
+				n += simTlv(tmp+n, 0x5F25, effective, sizeof(effective));
+				if (options.longRecords) // ICC public key certificate
+				{
+					memset(tmp2, 0x5C, SIM_CERT_LENGTH);
+					n += simTlv(tmp+n, 0x9F46, tmp2, SIM_CERT_LENGTH);
+				}
+			}
+			else if (p1 == 2)
+			{
+				// The second card (-D) ends with 13
+				uint8_t pan[] = {0x49, 0x70, 0x12, 0x34, 0x56, 0x78, 0x90, 0x12};
+				pan[sizeof(pan)-1] += simTarget;
+				const uint8_t expiry[] = {0x29, 0x12, 0x31};
+				n = simTlv(tmp, 0x5A, pan, sizeof(pan));
+				n += simTlv(tmp+n, 0x5F24, expiry, sizeof(expiry));
+			}
+			else
+				return simStatus(resp, 0, 0x6A, 0x83);
+			n = simTlv(resp, 0x70, tmp, n);
+			return simStatus(resp, n, 0x90, 0x00);
+		case 0xB0: // READ BINARY, bytes i & 0xFF
+		{
+			// Le is 1 byte, or 00 Le1 Le2 when extended; 0 is the maximum
+			unsigned int le = len == 5 ? apdu[4] : len == 7 && apdu[4] == 0x00 ? (apdu[5] << 8) | apdu[6] : 1;
+			if (le == 0)
+				le = len == 5 ? 256 : 65536;
+			unsigned int offset = (p1 << 8) | p2;
+			if (p1 & 0x80) // by SFI
+			{
+				fileSelected[simTarget] = (p1 & 0x1F) == (SIM_FILE_ID & 0x1F);
+				offset = p2;
+			}
+			if (!fileSelected[simTarget])
+				return simStatus(resp, 0, 0x69, 0x86);
+			if (offset >= SIM_FILE_LENGTH)
+				return simStatus(resp, 0, 0x6B, 0x00);
+			if (le > LONG_BUFFER_SIZE)
+				le = LONG_BUFFER_SIZE;
+			n = SIM_FILE_LENGTH-offset < le ? SIM_FILE_LENGTH-offset : le;
+			for (uint16_t i=0; i<n; i++)
+				resp[i] = (offset+i) & 0xFF;
+			return n < le ? simStatus(resp, n, 0x62, 0x82) : simStatus(resp, n, 0x90, 0x00);
+		}
+		default:
+			return simStatus(resp, 0, 0x6D, 0x00);
+	}
+}
+
+// Answer data waiting for GET RESPONSE (-G)
+static uint8_t pending[LONG_BUFFER_SIZE];
+static uint16_t pendingLength = 0;
+static uint16_t pendingOffset = 0;
+
+// Same as simCardProcess, but as a T=0 card (-G): answer data is only
+// given through GET RESPONSE (61xx), and READ RECORD needs the exact Le
+// (6Cxx). Any other command drops the data waiting.
+static uint16_t simCardT0(const uint8_t *apdu, uint16_t len, uint8_t *resp)
+{
+	if (len >= 4 && apdu[1] == 0xC0) // GET RESPONSE
+	{
+		if (pendingOffset >= pendingLength)
+			return simStatus(resp, 0, 0x69, 0x85);
+		uint16_t le = len > 4 && apdu[4] != 0 ? apdu[4] : 256;
+		uint16_t n = pendingLength-pendingOffset < le ? pendingLength-pendingOffset : le;
+		memcpy(resp, pending+pendingOffset, n);
+		pendingOffset += n;
+		uint16_t left = pendingLength-pendingOffset;
+		if (left > 0)
+			return simStatus(resp, n, 0x61, left > 0xFF ? 0x00 : left);
+		return simStatus(resp, n, 0x90, 0x00);
+	}
+
+	pendingLength = pendingOffset = 0;
+	uint16_t n = simCardProcess(apdu, len, resp);
+	if (n <= 2 || resp[n-2] != 0x90)
+		return n;
+	if (apdu[1] == 0xB2)
+	{
+		uint16_t le = len == 5 && apdu[4] != 0 ? apdu[4] : 256;
+		if (n-2 <= 256)
+			return le == n-2 ? n : simStatus(resp, 0, 0x6C, (n-2) & 0xFF);
+		// Longer than any short Le: 256 bytes, then 61xx for the rest
+		if (le != 256)
+			return simStatus(resp, 0, 0x6C, 0x00);
+		memcpy(pending, resp, n-2);
+		pendingLength = n-2;
+		pendingOffset = 256;
+		uint16_t left = pendingLength-pendingOffset;
+		return simStatus(resp, 256, 0x61, left > 0xFF ? 0x00 : left);
+	}
+	memcpy(pending, resp, n-2);
+	pendingLength = n-2;
+	return simStatus(resp, 0, 0x61, n-2 > 0xFF ? 0x00 : n-2);
+}
+
+/*
+ * Board
+ */
+
+static void simSleep(long us)
+{
+	struct timespec t = {us / 1000000, (us % 1000000) * 1000};
+	nanosleep(&t, NULL);
+}
+
+static long simNowMs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000L + now.tv_nsec/1000000;
+}
+
+// Time taken by bytes on the wire: 10 bits per byte (8N1)
+static void simWireDelay(unsigned int bytes)
+{
+	simSleep((long) bytes * 10 * 1000000 / baudrate);
+}
+
+// Largest frame data, depending on the frame format in use
+static uint16_t simMaxFrame(void)
+{
+	return (configFlags & MYTERM_CONFIG_LONGFRAMES) ? SIM_MAX_FRAME : BUFFER_SIZE;
+}
+
+// Whether frames with this opcode carry a sequence number and a CRC
+static bool simChecked(uint8_t code)
+{
+	return (configFlags & MYTERM_CONFIG_CRC) && code != MYTERM_HELLO && code != MYTERM_ECHO;
+}
+
+static void simWrite(int fd, const uint8_t *frame, int len)
+{
+	simWireDelay(len);
+	write(fd, frame, len);
+}
+
+static void simSendFrame(int fd, uint8_t code, const uint8_t *data, uint16_t len)
+{
+	uint8_t frame[LONG_BUFFER_SIZE+6];
+	int header = 1;
+	frame[0] = code;
+	if (configFlags & MYTERM_CONFIG_LONGFRAMES)
+		frame[header++] = len >> 8;
+	frame[header++] = len & 0xFF;
+	if (!simChecked(code))
+	{
+		if (len > 0)
+			memcpy(frame+header, data, len);
+		simWrite(fd, frame, len+header);
+		return;
+	}
+
+	// MYTERM_NAK frames take no sequence number, and are not sent again.
+	frame[header++] = code == MYTERM_NAK ? 0 : txSeq++;
+	if (len > 0)
+		memcpy(frame+header, data, len);
+	uint16_t crc = crc16(CRC16_INIT, frame, len+header);
+	frame[len+header] = crc >> 8;
+	frame[len+header+1] = crc & 0xFF;
+	int size = len+header+2;
+	if (code != MYTERM_NAK)
+	{
+		uint8_t seq = frame[header-1];
+		int slot = seq % SIM_SENT_FRAMES;
+		memcpy(sentFrames[slot], frame, size);
+		sentLengths[slot] = size;
+		sentSeqs[slot] = seq;
+		sentStarts[slot] = -1;
+		if (size <= SIM_SENT_RING)
+		{
+			if (sentEnd+size > SIM_SENT_RING)
+				sentEnd = 0;
+			sentStarts[slot] = sentEnd;
+			sentEnd += size;
+		}
+		// Frames too long for the ring were only kept while they were the
+		// last one; the others are overwritten by this one.
+		for (int i=0; i<SIM_SENT_FRAMES; i++)
+			if (i != slot && sentLengths[i] > 0 && (sentStarts[i] < 0
+				|| (sentStarts[slot] >= 0 && sentStarts[i] < sentEnd && sentStarts[slot] < sentStarts[i]+sentLengths[i])))
+				sentLengths[i] = 0;
+	}
+
+	// A byte after the opcode gets a bit flipped: the length, the sequence
+	// number, the data or the CRC.
+	if (options.garbleEvery > 0 && ++checkedFrames % options.garbleEvery == 0)
+		frame[1 + checkedFrames % (size-1)] ^= 0x10;
+	simWrite(fd, frame, size);
+}
+
+// Tells the host which frame is expected, and which one was sent last.
+static void simSendNak(int fd)
+{
+	uint8_t nak[MYTERM_NAK_LENGTH] = {rxSeq, (uint8_t) (txSeq-1)};
+	simSendFrame(fd, MYTERM_NAK, nak, sizeof(nak));
+}
+
+static bool simReadByte(int fd, uint8_t *c, int timeout)
+{
+	struct pollfd pfd = {fd, POLLIN, 0};
+	if (poll(&pfd, 1, timeout) <= 0)
+		return false;
+	return read(fd, c, 1) == 1;
+}
+
+// Reads len bytes, taking all those already received at once, as the
+// board does. Bytes beyond max are read and dropped.
+static bool simReadBytes(int fd, uint8_t *buf, uint16_t len, uint16_t max, int timeout)
+{
+	uint8_t dropped[BUFFER_SIZE];
+	uint16_t pos = 0;
+	while (pos < len)
+	{
+		struct pollfd pfd = {fd, POLLIN, 0};
+		if (poll(&pfd, 1, timeout) <= 0)
+			return false;
+		uint8_t *dest = pos < max ? buf+pos : dropped;
+		uint16_t room = pos < max ? max-pos : (uint16_t) sizeof(dropped);
+		ssize_t got = read(fd, dest, len-pos < room ? len-pos : room);
+		if (got <= 0)
+			return false;
+		pos += got;
+	}
+	return true;
+}
+
+// Reads a frame. Returns false if nothing came within timeout ms.
+// A frame already waiting was sent while the board was busy: its time on
+// the wire overlapped with the work of the board, and isn't counted again.
+// With MYTERM_CONFIG_CRC, garbled frames, frames sent twice and MYTERM_NAK
+// frames are handled here, as receiveFrame() in APDU_TERMINAL.ino does.
+static bool simReadFrame(int fd, uint8_t *code, uint8_t *data, uint16_t *len, int timeout)
+{
+	while (1)
+	{
+		struct pollfd pfd = {fd, POLLIN, 0};
+		bool waiting = poll(&pfd, 1, 0) > 0;
+		bool longFrames = (configFlags & MYTERM_CONFIG_LONGFRAMES) != 0;
+		uint8_t header[4] = {0, 0, 0, 0};
+
+		if (!simReadByte(fd, code, timeout))
+			return false;
+		header[0] = *code;
+		// MYTERM_HELLO always has a 1-byte length.
+		longFrames = longFrames && *code != MYTERM_HELLO;
+		bool checked = simChecked(*code);
+		int header_size = 1 + (longFrames ? 2 : 1) + (checked ? 1 : 0);
+		int gap = checked ? SIM_FRAME_GAP : SIM_TIMEOUT;
+		if (!simReadBytes(fd, header+1, header_size-1, sizeof(header)-1, gap))
+		{
+			if (checked)
+				simSendNak(fd);
+			continue;
+		}
+		*len = longFrames ? (header[1] << 8) | header[2] : header[1];
+		uint16_t total = *len + (checked ? 2 : 0);
+		if (!simReadBytes(fd, data, total, LONG_BUFFER_SIZE, gap))
+		{
+			if (checked)
+				simSendNak(fd);
+			continue;
+		}
+		if (!waiting)
+			simWireDelay(total + header_size);
+		if (!checked)
+		{
+			if (*len > LONG_BUFFER_SIZE)
+				*len = LONG_BUFFER_SIZE;
+			return true;
+		}
+
+		if (total > LONG_BUFFER_SIZE || crc16(crc16(CRC16_INIT, header, header_size), data, *len)
+			!= ((data[*len] << 8) | data[*len+1]))
+		{
+			simSendNak(fd);
+			continue;
+		}
+		if (*code == MYTERM_NAK)
+		{
+			// The host asks for a frame again: one of the last ones, or one
+			// not sent yet or lost.
+			int slot = *len >= MYTERM_NAK_LENGTH ? data[0] % SIM_SENT_FRAMES : 0;
+			if (*len >= MYTERM_NAK_LENGTH && sentLengths[slot] > 0 && sentSeqs[slot] == data[0])
+				simWrite(fd, sentFrames[slot], sentLengths[slot]);
+			else
+				simSendNak(fd);
+			continue;
+		}
+		uint8_t seq = header[header_size-1];
+		if (seq == (uint8_t) (rxSeq-1)) // sent again
+			continue;
+		rxSeq = seq+1;
+		return true;
+	}
+}
+
+// Whether the first card in the field is a MIFARE Classic tag (-M), which
+// never answers APDUs.
+static bool simMifare(void)
+{
+	return options.mifareEvery > 0 && cardIndex % options.mifareEvery == options.mifareEvery-1;
+}
+
+// Number of cards in the field: the second one (-D) is only listed with
+// MYTERM_CONFIG_DUAL.
+static int simCardCount(void)
+{
+	return options.dual && (configFlags & MYTERM_CONFIG_DUAL) ? 2 : 1;
+}
+
+// Sends an APDU to the card. With MYTERM_CONFIG_CHAIN, 61xx and 6Cxx
+// answers are completed as in exchange() in APDU_TERMINAL.ino, until the
+// card makes no progress. Past
+// timeout ms, the card is given up on (cardHung), and nothing is returned.
+static uint16_t simCardApdu(const uint8_t *apdu, uint16_t len, uint8_t *resp, int timeout)
+{
+	uint8_t last[LONG_BUFFER_SIZE];
+	uint16_t lastLength = len, offset = 0, n = 0;
+	int spent = 0;
+
+	memcpy(last, apdu, len);
+	for (int i=0; i<=SIM_MAX_CHAINING; i++)
+	{
+		bool hung = (lastLength >= 2 && last[1] == options.hungIns && cardIndex % 2 == 1)
+			|| (simTarget == 0 && simMifare());
+		if (hung || spent+options.cardLatency > timeout)
+		{
+			simSleep((timeout-spent) * 1000L);
+			cardHung = true;
+			return 0;
+		}
+		simSleep(options.cardLatency * 1000L);
+		spent += options.cardLatency;
+		n = offset + (options.t0 ? simCardT0(last, lastLength, resp+offset)
+			: simCardProcess(last, lastLength, resp+offset));
+		if (!(configFlags & MYTERM_CONFIG_CHAIN) || n < 2 || n-2+BUFFER_SIZE+3 > LONG_BUFFER_SIZE)
+			break;
+
+		uint8_t sw1 = resp[n-2], sw2 = resp[n-1];
+		if (sw1 == 0x61 && (last[1] != 0xC0 || n-2 > offset))
+		{
+			const uint8_t getResponse[5] = {0x00, 0xC0, 0x00, 0x00, sw2};
+			memcpy(last, getResponse, sizeof(getResponse));
+			lastLength = sizeof(getResponse);
+		}
+		else if (sw1 == 0x6C && lastLength > 4 && last[lastLength-1] != sw2)
+			last[lastLength-1] = sw2;
+		else
+			break;
+		offset = n-2;
+	}
+	return n;
+}
+
+// Same for scripts, which only handle short answers and run on the first
+// card.
+static uint8_t simCardExchange(void *ctx, const uint8_t *apdu, uint8_t len, uint8_t *resp, uint8_t *resplen)
+{
+	uint8_t answer[LONG_BUFFER_SIZE];
+	simTarget = 0;
+	uint16_t n = simCardApdu(apdu, len, answer, SIM_ACK_TIMEOUT);
+	(void) ctx;
+	*resplen = 0;
+	if (cardHung)
+		return MYTERM_TIMEOUT;
+	if (n > BUFFER_SIZE)
+		return MYTERM_READERROR;
+	memcpy(resp, answer, n);
+	*resplen = n;
+	return MYTERM_OK;
+}
+
+// With MYTERM_CONFIG_DEADLINE, skips the time the card may take at the
+// start of the command data, and returns it, as takeDeadline() in
+// APDU_TERMINAL.ino.
+static int simTakeDeadline(const uint8_t **data, uint16_t *len)
+{
+	if (!(configFlags & MYTERM_CONFIG_DEADLINE) || *len < 2)
+		return SIM_ACK_TIMEOUT;
+	int timeout = ((*data)[0] << 8) | (*data)[1];
+	*data += 2;
+	*len -= 2;
+	return timeout > 0 ? timeout : SIM_ACK_TIMEOUT;
+}
+
+// Sends an InDataExchange frame to the card it names, as the PN532 would.
+// Answers longer than maxlen can't be sent back.
+static uint8_t simTransceive(const uint8_t *cmd, uint16_t len, uint8_t *resp, uint16_t *resplen,
+uint16_t maxlen, int timeout)
+{
+	*resplen = 0;
+	if (cardHung)
+		return MYTERM_TIMEOUT;
+	if (len < 2 || cmd[0] != 0x40 || cmd[1] < 1 || cmd[1] > simCardCount())
+		return MYTERM_WRITEERROR;
+	simTarget = cmd[1]-1;
+	uint16_t n = simCardApdu(cmd+2, len-2, resp, timeout);
+	if (cardHung)
+		return MYTERM_TIMEOUT;
+	if (n > maxlen)
+		return MYTERM_READERROR;
+	*resplen = n;
+	return MYTERM_OK;
+}
+
+static void simScriptEmit(void *ctx, const uint8_t *data, uint8_t len)
+{
+	simSendFrame(*((int*) ctx), MYTERM_RECORD, data, len);
+}
+
+static void simRunBatch(int fd, const uint8_t *data, uint16_t length)
+{
+	uint8_t frame[BUFFER_SIZE];
+	uint8_t resp[LONG_BUFFER_SIZE];
+	uint16_t framelen = 2;
+	uint8_t framecount = 0;
+
+	if (length < 2)
+	{
+		simSendFrame(fd, MYTERM_UNDEFERROR, NULL, 0);
+		return;
+	}
+
+	uint8_t flags = data[0];
+	const uint8_t *commands = data+2;
+	uint16_t left = length-2;
+	int timeout = simTakeDeadline(&commands, &left);
+	uint16_t pos = commands-data;
+	for (uint8_t i=0; i<data[1] && pos < length; i++)
+	{
+		uint8_t cmdlen = data[pos++];
+		if (pos+cmdlen > length)
+			break;
+
+		// Batch answers have 1-byte lengths
+		uint16_t resplen = 0;
+		uint8_t rescode = simTransceive(data+pos, cmdlen, resp, &resplen, BUFFER_SIZE-2, timeout);
+		pos += cmdlen;
+
+		if (framelen+2+resplen > BUFFER_SIZE)
+		{
+			frame[0] = MYTERM_BATCH_MORE;
+			frame[1] = framecount;
+			simSendFrame(fd, MYTERM_BATCH, frame, framelen);
+			framelen = 2;
+			framecount = 0;
+		}
+		frame[framelen++] = rescode;
+		frame[framelen++] = resplen;
+		memcpy(frame+framelen, resp, resplen);
+		framelen += resplen;
+		framecount++;
+
+		bool ok = rescode == MYTERM_OK && resplen >= 2
+			&& resp[resplen-2] == 0x90 && resp[resplen-1] == 0x00;
+		if (rescode != MYTERM_OK || ((flags & MYTERM_BATCH_STOPONERROR) && !ok))
+			break;
+	}
+	frame[0] = 0;
+	frame[1] = framecount;
+	simSendFrame(fd, MYTERM_BATCH, frame, framelen);
+}
+
+// A card stays in the field until the host is silent for SIM_TIMEOUT ms.
+// The answer still uses the frame format of the request.
+static void simConfigure(int fd, const uint8_t *data, uint16_t len)
+{
+	uint16_t flags = len > 0 ? data[0] : 0;
+	if (len > 1)
+		flags |= data[1] << 8;
+	flags &= SIM_CONFIG_SUPPORTED;
+	uint8_t answer[5] = {flags & 0xFF, SIM_TAG_QUEUE, SIM_MAX_FRAME >> 8, SIM_MAX_FRAME & 0xFF, flags >> 8};
+	simSendFrame(fd, MYTERM_CONFIG, answer, sizeof(answer));
+	configFlags = flags;
+	txSeq = 0;
+	rxSeq = 0;
+	memset(sentLengths, 0, sizeof(sentLengths));
+}
+
+// Answers MYTERM_HELLO, as hello() in APDU_TERMINAL.ino: the link goes
+// back to its startup settings.
+static void simHello(int fd, uint8_t state)
+{
+	uint8_t answer[4] = {VERSION[0], VERSION[1], VERSION[2], state};
+	configFlags = 0;
+	simSendFrame(fd, MYTERM_HELLO, answer, sizeof(answer));
+	baudrate = options.baudrate;
+}
+
+// Switches the modelled rate, as changeBaudrate() in APDU_TERMINAL.ino.
+// Above options.maxBaudrate, the link garbles what the board sends back.
+static void simBaudrate(int fd, const uint8_t *data, uint16_t len)
+{
+	static const long rates[] = {MYTERM_BAUD_RATES};
+	uint8_t answer[4] = {0, 0, 0, 0};
+	long rate = len >= 4 ? ((long) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3] : 0;
+	bool supported = false;
+	
+	for (unsigned int i=0; i<sizeof(rates)/sizeof(rates[0]); i++)
+		supported = supported || rates[i] == rate;
+	if (!supported)
+	{
+		simSendFrame(fd, MYTERM_BAUD, answer, sizeof(answer));
+		return;
+	}
+	simSendFrame(fd, MYTERM_BAUD, data, 4);
+	
+	// Probation: echo the link checks, keep the rate on an empty one.
+	long previous = baudrate;
+	long deadline = simNowMs() + MYTERM_BAUD_PROBATION;
+	long left;
+	baudrate = rate;
+	while ((left = deadline - simNowMs()) > 0)
+	{
+		uint8_t code, echo[LONG_BUFFER_SIZE];
+		uint16_t echolen;
+		if (!simReadFrame(fd, &code, echo, &echolen, (int) left) || code != MYTERM_ECHO)
+			break;
+		if (echolen == 0)
+			return;
+		if (rate > options.maxBaudrate)
+			for (uint16_t i=0; i<echolen; i++)
+				echo[i] ^= 0x10;
+		simSendFrame(fd, MYTERM_ECHO, echo, echolen);
+	}
+	baudrate = previous;
+}
+
+// Waits for the next card during ms, answering MYTERM_CONFIG, MYTERM_BAUD
+// and MYTERM_HELLO frames. Anything else is dropped, as the board does
+// between two cards.
+static void simIdle(int fd, int ms)
+{
+	uint8_t code;
+	uint16_t len;
+	uint8_t data[LONG_BUFFER_SIZE];
+	long deadline = simNowMs() + ms;
+	long left;
+
+	while ((left = deadline - simNowMs()) > 0)
+	{
+		if (!simReadFrame(fd, &code, data, &len, (int) left))
+			continue;
+		if (code == MYTERM_CONFIG)
+			simConfigure(fd, data, len);
+		else if (code == MYTERM_BAUD)
+			simBaudrate(fd, data, len);
+		else if (code == MYTERM_HELLO)
+			simHello(fd, MYTERM_HELLO_IDLE);
+	}
+}
+
+// Appends the information of card index (from 0) to data, as sent with
+// MYTERM_CONFIG_TARGETINFO. Returns its length.
+static uint16_t simTargetInfo(uint8_t *data, int index)
+{
+	uint16_t len = 0;
+	bool mifare = index == 0 && simMifare();
+	const uint8_t *uid = mifare ? MIFARE_UID : index == 0 ? UID : UID2;
+	uint8_t uidLength = mifare ? sizeof(MIFARE_UID) : SIM_UID_LENGTH;
+	
+	memcpy(data+len, mifare ? MIFARE_ATQA : ATQA, 2);
+	len += 2;
+	data[len++] = mifare ? SIM_MIFARE_SAK : MYTERM_SAK_ISODEP;
+	data[len++] = uidLength;
+	memcpy(data+len, uid, uidLength);
+	len += uidLength;
+	data[len++] = mifare ? 0 : sizeof(ATS)-1;
+	if (!mifare)
+	{
+		memcpy(data+len, ATS+1, sizeof(ATS)-1);
+		len += sizeof(ATS)-1;
+	}
+	return len;
+}
+
+// Sends MYTERM_CARDFOUND, as sendCardFound() in APDU_TERMINAL.ino.
+static void simSendCardFound(int fd)
+{
+	uint8_t data[1+2*(5+SIM_UID_LENGTH+sizeof(ATS))] = {0};
+	uint16_t len = 0;
+	
+	if (configFlags & MYTERM_CONFIG_DUAL)
+	{
+		data[len++] = simCardCount();
+		for (int i=0; i<simCardCount(); i++)
+			len += simTargetInfo(data+len, i);
+	}
+	else if (configFlags & MYTERM_CONFIG_TARGETINFO)
+		len = simTargetInfo(data, 0);
+	else
+	{
+		memcpy(data, simMifare() ? MIFARE_UID : UID, simMifare() ? sizeof(MIFARE_UID) : SIM_UID_LENGTH);
+		len = SIM_UID_LENGTH;
+	}
+	simSendFrame(fd, MYTERM_CARDFOUND, data, len);
+}
+
+// The virtual card is taken away as soon as its session ends.
+static void simSession(int fd)
+{
+	uint8_t code;
+	uint16_t len;
+	uint8_t data[LONG_BUFFER_SIZE], resp[LONG_BUFFER_SIZE+2];
+
+	cardHung = false;
+	simTarget = 0;
+	fileSelected[0] = false;
+	fileSelected[1] = false;
+	simSendCardFound(fd);
+	if ((configFlags & MYTERM_CONFIG_PPSE)
+		&& (!simMifare() || !(configFlags & (MYTERM_CONFIG_TARGETINFO | MYTERM_CONFIG_DUAL))))
+	{
+		uint8_t select[6+sizeof(PPSE)] = {0x00, 0xA4, 0x04, 0x00, sizeof(PPSE)-1};
+		memcpy(select+5, PPSE, sizeof(PPSE)-1);
+		select[5+sizeof(PPSE)-1] = 0x00;
+		uint16_t resplen = simCardApdu(select, sizeof(select), resp, SIM_ACK_TIMEOUT);
+		simSendFrame(fd, MYTERM_OK, resp, resplen);
+	}
+	while (!cardHung && simReadFrame(fd, &code, data, &len, SIM_TIMEOUT))
+	{
+		switch (code)
+		{
+			case MYTERM_COMMAND:
+			{
+				const uint8_t *cmd = data;
+				uint16_t resplen = 0;
+				int timeout = simTakeDeadline(&cmd, &len);
+				uint8_t rescode = simTransceive(cmd, len, resp, &resplen, simMaxFrame(), timeout);
+				simSendFrame(fd, rescode, resp, resplen);
+			}
+			break;
+			case MYTERM_BATCH:
+				simRunBatch(fd, data, len);
+			break;
+			case MYTERM_SCRIPT:
+			{
+				struct scriptResult result;
+				scriptRun(data, len > BUFFER_SIZE ? BUFFER_SIZE : len, simCardExchange, simScriptEmit, &fd, &result);
+				uint8_t end[4] = {result.rescode, result.pc, result.sw1, result.sw2};
+				simSendFrame(fd, MYTERM_SCRIPT, end, sizeof(end));
+			}
+			break;
+			case MYTERM_CONFIG:
+				simConfigure(fd, data, len);
+			break;
+			case MYTERM_BAUD: // refused during a session
+			{
+				uint8_t answer[4] = {0, 0, 0, 0};
+				simSendFrame(fd, MYTERM_BAUD, answer, sizeof(answer));
+			}
+			break;
+			case MYTERM_RELEASE:
+				simSendFrame(fd, MYTERM_RELEASE, NULL, 0);
+				simSendFrame(fd, MYTERM_CARDREMOVED, NULL, 0);
+			return;
+			case MYTERM_HELLO: // the host restarted
+				simHello(fd, MYTERM_HELLO_SESSION);
+				simSendFrame(fd, MYTERM_CARDREMOVED, NULL, 0);
+			return;
+			case MYTERM_TAGGED:
+			{
+				// Answer: tag, rescode, then the card answer
+				const uint8_t *cmd = data+1;
+				uint16_t cmdlen = len > 0 ? len-1 : 0;
+				uint16_t resplen = 0;
+				int timeout = simTakeDeadline(&cmd, &cmdlen);
+				uint8_t rescode = len < 1 || (configFlags & MYTERM_CONFIG_TAGGED) == 0 ? MYTERM_UNDEFERROR
+					: simTransceive(cmd, cmdlen, resp+2, &resplen, simMaxFrame()-2, timeout);
+				resp[0] = len > 0 ? data[0] : 0;
+				resp[1] = rescode;
+				simSendFrame(fd, MYTERM_TAGGED, resp, resplen+2);
+			}
+			break;
+			default: // ignored, as the board does
+			break;
+		}
+	}
+	// A hung card already got its MYTERM_TIMEOUT answer.
+	if (!cardHung)
+		simSendFrame(fd, MYTERM_TIMEOUT, NULL, 0);
+	simSendFrame(fd, MYTERM_CARDREMOVED, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:c:r:R:LGH:E:M:D")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': // number of cards
+				options.cards = atoi(optarg);
+			break;
+			case 'd': // delay between cards, ms
+				options.cardDelay = atoi(optarg);
+			break;
+			case 'c': // card processing time, ms
+				options.cardLatency = atoi(optarg);
+			break;
+			case 'r': // serial baud rate
+				options.baudrate = atol(optarg);
+			break;
+			case 'R': // fastest rate the link supports
+				options.maxBaudrate = atol(optarg);
+			break;
+			case 'L': // long first record
+				options.longRecords = true;
+			break;
+			case 'G': // T=0 card
+				options.t0 = true;
+			break;
+			case 'H': // instruction every other card hangs on, in hexadecimal
+				options.hungIns = (int) strtol(optarg, NULL, 16) & 0xFF;
+			break;
+			case 'E': // one checked frame in n garbled
+				options.garbleEvery = atoi(optarg);
+			break;
+			case 'M': // one card in n is a MIFARE Classic tag
+				options.mifareEvery = atoi(optarg);
+			break;
+			case 'D': // a second card with each one
+				options.dual = true;
+			break;
+			default:
+				printf("Usage: %s [-n cards] [-d card_delay] [-c card_latency] [-r baudrate] [-R max_baudrate] [-L] [-G] [-H hung_ins] [-E garble_every] [-M mifare_every] [-D]\n", argv[0]);
+				return EXIT_FAILURE;
+			break;
+		}
+	}
+	if (options.baudrate <= 0)
+		options.baudrate = MYTERM_BAUD_DEFAULT;
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+	{
+		perror("Error while creating pseudo-terminal : ");
+		return EXIT_FAILURE;
+	}
+
+	// Keep the slave side open and raw, so that no byte is altered or
+	// lost while the host is not connected yet.
+	int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	struct termios tty;
+	if (slave < 0 || tcgetattr(slave, &tty) != 0)
+	{
+		perror("Error while opening pseudo-terminal : ");
+		return EXIT_FAILURE;
+	}
+	cfmakeraw(&tty);
+	tcsetattr(slave, TCSANOW, &tty);
+
+	printf("%s\n", ptsname(master));
+	fflush(stdout);
+
+	// Banner: PN532 firmware version
+	baudrate = options.baudrate;
+	simSendFrame(master, MYTERM_OK, VERSION, sizeof(VERSION));
+
+	for (int card=0; options.cards == 0 || card < options.cards; card++)
+	{
+		cardIndex = card;
+		simIdle(master, options.cardDelay);
+		simSession(master);
+	}
+
+	close(slave);
+	close(master);
+	return EXIT_SUCCESS;
+}
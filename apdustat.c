@@ -0,0 +1,138 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * apdustat.c: Prints the statistics page of a running apdu process.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "statpage.h"
+
+static const char *STATE_NAMES[STATPAGE_STATE_COUNT] = {
+	"idle", "waiting for card", "card found", "selecting", "reading", "extracted"
+};
+
+void printPage(const struct statpage *page)
+{
+	uint64_t cards = 0, sessions = 0, apdus = 0, timeouts = 0;
+	uint64_t swErrors[STATPAGE_SW_COUNT] = {0};
+
+	printf("Process %d\n", page->pid);
+	for (uint32_t i=0; i<page->maxReaders; i++)
+	{
+		struct statpageReader r;
+		if (atomic_load_explicit(&page->readers[i].used, memory_order_acquire) != 1)
+			continue;
+		if (!statpageReadSlot(&page->readers[i], &r))
+		{
+			printf("Reader %u: busy\n", i);
+			continue;
+		}
+
+		printf("Reader %u (fd %d): %s", i, r.port,
+			r.state < STATPAGE_STATE_COUNT ? STATE_NAMES[r.state] : "?");
+		if (r.uidLength > 0)
+		{
+			printf(", last UID ");
+			for (uint8_t j=0; j<r.uidLength; j++)
+				printf("%02x", r.uid[j]);
+		}
+		printf("\n");
+
+		cards += r.cardsSeen;
+		sessions += r.sessionsCompleted;
+		apdus += r.apdusSent;
+		timeouts += r.timeouts;
+		for (int j=0; j<STATPAGE_SW_COUNT; j++)
+			swErrors[j] += r.swErrors[j];
+	}
+
+	printf("Cards seen: %llu\n", (unsigned long long) cards);
+	printf("Sessions completed: %llu\n", (unsigned long long) sessions);
+	printf("APDUs sent: %llu\n", (unsigned long long) apdus);
+	printf("Timeouts: %llu\n", (unsigned long long) timeouts);
+	printf("SW errors: warning %llu, execution %llu, checking %llu, other %llu\n\n",
+		(unsigned long long) swErrors[STATPAGE_SW_WARNING],
+		(unsigned long long) swErrors[STATPAGE_SW_EXECERROR],
+		(unsigned long long) swErrors[STATPAGE_SW_CHECKERROR],
+		(unsigned long long) swErrors[STATPAGE_SW_OTHER]);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = STATPAGE_DEFAULT_NAME;
+	unsigned int interval = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'w': // refresh every x seconds
+				interval = (unsigned int) atoi(optarg);
+			break;
+			default:
+				printf("Usage: %s [-w interval] [page_name]\n", argv[0]);
+				return EXIT_FAILURE;
+			break;
+		}
+	}
+	if (optind < argc)
+		name = argv[optind];
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		perror("Error while opening statistics page : ");
+		return EXIT_FAILURE;
+	}
+
+	struct statpage *page = mmap(NULL, sizeof(struct statpage), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+	{
+		perror("Error while mapping statistics page : ");
+		return EXIT_FAILURE;
+	}
+
+	if (atomic_load_explicit(&page->magic, memory_order_acquire) != STATPAGE_MAGIC
+		|| page->version != STATPAGE_VERSION || page->size != sizeof(struct statpage))
+	{
+		fprintf(stderr, "Unsupported statistics page.\n");
+		munmap(page, sizeof(struct statpage));
+		return EXIT_FAILURE;
+	}
+
+	do
+	{
+		printPage(page);
+		if (interval > 0)
+			sleep(interval);
+	} while (interval > 0);
+
+	munmap(page, sizeof(struct statpage));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * cache.c: Results of the last cards read, to answer repeated taps.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+#include "log.h"
+#include "main.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// In memory only, unless mapped from a file by cacheOpen. Used by the main
+// thread only.
+static struct cacheTable memoryTable;
+static struct cacheTable *table = NULL;
+static bool mapped = false;
+static uint64_t ttl = 0;	// ms
+
+static uint64_t cacheNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+static void cacheReset(struct cacheTable *t)
+{
+	t->magic = 0;
+	memset(t->entries, 0, sizeof(t->entries));
+	t->version = CACHE_VERSION;
+	t->size = sizeof(struct cacheTable);
+	t->magic = CACHE_MAGIC;
+}
+
+// Enables the cache, keeping results for ttl seconds. With a path, the
+// entries are kept in this file, mapped in memory, so that they survive
+// restarts.
+bool cacheOpen(int seconds, const char *path)
+{
+	ttl = seconds > 0 ? (uint64_t) seconds*1000 : 0;
+	if (path == NULL)
+	{
+		cacheReset(&memoryTable);
+		table = &memoryTable;
+		return true;
+	}
+	
+	// It holds card numbers: only for its owner
+	int fd = open(path, O_CREAT | O_RDWR, 0600);
+	if (fd < 0)
+	{
+		perror("Error while opening cache file : ");
+		return false;
+	}
+	if (ftruncate(fd, sizeof(struct cacheTable)) != 0)
+	{
+		perror("Error while sizing cache file : ");
+		close(fd);
+		return false;
+	}
+	
+	table = mmap(NULL, sizeof(struct cacheTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED)
+	{
+		perror("Error while mapping cache file : ");
+		table = NULL;
+		return false;
+	}
+	mapped = true;
+	
+	if (table->magic != CACHE_MAGIC || table->version != CACHE_VERSION
+		|| table->size != sizeof(struct cacheTable))
+		cacheReset(table);
+	return true;
+}
+
+void cacheClose(void)
+{
+	if (mapped)
+		munmap(table, sizeof(struct cacheTable));
+	table = NULL;
+	mapped = false;
+}
+
+static struct cacheEntry* cacheFind(const uint8_t *uid, uint16_t uidLength)
+{
+	if (table == NULL || uidLength == 0 || uidLength > CACHE_UID_LENGTH)
+		return NULL;
+	for (int i=0; i<CACHE_ENTRIES; i++)
+	{
+		struct cacheEntry *e = &table->entries[i];
+		if (e->uidLength == uidLength && memcmp(e->uid, uid, uidLength) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+// Gets the result stored for the card uid less than ttl ago.
+bool cacheLookup(const uint8_t *uid, uint16_t uidLength, struct cacheResult *result)
+{
+	struct cacheEntry *e = cacheFind(uid, uidLength);
+	if (e == NULL)
+		return false;
+	
+	uint64_t now = cacheNow();
+	if (now < e->storedAt || now-e->storedAt > ttl)
+	{
+		logMessage(LOG_MODULE_MAIN, LOG_INFO, "Cached result expired", 0, 0);
+		e->uidLength = 0;
+		return false;
+	}
+	e->usedAt = now;
+	memcpy(result, &e->result, sizeof(struct cacheResult));
+	logMessage(LOG_MODULE_MAIN, LOG_INFO, "Cached result from %ld ms ago", (long) (now-e->storedAt), 0);
+	return true;
+}
+
+// Stores the result of the card uid, in place of the least recently used
+// entry if the cache is full.
+void cacheStore(const uint8_t *uid, uint16_t uidLength, const struct cacheResult *result)
+{
+	if (table == NULL || uidLength == 0 || uidLength > CACHE_UID_LENGTH)
+		return;
+	
+	struct cacheEntry *e = cacheFind(uid, uidLength);
+	for (int i=0; i<CACHE_ENTRIES && e == NULL; i++)
+		if (table->entries[i].uidLength == 0)
+			e = &table->entries[i];
+	if (e == NULL)
+	{
+		e = &table->entries[0];
+		for (int i=1; i<CACHE_ENTRIES; i++)
+			if (table->entries[i].usedAt < e->usedAt)
+				e = &table->entries[i];
+	}
+	
+	e->uidLength = 0;
+	memcpy(&e->result, result, sizeof(struct cacheResult));
+	memcpy(e->uid, uid, uidLength);
+	e->storedAt = e->usedAt = cacheNow();
+	e->uidLength = uidLength;
+}
+
+// Drops the result of the card uid, which doesn't match the card any more.
+void cacheForget(const uint8_t *uid, uint16_t uidLength)
+{
+	struct cacheEntry *e = cacheFind(uid, uidLength);
+	if (e != NULL)
+		e->uidLength = 0;
+}
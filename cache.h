@@ -0,0 +1,75 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * cache.h: Results of the last cards read, to answer repeated taps.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CACHE_MAGIC      0x48434441 // "ADCH"
+#define CACHE_VERSION    1
+#define CACHE_ENTRIES    64
+#define CACHE_UID_LENGTH 10
+#define CACHE_PAN_LENGTH 10 // 19 digits at most, in BCD
+#define CACHE_AID_LENGTH 16
+
+// What a session extracted from a card
+struct cacheResult
+{
+	uint8_t panLength;			// 0 if not found
+	uint8_t pan[CACHE_PAN_LENGTH];
+	uint8_t expiryLength;		// 0 if not found
+	uint8_t expiry[3];			// YYMMDD, in BCD
+	uint8_t aidLength;			// application read, 0 if unknown
+	uint8_t aid[CACHE_AID_LENGTH];
+};
+
+struct cacheEntry
+{
+	uint8_t uidLength;			// 0 for a free entry
+	uint8_t uid[CACHE_UID_LENGTH];
+	uint64_t storedAt;			// ms since the Epoch
+	uint64_t usedAt;			// last stored or found, for LRU eviction
+	struct cacheResult result;
+};
+
+// Layout of the file backing the cache, if any. Entries of a file with
+// another magic, version or size are dropped.
+struct cacheTable
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;				// sizeof(struct cacheTable)
+	struct cacheEntry entries[CACHE_ENTRIES];
+};
+
+bool cacheOpen(int ttl, const char *path);
+void cacheClose(void);
+bool cacheLookup(const uint8_t *uid, uint16_t uidLength, struct cacheResult *result);
+void cacheStore(const uint8_t *uid, uint16_t uidLength, const struct cacheResult *result);
+void cacheForget(const uint8_t *uid, uint16_t uidLength);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * 
+ * cardflow.hpp: C++20 coroutines over the asynchronous APDU requests.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CARDFLOW_HPP
+#define CARDFLOW_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+#include "apdu.h"
+#include "loop.h"
+
+#define CARDFLOW_MAX_FLOWS  (APDU_MAX_SESSIONS*2) // frames in the pool
+#define CARDFLOW_FRAME_SIZE 4096 // bytes of each, larger frames go to the heap
+
+/*
+ * A card flow is a coroutine, written as straight-line code:
+ * 
+ *     cardflow::Flow readCard(cardflow::Session &session)
+ *     {
+ *         struct apduResponse response;
+ *         int res = co_await session.transceive(selectPpse, response);
+ *         ...
+ *     }
+ * 
+ * It runs until its first co_await, then each time the answer comes, from
+ * apduRunLoop: a single thread drives the flows of every open session, whose
+ * requests share the tagged window of their reader (see apduSubmit).
+ */
+
+namespace cardflow
+{
+
+// Coroutine frames, allocated once per flow from fixed blocks: APDUs
+// themselves allocate nothing, their awaiter lives in the frame.
+class FramePool
+{
+public:
+	static void* allocate(std::size_t size)
+	{
+		for (int i=0; i<CARDFLOW_MAX_FLOWS && size <= CARDFLOW_FRAME_SIZE; i++)
+		{
+			if (!used[i])
+			{
+				used[i] = true;
+				return blocks[i];
+			}
+		}
+		void *p = std::malloc(size);
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return p;
+	}
+	
+	static void release(void *p)
+	{
+		for (int i=0; i<CARDFLOW_MAX_FLOWS; i++)
+		{
+			if (p == blocks[i])
+			{
+				used[i] = false;
+				return;
+			}
+		}
+		std::free(p);
+	}
+	
+private:
+	alignas(std::max_align_t) inline static unsigned char blocks[CARDFLOW_MAX_FLOWS][CARDFLOW_FRAME_SIZE];
+	inline static bool used[CARDFLOW_MAX_FLOWS];
+};
+
+// Handle on a running flow. It starts at once, and its frame is kept
+// until the Flow is destroyed, so that done() can be asked.
+class Flow
+{
+public:
+	struct promise_type
+	{
+		Flow get_return_object() { return Flow(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::abort(); }
+		
+		static void* operator new(std::size_t size) { return FramePool::allocate(size); }
+		static void operator delete(void *p) { FramePool::release(p); }
+	};
+	
+	Flow() = default;
+	Flow(Flow &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	Flow& operator=(Flow &&other) noexcept
+	{
+		if (this != &other)
+		{
+			if (handle)
+				handle.destroy();
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+	Flow(const Flow&) = delete;
+	Flow& operator=(const Flow&) = delete;
+	~Flow()
+	{
+		if (handle)
+			handle.destroy();
+	}
+	
+	bool done() const { return !handle || handle.done(); }
+	
+private:
+	explicit Flow(std::coroutine_handle<promise_type> h) : handle(h) {}
+	std::coroutine_handle<promise_type> handle;
+};
+
+// Suspends a flow until the answer to its command comes. The answer goes
+// in response; co_await gives its rescode, as apduTransceive does.
+class TransceiveAwaiter
+{
+public:
+	TransceiveAwaiter(struct apduSession *session, const struct apduCommand &cmd,
+		struct apduResponse &response) : session(session), cmd(cmd), response(response) {}
+	
+	// The command is copied by apduSubmit, so it is sent from here. Once
+	// the session budget is spent, nothing is sent: it times out at once.
+	bool await_ready()
+	{
+		if (!apduSubmit(session, &cmd, complete, this))
+		{
+			response.rescode = apduSessionExpired() ? MYTERM_TIMEOUT : MYTERM_UNDEFERROR;
+			response.length = 0;
+			completed = true;
+		}
+		return completed;
+	}
+	
+	bool await_suspend(std::coroutine_handle<> h)
+	{
+		if (completed) // failed while being submitted
+			return false;
+		waiting = h;
+		return true;
+	}
+	
+	int await_resume() const { return response.rescode; }
+	
+private:
+	static void complete(struct apduResponse *r, void *user)
+	{
+		TransceiveAwaiter *a = static_cast<TransceiveAwaiter*>(user);
+		a->response.rescode = r->rescode;
+		a->response.length = r->length;
+		a->response.sw1 = r->sw1;
+		a->response.sw2 = r->sw2;
+		std::memcpy(a->response.data, r->data, r->length);
+		a->completed = true;
+		if (a->waiting)
+			a->waiting.resume();
+	}
+	
+	struct apduSession *session;
+	struct apduCommand cmd;
+	struct apduResponse &response;
+	std::coroutine_handle<> waiting;
+	bool completed = false;
+};
+
+// Asynchronous requests to the current card of a reader (see
+// apduSessionOpen). It must outlive the flows using it.
+class Session
+{
+public:
+	explicit Session(int serialPort) : session(apduSessionOpen(serialPort)) {}
+	Session(const Session&) = delete;
+	Session& operator=(const Session&) = delete;
+	~Session() { apduSessionClose(session); }
+	
+	bool isOpen() const { return session != nullptr; }
+	
+	TransceiveAwaiter transceive(const struct apduCommand &cmd, struct apduResponse &response)
+	{
+		return TransceiveAwaiter(session, cmd, response);
+	}
+	
+private:
+	struct apduSession *session;
+};
+
+// Runs the event loop until every flow is done. Returns false on error.
+template <std::size_t N>
+bool runFlows(Flow (&flows)[N])
+{
+	while (1)
+	{
+		bool running = false;
+		for (std::size_t i=0; i<N; i++)
+			running = running || !flows[i].done();
+		if (!running)
+			return true;
+		if (apduRunLoop() < 0)
+			return false;
+	}
+}
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * checkpoint.c: Where interrupted card sessions stopped, to resume them.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "checkpoint.h"
+#include "log.h"
+#include "main.h"
+#include <string.h>
+#include <time.h>
+
+// Only the last interrupted session is kept.
+static struct checkpoint saved;
+static uint8_t savedUid[CHECKPOINT_MAX_UID];
+static uint16_t savedUidLength = 0;
+static struct timespec savedAt;
+static bool pending = false;
+static int window = CHECKPOINT_WINDOW;
+
+// Sets how long an interrupted session can be resumed, in ms (0: never).
+void checkpointSetWindow(int ms)
+{
+	window = ms > 0 ? ms : 0;
+	pending = false;
+}
+
+// Keeps where the session of the card uid stopped. Returns false if it
+// can't be resumed.
+bool checkpointSave(const uint8_t *uid, uint16_t uidLength, const struct checkpoint *cp)
+{
+	pending = false;
+	if (window == 0 || uidLength == 0 || uidLength > CHECKPOINT_MAX_UID
+		|| cp->aidLength == 0 || cp->aidLength > CHECKPOINT_MAX_AID)
+		return false;
+	memcpy(&saved, cp, sizeof(saved));
+	memcpy(savedUid, uid, uidLength);
+	savedUidLength = uidLength;
+	clock_gettime(CLOCK_MONOTONIC, &savedAt);
+	pending = true;
+	return true;
+}
+
+// Gets the checkpoint of the card uid, if its session was interrupted
+// less than the window ago. It can be taken only once.
+bool checkpointTake(const uint8_t *uid, uint16_t uidLength, struct checkpoint *cp)
+{
+	if (!pending || uidLength != savedUidLength || memcmp(uid, savedUid, uidLength) != 0)
+		return false;
+	pending = false;
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed = (now.tv_sec-savedAt.tv_sec)*1000 + (now.tv_nsec-savedAt.tv_nsec)/1000000;
+	if (elapsed > window)
+	{
+		logMessage(LOG_MODULE_MAIN, LOG_INFO, "Checkpoint expired %ld ms ago", elapsed-window, 0);
+		return false;
+	}
+	memcpy(cp, &saved, sizeof(saved));
+	return true;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * checkpoint.h: Where interrupted card sessions stopped, to resume them.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CHECKPOINT_WINDOW  5000 // ms for the card to come back, by default
+#define CHECKPOINT_MAX_UID 10
+#define CHECKPOINT_MAX_AID 16
+
+// Where the reads of a session stopped: the application selected, and the
+// first record not read yet. The ones before it were read and parsed.
+struct checkpoint
+{
+	uint8_t aid[CHECKPOINT_MAX_AID];
+	uint8_t aidLength;
+	int aidIndex;		// among the applications of the PPSE
+	uint8_t sfi;
+	uint8_t record;
+};
+
+void checkpointSetWindow(int ms);
+bool checkpointSave(const uint8_t *uid, uint16_t uidLength, const struct checkpoint *cp);
+bool checkpointTake(const uint8_t *uid, uint16_t uidLength, struct checkpoint *cp);
+
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * crc.h: CRC-16 of the frames, with MYTERM_CONFIG_CRC. Mirrored in
+ * APDU_TERMINAL.ino.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+
+uint16_t crc16(uint16_t crc, const uint8_t *data, unsigned int length);
+
+#endif
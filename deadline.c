@@ -0,0 +1,251 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * deadline.c: Per-command card timeouts, from the observed latencies.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "deadline.h"
+#include "mycodes.h"
+#include "log.h"
+#include "main.h"
+#include <math.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Latency of an instruction on a reader, as exponentially weighted moving
+// averages (weight DEADLINE_ALPHA for the last sample), in ms.
+struct deadlineEstimate
+{
+	double mean;
+	double variance;
+	uint32_t samples;
+};
+
+#define DEADLINE_ALPHA 0.125
+
+// Each slot is only used by the thread driving its reader, once claimed.
+struct deadlineReader
+{
+	_Atomic int used;
+	int port;
+	struct deadlineEstimate ins[256];
+	struct deadlineEstimate all;	// every instruction, for those not known yet
+};
+
+static struct deadlineReader readers[DEADLINE_MAX_READERS];
+
+// A command and its response are always handled by the same thread, as
+// in stats.c.
+static _Thread_local struct timespec pendingStart;
+static _Thread_local int pendingIns = -1;
+static _Thread_local uint16_t pendingDeadline = 0;
+static _Thread_local bool pendingCut = false;	// by the session budget
+
+// Time budget of the session of the card in the field, in ms (0 if none).
+// Each session is driven by a single thread too.
+static _Thread_local int sessionBudget = 0;
+static _Thread_local struct timespec sessionStart;
+static _Thread_local bool sessionCut = false;	// a command failed for lack of budget
+
+// Find the slot of a reader, claiming a free one the first time.
+static struct deadlineReader* deadlineSlot(int port)
+{
+	for (int i=0; i<DEADLINE_MAX_READERS; i++)
+	{
+		struct deadlineReader *slot = &readers[i];
+		int used = atomic_load_explicit(&slot->used, memory_order_acquire);
+
+		if (used == 1 && slot->port == port)
+			return slot;
+		if (used == 0)
+		{
+			int expected = 0;
+			if (atomic_compare_exchange_strong(&slot->used, &expected, 2))
+			{
+				slot->port = port;
+				atomic_store_explicit(&slot->used, 1, memory_order_release);
+				return slot;
+			}
+			while (atomic_load_explicit(&slot->used, memory_order_acquire) != 1);
+			if (slot->port == port)
+				return slot;
+		}
+	}
+	return NULL;
+}
+
+static void deadlineAddSample(struct deadlineEstimate *e, double ms)
+{
+	if (e->samples++ == 0)
+	{
+		// As for the first round trip time of TCP (RFC 6298)
+		e->mean = ms;
+		e->variance = ms*ms/4;
+		return;
+	}
+	double delta = ms-e->mean;
+	e->mean += DEADLINE_ALPHA*delta;
+	e->variance = (1-DEADLINE_ALPHA)*(e->variance + DEADLINE_ALPHA*delta*delta);
+}
+
+static double deadlineElapsedMs(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec-start->tv_sec)*1000.0 + (now.tv_nsec-start->tv_nsec)/1e6;
+}
+
+// Time the card may take to answer ins: mean + DEADLINE_DEVIATIONS sigma of
+// its last latencies. Until they are known, those of every instruction of
+// the reader are used, then DEADLINE_DEFAULT.
+static uint16_t deadlineEstimate(int port, uint8_t ins)
+{
+	struct deadlineReader *slot = deadlineSlot(port);
+	if (slot == NULL)
+		return DEADLINE_DEFAULT;
+
+	struct deadlineEstimate *e = &slot->ins[ins];
+	if (e->samples < DEADLINE_MIN_SAMPLES)
+		e = &slot->all;
+	if (e->samples < DEADLINE_MIN_SAMPLES)
+		return DEADLINE_DEFAULT;
+
+	double ms = ceil(e->mean + DEADLINE_DEVIATIONS*sqrt(e->variance));
+	if (ms < DEADLINE_FLOOR)
+		return DEADLINE_FLOOR;
+	if (ms > DEADLINE_MAX)
+		return DEADLINE_MAX;
+	return (uint16_t) ms;
+}
+
+// Deadline of a command: its estimate, within what is left of the session
+// budget. 0 once the budget is spent: the command must not be sent. cut,
+// if not NULL, tells if the budget shortened it.
+uint16_t deadlineFor(int port, uint8_t ins, bool *cut)
+{
+	uint16_t deadline = deadlineEstimate(port, ins);
+	int left = deadlineSessionLeft();
+	bool shortened = left >= 0 && left < deadline;
+	if (cut != NULL)
+		*cut = shortened;
+	return shortened ? left : deadline;
+}
+
+// Same, for a command sent now, whose answer is measured by deadlineEnd.
+uint16_t deadlineBegin(int port, uint8_t ins)
+{
+	pendingIns = ins;
+	pendingDeadline = deadlineFor(port, ins, &pendingCut);
+	if (pendingDeadline == 0)
+		sessionCut = true;
+	clock_gettime(CLOCK_MONOTONIC, &pendingStart);
+	return pendingDeadline;
+}
+
+// How long the computer waits for the answer to the pending command, in
+// ms: the board gives up at the deadline, then the answer has to come.
+// 0 if the command was not sent, -1 if none is pending.
+int deadlineWaitTimeout(void)
+{
+	if (pendingIns < 0)
+		return -1;
+	return pendingDeadline > 0 ? pendingDeadline + DEADLINE_MARGIN : 0;
+}
+
+// Takes the latency of a command into account. A command which timed out
+// counts as twice its deadline, so that a card slower than expected gets
+// more time next time, unless the session budget had cut the deadline.
+static void deadlineSample(int port, int ins, uint16_t deadline, bool cut, int rescode, double ms)
+{
+	if (rescode == MYTERM_TIMEOUT && cut)
+		sessionCut = true;
+	if (ins < 0 || deadline == 0 || (rescode != MYTERM_OK && rescode != MYTERM_TIMEOUT)
+		|| (rescode == MYTERM_TIMEOUT && cut))
+		return;
+
+	struct deadlineReader *slot = deadlineSlot(port);
+	if (slot == NULL)
+		return;
+
+	if (rescode == MYTERM_TIMEOUT)
+	{
+		ms = 2.0*deadline;
+		logMessage(LOG_MODULE_APDU, LOG_WARNING, "INS %02lx timed out after %ld ms", ins, deadline);
+	}
+	deadlineAddSample(&slot->ins[ins], ms);
+	deadlineAddSample(&slot->all, ms);
+}
+
+// Takes the latency of the pending command into account.
+void deadlineEnd(int port, int rescode)
+{
+	int ins = pendingIns;
+	pendingIns = -1;
+	deadlineSample(port, ins, pendingDeadline, pendingCut, rescode, deadlineElapsedMs(&pendingStart));
+}
+
+// Same, for a command which was not sent by deadlineBegin (batches, tagged
+// commands): deadline and cut are the ones given by deadlineFor when it
+// was sent, and ms the time the card took, as measured by the caller.
+void deadlineRecord(int port, uint8_t ins, uint16_t deadline, bool cut, int rescode, double ms)
+{
+	deadlineSample(port, ins, deadline, cut, rescode, ms);
+}
+
+// Starts the time budget of a session, in ms (0 for none). The deadlines
+// of its commands are cut to what is left of it.
+void deadlineSessionStart(int budget)
+{
+	sessionBudget = budget > 0 ? budget : 0;
+	sessionCut = false;
+	clock_gettime(CLOCK_MONOTONIC, &sessionStart);
+}
+
+void deadlineSessionEnd(void)
+{
+	sessionBudget = 0;
+}
+
+// ms left in the budget of the session, -1 without budget.
+int deadlineSessionLeft(void)
+{
+	if (sessionBudget == 0)
+		return -1;
+	double left = sessionBudget - deadlineElapsedMs(&sessionStart);
+	return left > 0 ? (int) left : 0;
+}
+
+// Whether the budget of the session is spent. The caller is about to give
+// up on a command: the session is then reported as cut.
+bool deadlineSessionOver(void)
+{
+	if (deadlineSessionLeft() != 0)
+		return false;
+	sessionCut = true;
+	return true;
+}
+
+// Whether a command of the session failed for lack of budget.
+bool deadlineSessionCut(void)
+{
+	return sessionCut;
+}
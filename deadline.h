@@ -0,0 +1,52 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * deadline.h: Per-command card timeouts, from the observed latencies.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DEADLINE_DEFAULT     10000 // ms, until an instruction has enough samples
+#define DEADLINE_FLOOR       50    // ms
+#define DEADLINE_MAX         60000 // ms, it takes 2 bytes in the frames
+#define DEADLINE_MIN_SAMPLES 3
+#define DEADLINE_DEVIATIONS  4     // deadline = mean + DEADLINE_DEVIATIONS * sigma
+#define DEADLINE_MARGIN      500   // ms the computer adds for the serial link
+#define DEADLINE_MAX_READERS 16
+
+uint16_t deadlineFor(int port, uint8_t ins, bool *cut);
+uint16_t deadlineBegin(int port, uint8_t ins);
+int deadlineWaitTimeout(void);
+void deadlineEnd(int port, int rescode);
+void deadlineRecord(int port, uint8_t ins, uint16_t deadline, bool cut, int rescode, double ms);
+
+void deadlineSessionStart(int budget);
+void deadlineSessionEnd(void);
+int deadlineSessionLeft(void);
+bool deadlineSessionOver(void);
+bool deadlineSessionCut(void);
+
+#endif
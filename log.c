@@ -0,0 +1,285 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * log.c: Asynchronous logging with per-module levels. Records are
+ * pushed in binary form to a lock-free queue, and formatted by a
+ * background thread.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+#include "main.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LOG_POLL_INTERVAL 2000000 // ns
+
+enum
+{
+	LOG_TYPE_MESSAGE,
+	LOG_TYPE_HEX
+};
+
+struct logRecord
+{
+	_Atomic size_t seq;
+	uint64_t ts;			// us, CLOCK_MONOTONIC
+	uint8_t module;
+	uint8_t level;
+	uint8_t type;
+	const char *format;		// or label for LOG_TYPE_HEX
+	long args[2];
+	uint16_t length;
+	uint8_t payload[LOG_PAYLOAD_SIZE];
+};
+
+#ifdef LOGLEVEL_DEBUG
+uint8_t logLevels[LOG_MODULE_COUNT] = {LOG_DEBUG, LOG_DEBUG, LOG_DEBUG, LOG_DEBUG};
+#else
+uint8_t logLevels[LOG_MODULE_COUNT] = {LOG_NONE, LOG_NONE, LOG_NONE, LOG_NONE};
+#endif
+
+static const char *MODULE_NAMES[LOG_MODULE_COUNT] = {"serial", "apdu", "tlv", "main"};
+static const char *LEVEL_NAMES[] = {"none", "error", "warning", "info", "debug"};
+
+// Bounded multi-producer queue (D. Vyukov): a record can be filled when
+// its seq equals the enqueue position, and read when it equals the
+// dequeue position + 1.
+static struct logRecord queue[LOG_QUEUE_SIZE];
+static _Atomic size_t enqueuePos = 0;
+static size_t dequeuePos = 0;
+static _Atomic uint64_t dropped = 0;
+
+static pthread_t logThread;
+static _Atomic bool running = false;
+
+static struct logRecord* logAcquire(void)
+{
+	size_t pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+	while (1)
+	{
+		struct logRecord *rec = &queue[pos & (LOG_QUEUE_SIZE-1)];
+		size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+		if (dif == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&enqueuePos, &pos, pos+1,
+				memory_order_relaxed, memory_order_relaxed))
+			{
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				rec->ts = (uint64_t) now.tv_sec*1000000 + now.tv_nsec/1000;
+				return rec;
+			}
+		}
+		else if (dif < 0)
+		{
+			// Queue is full: never block the caller, drop the record.
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return NULL;
+		}
+		else
+			pos = atomic_load_explicit(&enqueuePos, memory_order_relaxed);
+	}
+}
+
+static void logRelease(struct logRecord *rec)
+{
+	size_t seq = atomic_load_explicit(&rec->seq, memory_order_relaxed);
+	atomic_store_explicit(&rec->seq, seq+1, memory_order_release);
+}
+
+void logPushMessage(uint8_t module, uint8_t level, const char *format, long a, long b)
+{
+	struct logRecord *rec = logAcquire();
+	if (rec == NULL)
+		return;
+
+	rec->module = module;
+	rec->level = level;
+	rec->type = LOG_TYPE_MESSAGE;
+	rec->format = format;
+	rec->args[0] = a;
+	rec->args[1] = b;
+	rec->length = 0;
+	logRelease(rec);
+}
+
+void logPushHex(uint8_t module, uint8_t level, const char *label, const uint8_t *data, unsigned int length)
+{
+	struct logRecord *rec = logAcquire();
+	if (rec == NULL)
+		return;
+
+	rec->module = module;
+	rec->level = level;
+	rec->type = LOG_TYPE_HEX;
+	rec->format = label;
+	rec->args[0] = (long) length;
+	if (length > LOG_PAYLOAD_SIZE)
+		length = LOG_PAYLOAD_SIZE;
+	rec->length = (uint16_t) length;
+	if (length > 0 && data != NULL)
+		memcpy(rec->payload, data, length);
+	logRelease(rec);
+}
+
+static void logFormat(struct logRecord *rec)
+{
+	fprintf(stderr, "[%6llu.%06llu] %s %s: ",
+		(unsigned long long) rec->ts/1000000, (unsigned long long) rec->ts%1000000,
+		MODULE_NAMES[rec->module], LEVEL_NAMES[rec->level]);
+
+	if (rec->type == LOG_TYPE_MESSAGE)
+		fprintf(stderr, rec->format, rec->args[0], rec->args[1]);
+	else
+	{
+		fprintf(stderr, "%s (%ld bytes)", rec->format, rec->args[0]);
+		for (uint16_t i=0; i<rec->length; i++)
+			fprintf(stderr, " %02X", rec->payload[i]);
+		if (rec->args[0] > rec->length)
+			fprintf(stderr, " ...");
+	}
+	fprintf(stderr, "\n");
+}
+
+// Formats every available record. Returns the number of records read.
+static int logDrain(void)
+{
+	int count = 0;
+	while (1)
+	{
+		struct logRecord *rec = &queue[dequeuePos & (LOG_QUEUE_SIZE-1)];
+		size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+		if (seq != dequeuePos+1)
+			break;
+
+		logFormat(rec);
+		atomic_store_explicit(&rec->seq, dequeuePos+LOG_QUEUE_SIZE, memory_order_release);
+		dequeuePos++;
+		count++;
+	}
+
+	uint64_t d = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+	if (d > 0)
+		fprintf(stderr, "Log queue full, %llu records dropped.\n", (unsigned long long) d);
+	return count;
+}
+
+static void* logThreadMain(void *arg)
+{
+	(void) arg;
+	const struct timespec interval = {0, LOG_POLL_INTERVAL};
+
+	while (atomic_load(&running))
+	{
+		if (logDrain() == 0)
+			nanosleep(&interval, NULL);
+	}
+	logDrain();
+	return NULL;
+}
+
+static int logParseLevel(const char *str, size_t len)
+{
+	for (int i=LOG_NONE; i<=LOG_DEBUG; i++)
+		if (strlen(LEVEL_NAMES[i]) == len && strncmp(str, LEVEL_NAMES[i], len) == 0)
+			return i;
+	return -1;
+}
+
+// spec is a comma separated list of "module=level", or a single level
+// applied to every module, e.g. "serial=debug,apdu=info" or "debug".
+static bool logParseSpec(const char *spec)
+{
+	while (*spec != '\0')
+	{
+		size_t len = strcspn(spec, ",");
+		const char *eq = memchr(spec, '=', len);
+		int level;
+
+		if (eq == NULL)
+		{
+			if ((level = logParseLevel(spec, len)) < 0)
+				return false;
+			for (int i=0; i<LOG_MODULE_COUNT; i++)
+				logLevels[i] = level;
+		}
+		else
+		{
+			int module = -1;
+			for (int i=0; i<LOG_MODULE_COUNT; i++)
+				if (strlen(MODULE_NAMES[i]) == (size_t) (eq-spec) && strncmp(spec, MODULE_NAMES[i], eq-spec) == 0)
+					module = i;
+			if (module < 0 || (level = logParseLevel(eq+1, len-(eq-spec)-1)) < 0)
+				return false;
+			logLevels[module] = level;
+		}
+
+		spec += len;
+		if (*spec == ',')
+			spec++;
+	}
+	return true;
+}
+
+bool logStart(const char *spec)
+{
+	if (spec != NULL && !logParseSpec(spec))
+	{
+		fprintf(stderr, "Invalid log specification: %s\n", spec);
+		return false;
+	}
+
+	bool enabled = false;
+	for (int i=0; i<LOG_MODULE_COUNT; i++)
+		if (logLevels[i] > LOG_NONE)
+			enabled = true;
+	if (!enabled)
+		return true;
+
+	for (size_t i=0; i<LOG_QUEUE_SIZE; i++)
+		atomic_store_explicit(&queue[i].seq, i, memory_order_relaxed);
+
+	atomic_store(&running, true);
+	if (pthread_create(&logThread, NULL, logThreadMain, NULL) != 0)
+	{
+		fprintf(stderr, "Unable to start the log thread.\n");
+		atomic_store(&running, false);
+		for (int i=0; i<LOG_MODULE_COUNT; i++)
+			logLevels[i] = LOG_NONE;
+		return false;
+	}
+	atexit(logStop);
+	return true;
+}
+
+void logStop(void)
+{
+	if (!atomic_exchange(&running, false))
+		return;
+	pthread_join(logThread, NULL);
+}
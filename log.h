@@ -0,0 +1,77 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * log.h: Asynchronous logging with per-module levels. Records are
+ * pushed in binary form to a lock-free queue, and formatted by a
+ * background thread.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+	LOG_MODULE_SERIAL,
+	LOG_MODULE_APDU,
+	LOG_MODULE_TLV,
+	LOG_MODULE_MAIN,
+	LOG_MODULE_COUNT
+};
+
+enum
+{
+	LOG_NONE,
+	LOG_ERROR,
+	LOG_WARNING,
+	LOG_INFO,
+	LOG_DEBUG
+};
+
+#define LOG_QUEUE_SIZE   1024 // records, power of 2
+#define LOG_PAYLOAD_SIZE 264  // bytes kept of a hex dump, a short frame; longer ones end with "..."
+
+extern uint8_t logLevels[LOG_MODULE_COUNT];
+
+bool logStart(const char *spec);
+void logStop(void);
+void logPushMessage(uint8_t module, uint8_t level, const char *format, long a, long b);
+void logPushHex(uint8_t module, uint8_t level, const char *label, const uint8_t *data, unsigned int length);
+
+// The format must be a string literal, taking at most two long
+// arguments (%ld, %lx...): it is only formatted later.
+#define logMessage(module, level, format, a, b) \
+	do { if (logLevels[module] >= (level)) logPushMessage(module, level, format, a, b); } while (0)
+#define logHex(module, level, label, data, length) \
+	do { if (logLevels[module] >= (level)) logPushHex(module, level, label, data, length); } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * 
+ * loop.c: Event loop on epoll, driving the asynchronous APDU requests.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "loop.h"
+#include "log.h"
+#include "main.h"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+// Descriptors watched, with what to run when they can be read. epoll
+// events point to them. The loop is driven by a single thread.
+struct loopWatch
+{
+	bool used;
+	int fd;
+	loopHandler handler;
+	void *ctx;
+};
+
+static struct loopWatch watches[LOOP_MAX_WATCHES];
+static int epollFd = -1;
+
+bool loopOpen(void)
+{
+	if (epollFd >= 0)
+		return true;
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0)
+	{
+		perror("Error while creating event loop : ");
+		return false;
+	}
+	return true;
+}
+
+// Runs handler each time fd can be read, from loopRun: it should read
+// what is there, and no more. Returns false if fd can't be watched.
+bool loopWatch(int fd, loopHandler handler, void *ctx)
+{
+	struct loopWatch *w = NULL;
+	for (int i=0; i<LOOP_MAX_WATCHES && w == NULL; i++)
+		if (!watches[i].used)
+			w = &watches[i];
+	if (epollFd < 0 || w == NULL)
+		return false;
+	
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = w;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+	{
+		logMessage(LOG_MODULE_MAIN, LOG_ERROR, "Can't watch descriptor %ld (errno %ld)", fd, errno);
+		return false;
+	}
+	w->used = true;
+	w->fd = fd;
+	w->handler = handler;
+	w->ctx = ctx;
+	return true;
+}
+
+void loopUnwatch(int fd)
+{
+	for (int i=0; i<LOOP_MAX_WATCHES; i++)
+	{
+		if (watches[i].used && watches[i].fd == fd)
+		{
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+			watches[i].used = false;
+		}
+	}
+}
+
+// Waits up to timeout ms (forever if negative) for watched descriptors
+// to be readable, and runs their handlers. Returns how many ran, -1 on
+// error.
+int loopRun(int timeout)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	
+	if (epollFd < 0)
+		return -1;
+	int n = epoll_wait(epollFd, events, LOOP_MAX_EVENTS, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	for (int i=0; i<n; i++)
+	{
+		// A handler may have unwatched another descriptor meanwhile.
+		struct loopWatch *w = events[i].data.ptr;
+		if (w->used)
+			w->handler(w->fd, w->ctx);
+	}
+	return n;
+}
+
+void loopClose(void)
+{
+	if (epollFd < 0)
+		return;
+	close(epollFd);
+	epollFd = -1;
+	for (int i=0; i<LOOP_MAX_WATCHES; i++)
+		watches[i].used = false;
+}
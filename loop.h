@@ -0,0 +1,51 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * 
+ * loop.h: Event loop on epoll, driving the asynchronous APDU requests.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LOOP_MAX_WATCHES 64 // file descriptors watched at once
+#define LOOP_MAX_EVENTS  16 // handled per round
+
+typedef void (*loopHandler)(int fd, void *ctx);
+
+bool loopOpen(void);
+bool loopWatch(int fd, loopHandler handler, void *ctx);
+void loopUnwatch(int fd);
+int loopRun(int timeout);
+void loopClose(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
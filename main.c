@@ -33,34 +33,670 @@
 #include "mycodes.h"
 #include "apdu.h"
 #include "tlv.h"
+#include "script.h"
+#include "stats.h"
+#include "statpage.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "cache.h"
+#include "loop.h"
+#include "log.h"
 #include "main.h"
 
 
-void printBuffer(uint8_t *buffer, uint8_t len)
+#define MAX_RECORDS 31
+
+// What the session of the card in the field extracted, for the cache
+static struct cacheResult cardResult;
+
+// Records are read with apduSubmit, from the event loop (-a)
+static bool asyncReads = false;
+
+void printBuffer(uint8_t *buffer, uint16_t len)
 {
 	if (len > 0)
 	{
-		for (uint8_t j=0; j<len; j++)
+		for (uint16_t j=0; j<len; j++)
 			printf("%02x",buffer[j]);
 		printf("\n");
 	}
 }
 
+void printCardNumber(uint8_t *pan, uint16_t length)
+{
+	printf("### Card number ###\n");
+	printBuffer(pan, length);
+	printf("\n");
+}
+
+void printExpirationDate(uint8_t *date)
+{
+	printf("### Expiration date ###\n");
+	printf("%02x/%02x\n\n", date[1], date[0]);
+}
+
+// Prints card number and expiration date if the record contains them.
+bool printCardData(uint8_t *buffer, uint16_t buflen)
+{
+	bool data_found = false;
+	
+	traceBegin("TLV parsing");
+	struct TLVobject *rec = tlvParseData(buffer, buflen);
+	
+	struct TLVobject *card_number = tlvObjectLookForTag(rec, 0x5a);
+	struct TLVobject *expiration_date = tlvObjectLookForTag(rec, 0x5f24);
+	traceEnd("TLV parsing");
+	
+	traceBegin("output");
+	if (card_number != NULL)
+	{
+		printCardNumber((uint8_t*) card_number->data[0], card_number->length);
+		if (card_number->length <= CACHE_PAN_LENGTH)
+		{
+			memcpy(cardResult.pan, card_number->data[0], card_number->length);
+			cardResult.panLength = card_number->length;
+		}
+		data_found = true;
+	}
+	
+	if (expiration_date != NULL)
+	{
+		printExpirationDate((uint8_t*) expiration_date->data[0]);
+		if (expiration_date->length == sizeof(cardResult.expiry))
+		{
+			memcpy(cardResult.expiry, expiration_date->data[0], expiration_date->length);
+			cardResult.expiryLength = expiration_date->length;
+		}
+		data_found = true;
+	}
+	traceEnd("output");
+	tlvObjectFree(rec);
+	return data_found;
+}
+
+// Reads count records of a SFI, starting from first. With more than one
+// record, they are read in a single batch, which stops at the first error.
+// Returns the number of responses.
+int readRecords(int serialPort, uint8_t sfi, uint8_t first, int count, struct apduResponse *responses)
+{
+	if (count <= 1)
+	{
+		struct apduCommand cmd = {0x00,0xB2,first,(sfi << 3)|04,0x00,NULL,0x00,true};
+		apduTransceive(serialPort, &cmd, &responses[0]);
+		return 1;
+	}
+	
+	struct apduCommand commands[MAX_RECORDS];
+	if (count > MAX_RECORDS)
+		count = MAX_RECORDS;
+	for (int i=0; i<count; i++)
+	{
+		struct apduCommand cmd = {0x00,0xB2,first+i,(sfi << 3)|04,0x00,NULL,0x00,true};
+		commands[i] = cmd;
+	}
+	int received = apduSendBatch(serialPort, commands, count, MYTERM_BATCH_STOPONERROR, responses);
+	
+	// Batch answers are limited to 255 bytes: longer records are read
+	// alone, then the batch goes on.
+	if (received > 0 && responses[received-1].rescode == MYTERM_READERROR)
+	{
+		struct apduResponse *r = &responses[received-1];
+		readRecords(serialPort, sfi, first+received-1, 1, r);
+		if (received < count && r->rescode == MYTERM_OK && r->sw1 == 0x90 && r->sw2 == 0x00)
+			received += readRecords(serialPort, sfi, first+received, count-received, responses+received);
+	}
+	return received;
+}
+
+// Outcome of reading card data
+enum readStatus
+{
+	READ_NOTFOUND,
+	READ_FOUND,
+	READ_INTERRUPTED	// by a transient failure: the session can be resumed
+};
+
+// Whether a command got no answer from the card (timeout, serial error),
+// instead of an error from it: the same command may work on a next tap.
+bool transientFailure(int rescode)
+{
+	return rescode == MYTERM_TIMEOUT || rescode == MYTERM_READERROR || rescode == MYTERM_WRITEERROR;
+}
+
+// Reads the records of a SFI from first on, by batches of batchSize,
+// printing card data as soon as it comes. If interrupted, *next is the
+// first record not read.
+enum readStatus readRecordsBatched(int serialPort, uint8_t sfi, uint8_t first, int batchSize, uint8_t *next)
+{
+	struct apduResponse responses[MAX_RECORDS];
+	uint8_t record_number = first;
+	
+	while (record_number <= MAX_RECORDS)
+	{
+		int count = MAX_RECORDS+1-record_number;
+		if (count > batchSize)
+			count = batchSize;
+		
+		int received = readRecords(serialPort, sfi, record_number, count, responses);
+		int i;
+		for (i=0; i<received; i++)
+		{
+			if (transientFailure(responses[i].rescode))
+			{
+				*next = record_number+i;
+				return READ_INTERRUPTED;
+			}
+			if (responses[i].rescode != MYTERM_OK || responses[i].sw1 != 0x90
+				|| responses[i].sw2 != 0x00)
+				break;
+			if (printCardData(responses[i].data, responses[i].length))
+				return READ_FOUND;
+		}
+		
+		// Stop at the end of the file
+		if (i < count)
+			break;
+		record_number += count;
+	}
+	return READ_NOTFOUND;
+}
+
+// Same, with up to windowSize tagged requests in flight. Requests still in
+// flight after the data or the end of the file are waited for and dropped.
+enum readStatus readRecordsPipelined(int serialPort, uint8_t sfi, uint8_t first, int windowSize, uint8_t *next)
+{
+	int tags[APDU_MAX_WINDOW];
+	struct apduResponse response;
+	int count = MAX_RECORDS+1-first;
+	int submitted = 0, done = 0;
+	bool stop = false, cut = false;
+	enum readStatus status = READ_NOTFOUND;
+	
+	while (done < submitted || (!stop && !cut && submitted < count))
+	{
+		// Keep the window full
+		while (!stop && !cut && submitted < count && submitted-done < windowSize)
+		{
+			struct apduCommand cmd = {0x00,0xB2,first+submitted,(sfi << 3)|04,0x00,NULL,0x00,true};
+			int tag = apduSubmitCommand(serialPort, &cmd);
+			if (tag < 0)
+			{
+				// Out of session budget: the requests in flight are still read
+				cut = apduSessionExpired();
+				break;
+			}
+			tags[submitted % APDU_MAX_WINDOW] = tag;
+			submitted++;
+		}
+		if (done == submitted)
+			break;
+		
+		int res = apduWaitForTagged(serialPort, tags[done % APDU_MAX_WINDOW], &response);
+		done++;
+		if (stop)
+			continue;
+		if (transientFailure(res))
+		{
+			*next = first+done-1;
+			stop = true;
+			status = READ_INTERRUPTED;
+		}
+		else if (res != MYTERM_OK || response.sw1 != 0x90 || response.sw2 != 0x00)
+			stop = true;
+		else if (printCardData(response.data, response.length))
+		{
+			stop = true;
+			status = READ_FOUND;
+		}
+	}
+	if (cut && !stop)
+	{
+		*next = first+submitted;
+		status = READ_INTERRUPTED;
+	}
+	return status;
+}
+
+// Reads of readRecordsAsync, shared by the completions of its requests
+struct asyncRecord
+{
+	struct asyncRead *read;
+	uint8_t record;
+};
+
+struct asyncRead
+{
+	struct apduSession *session;
+	uint8_t sfi;
+	uint8_t submitted;		// next record to ask for
+	uint8_t interrupted;	// first record not read, if interrupted
+	bool stop, cut;
+	enum readStatus status;
+	struct asyncRecord requests[MAX_RECORDS+1];
+};
+
+// Asks for the next record, unless the reads are over.
+static void submitRecord(struct asyncRead *r);
+
+// Completion of a READ RECORD. The next record is asked for at once, so
+// that as many are in flight as at the start.
+static void recordRead(struct apduResponse *response, void *user)
+{
+	struct asyncRecord *req = user;
+	struct asyncRead *r = req->read;
+	
+	if (r->stop)
+		return;
+	if (transientFailure(response->rescode))
+	{
+		r->interrupted = req->record;
+		r->stop = true;
+		r->status = READ_INTERRUPTED;
+	}
+	else if (response->rescode != MYTERM_OK || response->sw1 != 0x90 || response->sw2 != 0x00)
+		r->stop = true;
+	else if (printCardData(response->data, response->length))
+	{
+		r->stop = true;
+		r->status = READ_FOUND;
+	}
+	else
+		submitRecord(r);
+}
+
+static void submitRecord(struct asyncRead *r)
+{
+	if (r->stop || r->cut || r->submitted > MAX_RECORDS)
+		return;
+	struct apduCommand cmd = {0x00,0xB2,r->submitted,(r->sfi << 3)|04,0x00,NULL,0x00,true};
+	struct asyncRecord *req = &r->requests[r->submitted];
+	req->read = r;
+	req->record = r->submitted;
+	if (!apduSubmit(r->session, &cmd, recordRead, req))
+	{
+		// Out of session budget: the requests in flight are still read
+		r->cut = apduSessionExpired();
+		r->stop = !r->cut;
+		return;
+	}
+	r->submitted++;
+}
+
+// Same as readRecordsPipelined, with asynchronous requests: windowSize of
+// them are submitted, and each completion submits the next one.
+enum readStatus readRecordsAsync(int serialPort, uint8_t sfi, uint8_t first, int windowSize, uint8_t *next)
+{
+	struct asyncRead r;
+	memset(&r, 0, sizeof(r));
+	r.session = apduSessionOpen(serialPort);
+	if (r.session == NULL)
+		return readRecordsPipelined(serialPort, sfi, first, windowSize, next);
+	r.sfi = sfi;
+	r.submitted = first;
+	r.status = READ_NOTFOUND;
+	
+	for (int i=0; i<windowSize; i++)
+		submitRecord(&r);
+	while (apduSessionPending(r.session) > 0 && apduRunLoop() >= 0);
+	apduSessionClose(r.session);
+	
+	if (r.status == READ_INTERRUPTED)
+		*next = r.interrupted;
+	else if (r.cut && !r.stop)
+	{
+		*next = r.submitted;
+		r.status = READ_INTERRUPTED;
+	}
+	return r.status;
+}
+
+// Selects the application of the checkpoint, then reads its records, SFI
+// by SFI, from the SFI and record of the checkpoint on. If interrupted,
+// they are moved to the first record not read.
+enum readStatus readApplication(int serialPort, struct checkpoint *cp, int batchSize, int windowSize)
+{
+	struct apduResponse response;
+	struct apduCommand select = {0x00,0xA4,0x04,0x00,cp->aidLength,cp->aid,0x00,true};
+	
+	if (transientFailure(apduTransceive(serialPort, &select, &response)))
+		return READ_INTERRUPTED;
+	
+	for (; cp->sfi<16; cp->sfi++, cp->record = 1)
+	{
+		enum readStatus status;
+		if (windowSize > 1 && asyncReads)
+			status = readRecordsAsync(serialPort, cp->sfi, cp->record, windowSize, &cp->record);
+		else if (windowSize > 1)
+			status = readRecordsPipelined(serialPort, cp->sfi, cp->record, windowSize, &cp->record);
+		else
+			status = readRecordsBatched(serialPort, cp->sfi, cp->record, batchSize, &cp->record);
+		if (status == READ_FOUND)
+		{
+			memcpy(cardResult.aid, cp->aid, cp->aidLength);
+			cardResult.aidLength = cp->aidLength;
+		}
+		if (status != READ_NOTFOUND)
+			return status;
+	}
+	return READ_NOTFOUND;
+}
+
+// Keeps where the session of the card stopped, for its next tap.
+void saveCheckpoint(struct checkpoint *cp)
+{
+	uint8_t uid[CHECKPOINT_MAX_UID];
+	uint16_t uidLength = apduCardUid(uid, sizeof(uid));
+	
+	if (checkpointSave(uid, uidLength, cp))
+		printf("Card session interrupted at SFI %d, record %d: tap the card again to resume.\n\n",
+			cp->sfi, cp->record);
+	else
+		printf("Card session interrupted.\n\n");
+}
+
+// Reads card number and expiration date, with a SELECT PPSE, then a
+// SELECT of each AID, and reading records one after another. The session
+// of a card interrupted on its last tap is resumed where it stopped.
+// Returns 1 if data was found, 0 otherwise, and -1 if the card has no FCI.
+int readCard(int serialPort, int batchSize, int windowSize)
+{
+	struct apduResponse response;
+	struct checkpoint cp;
+	uint8_t uid[CHECKPOINT_MAX_UID];
+	uint16_t uidLength = apduCardUid(uid, sizeof(uid));
+	int firstAid = 0;
+	
+	// The board may have selected the PPSE already (-p)
+	bool ppseAnswered = apduTakePpseResponse(&response);
+	
+	// The records before the checkpoint were read and parsed already
+	if (checkpointTake(uid, uidLength, &cp))
+	{
+		printf("Resuming at SFI %d, record %d.\n", cp.sfi, cp.record);
+		enum readStatus status = readApplication(serialPort, &cp, batchSize, windowSize);
+		if (status == READ_INTERRUPTED)
+			saveCheckpoint(&cp);
+		if (status != READ_NOTFOUND)
+			return status == READ_FOUND ? 1 : 0;
+		firstAid = cp.aidIndex+1;
+	}
+	
+	if (!ppseAnswered)
+	{
+		struct apduCommand select = {0x00,0xA4,0x04,0x00,0x0E,(uint8_t*) "2PAY.SYS.DDF01",0x00,true};
+		if (transientFailure(apduTransceive(serialPort, &select, &response)))
+		{
+			printf("Card session interrupted.\n\n");
+			return 0;
+		}
+	}
+	
+	// Look for FCI. This tag contains the application templates, with the AID.
+	traceBegin("TLV parsing");
+	struct TLVobject *d = tlvParseData(response.data, response.length);
+	traceEnd("TLV parsing");
+	
+	struct TLVobject *fci = tlvObjectLookForTag(d, 0xBF0C);
+	if (fci == NULL)
+	{
+		printf("Error: No FCI found.\n");
+		tlvObjectFree(d);
+		return -1;
+	}
+	
+	
+	enum readStatus status = READ_NOTFOUND;
+	
+	for (int i=firstAid; i<255 && status == READ_NOTFOUND; i++)
+	{
+		if (fci->data[i] == NULL)
+			break;
+		
+		struct TLVobject *aid = tlvObjectLookForTag(fci->data[i], 0x4F);
+		
+		if (aid != NULL && aid->length <= CHECKPOINT_MAX_AID)
+		{
+			// Try to retrieve data reading record by record, and sfi by sfi
+			memcpy(cp.aid, aid->data[0], aid->length);
+			cp.aidLength = aid->length;
+			cp.aidIndex = i;
+			cp.sfi = 1;
+			cp.record = 1;
+			status = readApplication(serialPort, &cp, batchSize, windowSize);
+		}
+	}
+	
+	tlvObjectFree(d);
+	if (status == READ_INTERRUPTED)
+		saveCheckpoint(&cp);
+	return status == READ_FOUND ? 1 : 0;
+}
+
+// Prints the result stored for the card in the field by a previous tap,
+// if any. With verify, the card must still answer a SELECT of the
+// application read then (or of the PPSE, if unknown).
+// Returns true if it was printed.
+bool readCardCached(int serialPort, bool verify)
+{
+	struct cacheResult cached;
+	uint8_t uid[CACHE_UID_LENGTH];
+	uint16_t uidLength = apduCardUid(uid, sizeof(uid));
+	
+	struct apduResponse response;
+	
+	if (!cacheLookup(uid, uidLength, &cached))
+		return false;
+	
+	// Not needed: the answer to the PPSE sent by the board (-p)
+	apduTakePpseResponse(&response);
+	
+	if (verify)
+	{
+		struct apduCommand select = {0x00,0xA4,0x04,0x00,cached.aidLength,cached.aid,0x00,true};
+		if (cached.aidLength == 0)
+		{
+			select.lc = 0x0E;
+			select.data = (uint8_t*) "2PAY.SYS.DDF01";
+		}
+		if (apduTransceive(serialPort, &select, &response) != MYTERM_OK
+			|| response.sw1 != 0x90 || response.sw2 != 0x00)
+		{
+			cacheForget(uid, uidLength);
+			return false;
+		}
+	}
+	
+	traceBegin("output");
+	if (cached.panLength > 0)
+		printCardNumber(cached.pan, cached.panLength);
+	if (cached.expiryLength > 0)
+		printExpirationDate(cached.expiry);
+	traceEnd("output");
+	return true;
+}
+
+// Keeps the result of the card in the field for its next taps.
+void storeCardResult(void)
+{
+	uint8_t uid[CACHE_UID_LENGTH];
+	uint16_t uidLength = apduCardUid(uid, sizeof(uid));
+	
+	if (cardResult.panLength > 0)
+		cacheStore(uid, uidLength, &cardResult);
+}
+
+// Each tag streamed by the script is a whole TLV object
+void printScriptRecord(uint8_t *data, uint16_t length, void *user)
+{
+	if (printCardData(data, length))
+		*((bool*) user) = true;
+}
+
+// Same as readCard, but the board runs the whole session by itself,
+// and only sends back card number and expiration date.
+int readCardScript(int serialPort)
+{
+	const uint16_t tags[2] = {0x5A, 0x5F24};
+	struct script s;
+	struct scriptResult result;
+	bool data_found = false;
+	
+	if (!scriptCompileEmv(&s, tags, 2))
+		return -1;
+	apduRunScript(serialPort, &s, printScriptRecord, &data_found, &result);
+	return data_found ? 1 : 0;
+}
+
+// Prints a transparent file chunk by chunk, as it is read.
+void printBinaryChunk(unsigned int offset, uint8_t *data, uint16_t length, void *user)
+{
+	(void) user;
+	printf("%04x: ", offset);
+	printBuffer(data, length);
+}
+
+// Selects a transparent EF by its file identifier, and prints its content,
+// read with READ BINARY (for non-EMV cards).
+// Returns 1 if data was read, 0 otherwise.
+int readFile(int serialPort, uint16_t fileId)
+{
+	uint8_t fid[2] = {fileId >> 8, fileId & 0xFF};
+	struct apduCommand select = {0x00,0xA4,0x00,0x0C,sizeof(fid),fid,0x00,false};
+	struct apduResponse response;
+	
+	if (apduTransceive(serialPort, &select, &response) != MYTERM_OK
+		|| response.sw1 != 0x90 || response.sw2 != 0x00)
+		return 0;
+	
+	printf("### File %04x ###\n", fileId);
+	int n = apduReadBinary(serialPort, 0, 0, printBinaryChunk, NULL);
+	if (n < 0)
+	{
+		printf("Error: File not read entirely.\n\n");
+		return 0;
+	}
+	printf("%d bytes\n\n", n);
+	return n > 0 ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
+	unsigned int statsInterval = 0;
+	char *statpageName = NULL;
+	char *tracePath = NULL;
+	char *logSpec = NULL;
+	int batchSize = 1;
+	bool useScript = false;
+	bool speculativePpse = false;
+	int windowSize = 1;
+	int fileId = -1;
+	long maxBaudrate = 2000000;
+	int sessionBudget = 0;
+	int resumeWindow = CHECKPOINT_WINDOW;
+	int cacheTtl = 0;
+	char *cachePath = NULL;
+	bool verifyCache = false;
+	bool dualCards = false;
+	int opt;
+	
+	while ((opt = getopt(argc, argv, "s:m:t:l:b:xpw:af:B:T:r:c:C:VD")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': // dump statistics every x seconds
+				statsInterval = (unsigned int) atoi(optarg);
+			break;
+			case 'm': // publish statistics in shared memory
+				statpageName = optarg;
+			break;
+			case 't': // record a timeline of the sessions
+				tracePath = optarg;
+				traceEnabled = true;
+			break;
+			case 'l': // log levels, e.g. "serial=debug,apdu=info"
+				logSpec = optarg;
+			break;
+			case 'b': // read records by batches of x commands
+				batchSize = atoi(optarg);
+				if (batchSize < 1)
+					batchSize = 1;
+			break;
+			case 'x': // let the board run the whole session
+				useScript = true;
+			break;
+			case 'p': // let the board select the PPSE on card detection
+				speculativePpse = true;
+			break;
+			case 'w': // keep up to x tagged requests in flight
+				windowSize = atoi(optarg);
+			break;
+			case 'f': // read a transparent file instead of EMV data
+				fileId = (int) strtol(optarg, NULL, 16) & 0xFFFF;
+			break;
+			case 'B': // fastest serial rate to negotiate, 115200 to keep it
+				maxBaudrate = atol(optarg);
+			break;
+			case 'T': // time budget of each card, ms
+				sessionBudget = atoi(optarg);
+			break;
+			case 'r': // time to resume an interrupted card, ms
+				resumeWindow = atoi(optarg);
+			break;
+			case 'c': // keep the results of each card, seconds
+				cacheTtl = atoi(optarg);
+			break;
+			case 'C': // file to keep them across restarts
+				cachePath = optarg;
+			break;
+			case 'V': // check that a cached card still answers
+				verifyCache = true;
+			break;
+			case 'a': // read records with asynchronous requests
+				asyncReads = true;
+			break;
+			case 'D': // read two cards in the field at once
+				dualCards = true;
+			break;
+			default:
+				optind = argc;
+			break;
+		}
+	}
+	
+	if (optind >= argc)
 	{
-		printf("Usage: %s <serial_port>\n", argv[0]);
+		printf("Usage: %s [-s stats_interval] [-m stats_page] [-t trace.json] [-l log_levels] [-b batch_size] [-x] [-p] [-w window] [-a] [-f file_id] [-B max_baudrate] [-T budget_ms] [-r resume_ms] [-c cache_ttl] [-C cache_file] [-V] [-D] <serial_port>\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 	
-	int serial_port = open(argv[1],O_RDWR);
+	if (!logStart(logSpec))
+		return EXIT_FAILURE;
+	
+	int serial_port = open(argv[optind],O_RDWR);
 	if (serial_port < 0)
 	{
 		perror("Error while opening serial port : ");
 		return EXIT_FAILURE;
 	}
 	
+	if (statpageName != NULL && !statpageOpen(statpageName))
+	{
+		close(serial_port);
+		return EXIT_FAILURE;
+	}
+	
+	if (asyncReads && !loopOpen())
+	{
+		close(serial_port);
+		return EXIT_FAILURE;
+	}
+	
+	if (cacheTtl > 0 && !cacheOpen(cacheTtl, cachePath))
+	{
+		close(serial_port);
+		return EXIT_FAILURE;
+	}
+	
 	if (!serialInitialize(serial_port))
 	{
 		close(serial_port);
@@ -73,99 +709,83 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 	
+	// Scripts select the PPSE by themselves, and only run on the first
+	// card. Long frames, the board following 61xx and 6Cxx answers, faster
+	// rates, per-command deadlines, checked frames and card types are only
+	// used if it supports them.
+	uint16_t configFlags = 0;
+	if (fileId >= 0)
+		useScript = false;
+	if (speculativePpse && !useScript && fileId < 0)
+		configFlags |= MYTERM_CONFIG_PPSE;
+	if (windowSize > 1 && !useScript)
+		configFlags |= MYTERM_CONFIG_TAGGED;
+	if (dualCards && !useScript)
+		configFlags |= MYTERM_CONFIG_DUAL;
+	uint16_t accepted = apduConfigure(serial_port, configFlags | MYTERM_CONFIG_LONGFRAMES
+		| MYTERM_CONFIG_CHAIN | MYTERM_CONFIG_BAUD | MYTERM_CONFIG_DEADLINE | MYTERM_CONFIG_CRC
+		| MYTERM_CONFIG_TARGETINFO);
+	if ((accepted & configFlags) != configFlags)
+		fprintf(stderr, "The board doesn't support all the requested features.\n");
+	if (maxBaudrate > MYTERM_BAUD_DEFAULT)
+		printf("Serial link at %ld baud.\n", apduNegotiateBaudrate(serial_port, maxBaudrate));
+	windowSize = apduSetWindow(windowSize);
+	apduSetSessionBudget(sessionBudget);
+	checkpointSetWindow(resumeWindow);
+	
 	while (1)
 	{
-		uint8_t buffer[BUFFER_SIZE];
-		uint8_t buflen = BUFFER_SIZE;
-		
-		apduWaitForCard(serial_port);
-		
-		apduSendCommand(serial_port,0x00,0xA4,0x04,0x00,0x0E,"2PAY.SYS.DDF01",0x00,true);
-		apduWaitForResponse(serial_port, buffer, &buflen, NULL, NULL);
-		
-		// Look for FCI. This tag contains the application templates, with the AID.
-		struct TLVobject *d = tlvParseData(buffer, buflen);
-		d = tlvParseData(buffer, buflen);
-		
-		struct TLVobject *fci = tlvObjectLookForTag(d, 0xBF0C);
-		if (fci == NULL)
-		{
-			printf("Error: No FCI found.\n");
+		int found = apduWaitForCard(serial_port);
+		if (found < 0)
 			return EXIT_FAILURE;
-		}
-		
-		
-		bool data_found = false;
+		// Frames left by a card seen during apduConfigure
+		if (found != MYTERM_CARDFOUND)
+			continue;
 		
-		for (int i=0; i<255; i++)
+		// With -D, the cards found together are read one after the
+		// other, within the same session budget.
+		for (int c=0; c<apduCardCount(); c++)
 		{
-			if (fci->data[i] == NULL)
-				break;
-			
-			struct TLVobject *aid = tlvObjectLookForTag(fci->data[i], 0x4F);
-			
-			if (aid != NULL)
-			{			
-				// Select AID
-				buflen = BUFFER_SIZE;
-				apduSendCommand(serial_port,0x00,0xA4,0x04,0x00,aid->length,aid->data[0],0x00,true);
-				apduWaitForResponse(serial_port, buffer, &buflen, NULL, NULL);
-				
-				// Try to retrieve data reading record by record, and sfi by sfi
-				for (uint8_t sfi=1; sfi<16; sfi++)
-				{
-					for (uint8_t record_number=1; record_number<32; record_number++)
-					{
-						uint8_t sw1, sw2;
-						buflen = BUFFER_SIZE;
-						apduSendCommand(serial_port,0x00,0xB2,record_number,(sfi << 3)|04,0x00,NULL,0x00,true);
-						apduWaitForResponse(serial_port, buffer, &buflen, &sw1, &sw2);
-						if (sw1 == 0x90 && sw2 == 00)
-						{
-							struct TLVobject *rec = tlvParseData(buffer, buflen);
-							
-							struct TLVobject *card_number = tlvObjectLookForTag(rec, 0x5a);
-							struct TLVobject *expiration_date = tlvObjectLookForTag(rec, 0x5f24);
-							
-							if (card_number != NULL)
-							{
-								printf("### Card number ###\n");
-								printBuffer((uint8_t*) card_number->data[0], card_number->length);
-								printf("\n");
-								data_found = true;
-							}
-							
-							if (expiration_date != NULL)
-							{
-								printf("### Expiration date ###\n");
-								printf("%02x/%02x\n\n", ((uint8_t*) expiration_date->data[0])[1],
-								((uint8_t*) expiration_date->data[0])[0]);
-								data_found = true;
-							}
-							tlvObjectFree(rec);
-						}
-						else
-							break;
-						if (data_found) break;				
-					}
-					if (data_found) break;
-				}
+			int res;
+			apduSelectCard(c);
+			memset(&cardResult, 0, sizeof(cardResult));
+			// MIFARE Classic or Ultralight tags would only time out
+			if (!apduCardIsoDep())
+			{
+				printf("Not an ISO-DEP card: skipped.\n\n");
+				res = 0;
 			}
-			if (data_found) break;
-		}
-		
-		tlvObjectFree(d);
-		int r = 0;
-		while (r != MYTERM_TIMEOUT)
-		{
-			buflen = BUFFER_SIZE;
-			r = apduWaitForResponse(serial_port, buffer, &buflen, NULL, NULL);
-			
-			if (r != MYTERM_TIMEOUT && r != MYTERM_OK)
+			else if (fileId >= 0)
+				res = readFile(serial_port, fileId);
+			else if (readCardCached(serial_port, verifyCache))
+				res = 1;
+			else
+			{
+				res = useScript ? readCardScript(serial_port) : readCard(serial_port, batchSize, windowSize);
+				if (res > 0)
+					storeCardResult();
+			}
+			if (res < 0)
 				return EXIT_FAILURE;
+			if (res > 0)
+				statpageSessionCompleted(serial_port);
 		}
+		if (apduSessionExpired())
+			printf("Session budget of %d ms spent: results are partial.\n\n", sessionBudget);
+		
+		if (statsInterval > 0)
+			statsDumpIfDue(stderr, statsInterval);
+		
+		if (!apduReleaseCard(serial_port))
+			return EXIT_FAILURE;
+		// Once the card is released, out of the time it is measured
+		if (tracePath != NULL)
+			traceWrite(tracePath);
 	}
 
+	cacheClose();
+	loopClose();
+	statpageClose();
 	close(serial_port);
 	return EXIT_SUCCESS;
 }
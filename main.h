@@ -24,7 +24,8 @@
 #ifndef MAIN_H
 #define MAIN_H
 
-// Enable debug printing
+// Start every module at the debug log level. Levels can also be
+// chosen at runtime with the -l option (see log.h).
 // #define LOGLEVEL_DEBUG
 
 #endif
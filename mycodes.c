@@ -55,6 +55,9 @@ void mycodesPrintStr(int code, char *preStr)
 		case MYTERM_CARDFOUND:
 			errorStr = CARDFOUND_STR;
 			break;
+		case MYTERM_CARDREMOVED:
+			errorStr = CARDREMOVED_STR;
+			break;
 	}
 	
 	if (errorStr == NULL)
@@ -26,6 +26,10 @@
 #ifndef MYCODES_H
 #define MYCODES_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Opcodes / rescodes
 #define MYTERM_TIMEOUT    0x11
 #define MYTERM_NOTFOUND   0x12
@@ -36,17 +40,93 @@
 #define MYTERM_OK         0x0A
 #define MYTERM_CARDFOUND  0x0B
 #define MYTERM_COMMAND    0x0C
+#define MYTERM_BATCH      0x0D
+#define MYTERM_SCRIPT     0x0E
+#define MYTERM_RECORD     0x0F
+#define MYTERM_CONFIG     0x10
+#define MYTERM_TAGGED     0x13
+#define MYTERM_RELEASE    0x14
+#define MYTERM_CARDREMOVED 0x15
+#define MYTERM_BAUD       0x16
+#define MYTERM_ECHO       0x17
+#define MYTERM_HELLO      0x18
+#define MYTERM_NAK        0x19
+
+// MYTERM_HELLO states: the board answers it with its PN532 version (3 bytes)
+// and one of these, then goes back to its startup settings.
+#define MYTERM_HELLO_IDLE        0x00 // Waiting for a card
+#define MYTERM_HELLO_SESSION     0x01 // A session was running: waiting for the card to leave
+
+// MYTERM_BATCH command flags
+#define MYTERM_BATCH_STOPONERROR 0x01 // Stop after the first response which is not 9000
+
+// MYTERM_BATCH response flags
+#define MYTERM_BATCH_MORE        0x01 // Another MYTERM_BATCH response frame follows
+
+// MYTERM_CONFIG flags
+#define MYTERM_CONFIG_PPSE       0x01 // SELECT PPSE as soon as a card is detected
+#define MYTERM_CONFIG_TAGGED     0x02 // Accept MYTERM_TAGGED frames
+#define MYTERM_CONFIG_LONGFRAMES 0x04 // 16-bit frame lengths, after the answer
+#define MYTERM_CONFIG_CHAIN      0x08 // Follow 61xx and 6Cxx answers on the board
+#define MYTERM_CONFIG_BAUD       0x10 // Accept MYTERM_BAUD frames between two cards
+#define MYTERM_CONFIG_DEADLINE   0x20 // Commands start with the time the card may take (2 bytes, ms)
+#define MYTERM_CONFIG_CRC        0x40 // Sequence number and CRC-16 on frames, after the answer
+#define MYTERM_CONFIG_TARGETINFO 0x80 // MYTERM_CARDFOUND carries ATQA, SAK, UID length and ATS
+#define MYTERM_CONFIG_DUAL       0x0100 // Up to two cards at once (second byte of flags)
+
+// With MYTERM_CONFIG_CRC, frames other than MYTERM_HELLO and MYTERM_ECHO
+// ones carry a sequence number (1 byte, after the length; one counter per
+// direction) and end with a CRC-16 (crc.h, 2 bytes) of the bytes before
+// it. A garbled frame is answered with MYTERM_NAK: the sequence number
+// of the frame asked for, then the one of the last frame sent (NAK frames
+// take none). The board sends its last frame again if asked for, and
+// the few before it if they were short; the computer only its last one.
+// The receiving side keeps the frames which follow a garbled one.
+#define MYTERM_NAK_LENGTH        2
+
+// With MYTERM_CONFIG_TARGETINFO, MYTERM_CARDFOUND data is: ATQA (2 bytes),
+// SAK, UID length, UID, ATS length, then the ATS without its length byte
+// (none for cards which are not ISO-DEP). Otherwise, it is the UID on
+// 7 bytes. MYTERM_CONFIG_PPSE is skipped for cards which are not ISO-DEP.
+#define MYTERM_SAK_ISODEP        0x20 // ISO/IEC 14443-4 compliant
+
+// Flags above 0xFF go in a second byte of MYTERM_CONFIG data, sent only
+// when needed; the answer holds them in its fifth byte. With
+// MYTERM_CONFIG_DUAL, MYTERM_CARDFOUND data is the number of cards (1 or
+// 2), then the information of each, as with MYTERM_CONFIG_TARGETINFO.
+// Commands go to card n (from 1) with 40 0n as InDataExchange header.
+// The board selects the PPSE and runs scripts on the first card only.
+
+// MYTERM_BAUD rates, from the fastest. The link always starts at 115200.
+#define MYTERM_BAUD_DEFAULT      115200
+#define MYTERM_BAUD_RATES        2000000, 1000000, 921600, 460800, 230400
+#define MYTERM_BAUD_PROBATION    500 // ms for the computer to check a new rate
+
+// MYTERM_SCRIPT bytecode (see script.h)
+#define SCRIPT_END        0x00 // End of the script
+#define SCRIPT_APDU       0x01 // 1 byte length, then an APDU: send it, keep its answer
+#define SCRIPT_SELECTTAG  0x02 // 2 bytes tag: SELECT the value of this tag in the last answer
+#define SCRIPT_GPO        0x03 // Send GET PROCESSING OPTIONS, with the PDOL of the last answer
+#define SCRIPT_FILTER     0x04 // 1 byte count, then 2 bytes tags: only stream these tags
+#define SCRIPT_READAFL    0x05 // Read the records listed in the AFL of the last answer
+#define SCRIPT_EMIT       0x06 // Stream the last answer
 
 #define OK_STR			 "OK"
 #define CARDFOUND_STR	 "Card detected"
+#define CARDREMOVED_STR	 "Card removed"
 #define TIMEOUT_STR		 "Timeout"
 #define NOTFOUND_STR		 "Chip/card not found"
 #define READERROR_STR	 "Read error"
 #define WRITEERROR_STR	 "Write error"
 #define UNDEFERROR_STR	 "Undefined error"
 
-#define BUFFER_SIZE 255
+#define BUFFER_SIZE 255			// frame data, with 1-byte lengths
+#define LONG_BUFFER_SIZE 1024	// frame data, with MYTERM_CONFIG_LONGFRAMES
 
 void mycodesPrintStr(int code, char *preStr);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * probes.h: USDT static tracepoints (provider "apdu") on the send,
+ * receive and parse paths. They cost a single nop when nothing is
+ * attached, e.g.:
+ * 
+ *   bpftrace -e 'usdt:./apdu:apdu:apdu_response { @sw[arg3] = count(); }'
+ * 
+ * Without <sys/sdt.h> (systemtap-sdt-dev), or when built with
+ * -DAPDU_NO_PROBES, the probes compile to nothing.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Probes and their arguments:
+ * - serial_send (port, length): frame written by sendCommand
+ * - serial_receive (port, rescode, length): frame read by waitResponse
+ * - apdu_command (port, cla, ins, p1, p2, lc): apduSendCommand
+ * - apdu_response (port, rescode, length, sw): apduWaitForResponse,
+ *   sw is SW1 << 8 | SW2, or -1 if the frame is not a card response
+ * - card_wait (port): apduWaitForCard starts waiting
+ * - card_found (port, rescode, uid length): apduWaitForCard returns
+ * - tlv_parse (length, tag, constructed): tlvParseData parsed an object
+ */
+
+#if !defined(APDU_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define APDU_HAVE_PROBES
+#endif
+#endif
+
+#ifdef APDU_HAVE_PROBES
+#include <sys/sdt.h>
+
+#define APDU_PROBE1(name, a) DTRACE_PROBE1(apdu, name, a)
+#define APDU_PROBE2(name, a, b) DTRACE_PROBE2(apdu, name, a, b)
+#define APDU_PROBE3(name, a, b, c) DTRACE_PROBE3(apdu, name, a, b, c)
+#define APDU_PROBE4(name, a, b, c, d) DTRACE_PROBE4(apdu, name, a, b, c, d)
+#define APDU_PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(apdu, name, a, b, c, d, e, f)
+#else
+#define APDU_PROBE1(name, a) do {} while (0)
+#define APDU_PROBE2(name, a, b) do {} while (0)
+#define APDU_PROBE3(name, a, b, c) do {} while (0)
+#define APDU_PROBE4(name, a, b, c, d) do {} while (0)
+#define APDU_PROBE6(name, a, b, c, d, e, f) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * script.c: Compiler and interpreter of the scripts run by the board
+ * (MYTERM_SCRIPT), so that a whole card session needs no round trip
+ * with the computer. The interpreter is the one of the simulator, and
+ * is mirrored in APDU_TERMINAL.ino.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "script.h"
+#include "main.h"
+#include <string.h>
+
+/*
+ * Compiler
+ */
+
+static bool scriptReserve(struct script *s, unsigned int len)
+{
+	if (s->overflow || s->length+len > sizeof(s->code))
+	{
+		s->overflow = true;
+		return false;
+	}
+	return true;
+}
+
+void scriptInit(struct script *s)
+{
+	s->length = 0;
+	s->overflow = false;
+}
+
+void scriptApdu(struct script *s, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2,
+	uint8_t lc, const uint8_t *data, uint8_t le, bool isLePresent)
+{
+	uint8_t apdulen = 4 + (lc > 0 ? lc+1 : 0) + (isLePresent ? 1 : 0);
+	if (!scriptReserve(s, 2+apdulen))
+		return;
+
+	s->code[s->length++] = SCRIPT_APDU;
+	s->code[s->length++] = apdulen;
+	s->code[s->length++] = cla;
+	s->code[s->length++] = ins;
+	s->code[s->length++] = p1;
+	s->code[s->length++] = p2;
+	if (lc > 0)
+	{
+		s->code[s->length++] = lc;
+		memcpy(s->code+s->length, data, lc);
+		s->length += lc;
+	}
+	if (isLePresent)
+		s->code[s->length++] = le;
+}
+
+void scriptSelectTag(struct script *s, uint16_t tag)
+{
+	if (!scriptReserve(s, 3))
+		return;
+	s->code[s->length++] = SCRIPT_SELECTTAG;
+	s->code[s->length++] = tag >> 8;
+	s->code[s->length++] = tag & 0xFF;
+}
+
+void scriptGpo(struct script *s)
+{
+	if (scriptReserve(s, 1))
+		s->code[s->length++] = SCRIPT_GPO;
+}
+
+void scriptFilter(struct script *s, const uint16_t *tags, uint8_t count)
+{
+	if (count > SCRIPT_MAX_FILTER || !scriptReserve(s, 2+2*count))
+	{
+		s->overflow = true;
+		return;
+	}
+	s->code[s->length++] = SCRIPT_FILTER;
+	s->code[s->length++] = count;
+	for (uint8_t i=0; i<count; i++)
+	{
+		s->code[s->length++] = tags[i] >> 8;
+		s->code[s->length++] = tags[i] & 0xFF;
+	}
+}
+
+void scriptReadAfl(struct script *s)
+{
+	if (scriptReserve(s, 1))
+		s->code[s->length++] = SCRIPT_READAFL;
+}
+
+void scriptEmit(struct script *s)
+{
+	if (scriptReserve(s, 1))
+		s->code[s->length++] = SCRIPT_EMIT;
+}
+
+void scriptEnd(struct script *s)
+{
+	if (scriptReserve(s, 1))
+		s->code[s->length++] = SCRIPT_END;
+}
+
+// EMV session: select PPSE, select the first AID (tag 4F), get processing
+// options, then read the records of the AFL, streaming only the given tags
+// (or whole records if count is 0).
+bool scriptCompileEmv(struct script *s, const uint16_t *tags, uint8_t count)
+{
+	scriptInit(s);
+	scriptApdu(s, 0x00, 0xA4, 0x04, 0x00, 14, (const uint8_t*) "2PAY.SYS.DDF01", 0x00, true);
+	scriptSelectTag(s, 0x4F);
+	scriptGpo(s);
+	if (count > 0)
+		scriptFilter(s, tags, count);
+	scriptReadAfl(s);
+	scriptEnd(s);
+	return !s->overflow;
+}
+
+/*
+ * Interpreter
+ */
+
+// Looks for a tag in BER-TLV data, recursing into constructed objects.
+// Returns the offset of the object, and of its value.
+bool scriptFindTag(const uint8_t *data, unsigned int length, uint16_t tag,
+	unsigned int *start, unsigned int *valueStart, unsigned int *valueLength)
+{
+	unsigned int pos = 0;
+	while (pos < length)
+	{
+		unsigned int objStart = pos;
+		if (data[pos] == 0x00 || data[pos] == 0xFF) // padding
+		{
+			pos++;
+			continue;
+		}
+
+		bool constructed = (data[pos] & 0x20) == 0x20;
+		uint16_t t = data[pos++];
+		if ((t & 0x1F) == 0x1F)
+		{
+			// Only the two first bytes of longer tags are kept
+			if (pos >= length)
+				return false;
+			t = (t << 8) | data[pos];
+			while (pos < length && (data[pos++] & 0x80) == 0x80);
+		}
+
+		if (pos >= length)
+			return false;
+		unsigned int len = data[pos++];
+		if (len == 0x81 && pos < length)
+			len = data[pos++];
+		else if (len == 0x82 && pos+1 < length)
+		{
+			len = (data[pos] << 8) | data[pos+1];
+			pos += 2;
+		}
+		else if (len > 0x80)
+			return false;
+		if (pos+len > length)
+			return false;
+
+		if (t == tag)
+		{
+			*start = objStart;
+			*valueStart = pos;
+			*valueLength = len;
+			return true;
+		}
+		if (constructed && scriptFindTag(data+pos, len, tag, start, valueStart, valueLength))
+		{
+			*start += pos;
+			*valueStart += pos;
+			return true;
+		}
+		pos += len;
+	}
+	return false;
+}
+
+static bool scriptExchange(scriptTransceiveFunc transceive, void *ctx, const uint8_t *apdu,
+	uint8_t len, uint8_t *resp, uint8_t *resplen, struct scriptResult *result)
+{
+	*resplen = BUFFER_SIZE;
+	result->rescode = transceive(ctx, apdu, len, resp, resplen);
+	if (result->rescode != MYTERM_OK)
+		return false;
+	if (*resplen < 2)
+	{
+		result->rescode = MYTERM_READERROR;
+		return false;
+	}
+
+	result->sw1 = resp[*resplen-2];
+	result->sw2 = resp[*resplen-1];
+	*resplen -= 2;
+	return result->sw1 == 0x90 && result->sw2 == 0x00;
+}
+
+// Builds GET PROCESSING OPTIONS in apdu, with the PDOL (tag 9F38) of the
+// FCI filled with zeros, or an empty one if there is none. Returns the
+// length of the APDU, 0 if the PDOL asks for more than SCRIPT_MAX_PDOL bytes.
+static uint8_t scriptBuildGpo(const uint8_t *fci, unsigned int fcilen, uint8_t *apdu)
+{
+	unsigned int start, vstart, vlen;
+	unsigned int pdolLength = 0;
+	if (scriptFindTag(fci, fcilen, 0x9F38, &start, &vstart, &vlen))
+	{
+		// A DOL only holds tags and lengths
+		const uint8_t *dol = fci+vstart;
+		unsigned int pos = 0;
+		while (pos < vlen)
+		{
+			if ((dol[pos++] & 0x1F) == 0x1F)
+				while (pos < vlen && (dol[pos++] & 0x80) == 0x80);
+			if (pos >= vlen)
+				break;
+			pdolLength += dol[pos++];
+		}
+	}
+	if (pdolLength > SCRIPT_MAX_PDOL)
+		return 0;
+
+	const uint8_t gpo[4] = {0x80, 0xA8, 0x00, 0x00};
+	memcpy(apdu, gpo, 4);
+	apdu[4] = 2+pdolLength;
+	apdu[5] = 0x83;
+	apdu[6] = pdolLength;
+	memset(apdu+7, 0x00, pdolLength);
+	apdu[7+pdolLength] = 0x00;
+	return 8+pdolLength;
+}
+
+void scriptRun(const uint8_t *code, uint8_t length, scriptTransceiveFunc transceive,
+	scriptEmitFunc emit, void *ctx, struct scriptResult *result)
+{
+	uint8_t last[BUFFER_SIZE], rec[BUFFER_SIZE], apdu[BUFFER_SIZE];
+	uint8_t lastlen = 0, reclen;
+	uint16_t filter[SCRIPT_MAX_FILTER];
+	uint8_t filterCount = 0;
+	unsigned int start, vstart, vlen;
+	unsigned int pc = 0;
+
+	result->rescode = MYTERM_OK;
+	result->pc = 0;
+	result->sw1 = 0x90;
+	result->sw2 = 0x00;
+
+	while (pc < length)
+	{
+		result->pc = pc;
+		switch (code[pc++])
+		{
+			case SCRIPT_END:
+				return;
+			case SCRIPT_APDU:
+				if (pc >= length || pc+1+code[pc] > length)
+				{
+					result->rescode = MYTERM_UNDEFERROR;
+					return;
+				}
+				if (!scriptExchange(transceive, ctx, code+pc+1, code[pc], last, &lastlen, result))
+					return;
+				pc += 1+code[pc];
+			break;
+			case SCRIPT_SELECTTAG:
+			{
+				if (pc+2 > length)
+				{
+					result->rescode = MYTERM_UNDEFERROR;
+					return;
+				}
+				uint16_t tag = (code[pc] << 8) | code[pc+1];
+				pc += 2;
+				if (!scriptFindTag(last, lastlen, tag, &start, &vstart, &vlen) || vlen > 16)
+				{
+					result->rescode = MYTERM_NOTFOUND;
+					return;
+				}
+				const uint8_t select[4] = {0x00, 0xA4, 0x04, 0x00};
+				memcpy(apdu, select, 4);
+				apdu[4] = vlen;
+				memcpy(apdu+5, last+vstart, vlen);
+				apdu[5+vlen] = 0x00;
+				if (!scriptExchange(transceive, ctx, apdu, 6+vlen, last, &lastlen, result))
+					return;
+			}
+			break;
+			case SCRIPT_GPO:
+			{
+				uint8_t len = scriptBuildGpo(last, lastlen, apdu);
+				if (len == 0)
+				{
+					result->rescode = MYTERM_UNDEFERROR;
+					return;
+				}
+				if (!scriptExchange(transceive, ctx, apdu, len, last, &lastlen, result))
+					return;
+			}
+			break;
+			case SCRIPT_FILTER:
+				if (pc >= length || code[pc] > SCRIPT_MAX_FILTER || pc+1+2*code[pc] > length)
+				{
+					result->rescode = MYTERM_UNDEFERROR;
+					return;
+				}
+				filterCount = code[pc++];
+				for (uint8_t i=0; i<filterCount; i++, pc+=2)
+					filter[i] = (code[pc] << 8) | code[pc+1];
+			break;
+			case SCRIPT_READAFL:
+			{
+				// Format 1: 80 { AIP, AFL }. Format 2: 77 { 82 AIP, 94 AFL }
+				const uint8_t *afl;
+				unsigned int afllen;
+				if (lastlen > 2 && last[0] == 0x80 && scriptFindTag(last, lastlen, 0x80, &start, &vstart, &vlen) && vlen >= 2)
+				{
+					afl = last+vstart+2;
+					afllen = vlen-2;
+				}
+				else if (scriptFindTag(last, lastlen, 0x94, &start, &vstart, &vlen))
+				{
+					afl = last+vstart;
+					afllen = vlen;
+				}
+				else
+				{
+					result->rescode = MYTERM_NOTFOUND;
+					return;
+				}
+
+				// One bit per filter tag. Once every tag was found, there
+				// is no need to read further.
+				uint16_t found = 0;
+				uint16_t all = (1 << filterCount) - 1;
+				for (unsigned int i=0; i+4 <= afllen && (filterCount == 0 || found != all); i+=4)
+				{
+					uint8_t sfi = afl[i] >> 3;
+					for (unsigned int r=afl[i+1]; r<=afl[i+2] && r != 0 && (filterCount == 0 || found != all); r++)
+					{
+						uint8_t readRecord[5] = {0x00, 0xB2, r, (sfi << 3) | 0x04, 0x00};
+						if (!scriptExchange(transceive, ctx, readRecord, sizeof(readRecord), rec, &reclen, result))
+							return;
+
+						if (filterCount == 0)
+						{
+							emit(ctx, rec, reclen);
+							continue;
+						}
+						for (uint8_t f=0; f<filterCount; f++)
+						{
+							if ((found & (1 << f)) == 0
+								&& scriptFindTag(rec, reclen, filter[f], &start, &vstart, &vlen))
+							{
+								emit(ctx, rec+start, vstart+vlen-start);
+								found |= 1 << f;
+							}
+						}
+					}
+				}
+			}
+			break;
+			case SCRIPT_EMIT:
+				emit(ctx, last, lastlen);
+			break;
+			default:
+				result->rescode = MYTERM_UNDEFERROR;
+				return;
+		}
+	}
+}
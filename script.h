@@ -0,0 +1,94 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * script.h: Compiler and interpreter of the scripts run by the board
+ * (MYTERM_SCRIPT), so that a whole card session needs no round trip
+ * with the computer. The interpreter is the one of the simulator, and
+ * is mirrored in APDU_TERMINAL.ino.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mycodes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SCRIPT_MAX_FILTER 8
+#define SCRIPT_MAX_PDOL   64 // bytes of PDOL data sent with GPO
+
+/*
+ * Script frame: MYTERM_SCRIPT, then the bytecode (see SCRIPT_* opcodes in
+ * mycodes.h). While running, the board streams MYTERM_RECORD frames,
+ * then ends with a MYTERM_SCRIPT frame: 1 byte rescode (MYTERM_OK, or the
+ * error which stopped the script), 1 byte offset of the last instruction,
+ * SW1 and SW2 of the last answer.
+ */
+
+struct script
+{
+	uint8_t code[BUFFER_SIZE-2];
+	uint8_t length;
+	bool overflow;		// true if an instruction didn't fit
+};
+
+struct scriptResult
+{
+	uint8_t rescode;	// MYTERM_OK, MYTERM_NOTFOUND if a tag is missing...
+	uint8_t pc;
+	uint8_t sw1;
+	uint8_t sw2;
+};
+
+// Sends an APDU to the card. Returns a MYTERM rescode, and the answer
+// followed by SW1 SW2 in resp.
+typedef uint8_t (*scriptTransceiveFunc)(void *ctx, const uint8_t *apdu, uint8_t len,
+	uint8_t *resp, uint8_t *resplen);
+typedef void (*scriptEmitFunc)(void *ctx, const uint8_t *data, uint8_t len);
+
+// Compiler
+void scriptInit(struct script *s);
+void scriptApdu(struct script *s, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2,
+	uint8_t lc, const uint8_t *data, uint8_t le, bool isLePresent);
+void scriptSelectTag(struct script *s, uint16_t tag);
+void scriptGpo(struct script *s);
+void scriptFilter(struct script *s, const uint16_t *tags, uint8_t count);
+void scriptReadAfl(struct script *s);
+void scriptEmit(struct script *s);
+void scriptEnd(struct script *s);
+bool scriptCompileEmv(struct script *s, const uint16_t *tags, uint8_t count);
+
+// Interpreter
+bool scriptFindTag(const uint8_t *data, unsigned int length, uint16_t tag,
+	unsigned int *start, unsigned int *valueStart, unsigned int *valueLength);
+void scriptRun(const uint8_t *code, uint8_t length, scriptTransceiveFunc transceive,
+	scriptEmitFunc emit, void *ctx, struct scriptResult *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
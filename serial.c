@@ -24,13 +24,66 @@
  */
 
 #include "serial.h"
+#include "serialspeed.h"
+#include "crc.h"
 #include "mycodes.h"
+#include "stats.h"
+#include "trace.h"
+#include "probes.h"
+#include "log.h"
 #include "main.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <termios.h>
+#include <poll.h>
+
+// Frame format: 1-byte data lengths at startup, 16-bit ones once the
+// board accepted MYTERM_CONFIG_LONGFRAMES.
+static bool longFrames = false;
+static uint16_t maxFrameLength = BUFFER_SIZE;
+static long baudrate = MYTERM_BAUD_DEFAULT;
+
+// Sequence numbers and CRC, once the board accepted MYTERM_CONFIG_CRC.
+// The last frame sent is kept, in case the board asks for it again.
+static bool checksums = false;
+static uint8_t txSeq = 0;	// of the next frame sent
+static uint8_t rxSeq = 0;	// expected for the next frame received
+static uint8_t lastFrame[LONG_BUFFER_SIZE+6];
+static int lastFrameLength = 0;
+static uint8_t askedSeq = 0;	// of the last frame asked for again
+
+// Bytes received and not read as frames yet. With MYTERM_CONFIG_CRC, the
+// frames which follow a garbled one are searched for in them (resync), and
+// those which come ahead of the one expected are held.
+static uint8_t rxBuffer[LONG_BUFFER_SIZE+8];
+static int rxCount = 0;
+static bool resync = false;		// the last frame was garbled, the next one isn't found yet
+static bool stalled = false;	// the link went silent before a frame was complete
+
+struct serialHeldFrame
+{
+	bool used;
+	uint8_t opcode;
+	uint8_t seq;
+	uint16_t len;
+	uint8_t data[LONG_BUFFER_SIZE];
+};
+
+static struct serialHeldFrame heldFrames[SERIAL_HELD_FRAMES];
+
+// How a frame was received (see serialReadRawFrame)
+enum serialFrameStatus
+{
+	SERIAL_FRAME_OK,
+	SERIAL_FRAME_NONE,		// nothing came in time
+	SERIAL_FRAME_GARBLED	// wrong CRC, or cut
+};
+
+static int serialRead(int serial_port, uint8_t *buffer, int size);
+static int serialFill(int serial_port, int need, int timeout, bool inFrame);
+static void serialConsume(int n);
 
 bool serialInitialize(int serial_port)
 {
@@ -47,6 +100,7 @@ bool serialInitialize(int serial_port)
 	tty.c_cflag |= CS8;     // byte size: 8
 	tty.c_cflag &= ~CRTSCTS;// disable RTS/CTS hardware flow control
 	tty.c_cflag |= CREAD | CLOCAL; // Turn on READ & ignore ctrl lines
+	tty.c_cflag &= ~HUPCL;  // Keep DTR up on close: dropping it resets most Arduinos
 	
 	tty.c_lflag &= ~ICANON; // Disable line per line mode
 	tty.c_lflag &= ~ECHO; // Disable echo
@@ -73,98 +127,593 @@ bool serialInitialize(int serial_port)
 	return true;
 }
 
-void sendCommand(int serial_port, uint8_t *buffer, uint8_t len)
+// Switches to 16-bit frame lengths, up to maxLength bytes of data (the
+// smallest buffer of the board and of the computer).
+void serialSetLongFrames(uint16_t maxLength)
+{
+	longFrames = true;
+	maxFrameLength = maxLength > LONG_BUFFER_SIZE ? LONG_BUFFER_SIZE : maxLength;
+}
+
+uint16_t serialMaxFrameLength(void)
+{
+	return maxFrameLength;
+}
+
+// Adds sequence numbers and CRC to the frames, from now on in both
+// directions.
+void serialSetChecksums(void)
+{
+	checksums = true;
+	txSeq = 0;
+	rxSeq = 0;
+	lastFrameLength = 0;
+	resync = false;
+	for (int i=0; i<SERIAL_HELD_FRAMES; i++)
+		heldFrames[i].used = false;
+}
+
+// Whether frames with this opcode carry a sequence number and a CRC.
+// MYTERM_HELLO ones never do, as the board may have restarted, nor
+// MYTERM_ECHO ones, which check the link by themselves.
+static bool serialChecked(uint8_t opcode)
+{
+	return checksums && opcode != MYTERM_HELLO && opcode != MYTERM_ECHO;
+}
+
+// Bxxx constant of a rate, or B0 if termios has none
+static speed_t serialSpeedConstant(long rate)
+{
+	switch (rate)
+	{
+		case 115200: return B115200;
+		case 230400: return B230400;
+#ifdef B460800
+		case 460800: return B460800;
+#endif
+#ifdef B921600
+		case 921600: return B921600;
+#endif
+#ifdef B1000000
+		case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+		case 2000000: return B2000000;
+#endif
+		default: return B0;
+	}
+}
+
+// Changes the rate once the bytes already written are sent, then drops
+// what was received at the old one.
+bool serialSetBaudrate(int serial_port, long rate)
+{
+	speed_t speed = serialSpeedConstant(rate);
+	bool done;
+	
+	if (rate == baudrate)
+		return true;
+	if (speed == B0)
+		done = serialspeedSet(serial_port, rate);
+	else
+	{
+		struct termios tty;
+		done = tcgetattr(serial_port, &tty) == 0 && cfsetspeed(&tty, speed) == 0
+			&& tcsetattr(serial_port, TCSADRAIN, &tty) == 0;
+	}
+	if (!done)
+	{
+		fprintf(stderr, "Can't set the serial port to %ld baud.\n", rate);
+		return false;
+	}
+	tcflush(serial_port, TCIFLUSH);
+	rxCount = 0;
+	baudrate = rate;
+	logMessage(LOG_MODULE_SERIAL, LOG_INFO, "Serial port set to %ld baud", rate, 0);
+	return true;
+}
+
+// Sends a MYTERM_ECHO frame holding a test pattern, and checks that it
+// comes back unaltered within timeout ms. The answer is compared byte
+// after byte, as a garbled length must not make us wait for more data.
+bool serialCheckLink(int serial_port, int timeout)
+{
+	uint8_t pattern[SERIAL_ECHO_LENGTH];
+	uint8_t expected[SERIAL_ECHO_LENGTH+3];
+	int header = longFrames ? 3 : 2;
+	
+	// Edges and alternating bits first, then every bit in every position
+	for (int i=0; i<SERIAL_ECHO_LENGTH; i++)
+		pattern[i] = (uint8_t) (i*0x1D + 0x55);
+	pattern[0] = 0x00;
+	pattern[1] = 0xFF;
+	pattern[2] = 0x55;
+	pattern[3] = 0xAA;
+	
+	expected[0] = MYTERM_ECHO;
+	if (longFrames)
+		expected[1] = 0;
+	expected[header-1] = SERIAL_ECHO_LENGTH;
+	memcpy(expected+header, pattern, SERIAL_ECHO_LENGTH);
+	
+	sendFrame(serial_port, MYTERM_ECHO, pattern, SERIAL_ECHO_LENGTH);
+	for (int i=0; i<SERIAL_ECHO_LENGTH+header; i++)
+	{
+		if (serialFill(serial_port, i+1, timeout, false) <= 0 || rxBuffer[i] != expected[i])
+		{
+			serialConsume(rxCount);
+			return false;
+		}
+	}
+	serialConsume(SERIAL_ECHO_LENGTH+header);
+	return true;
+}
+
+void sendCommand(int serial_port, uint8_t *buffer, uint16_t len)
 {
 	if (len == 0)
 		return;
+	sendFrame(serial_port, MYTERM_COMMAND, buffer, len);
+}
+
+void sendFrame(int serial_port, uint8_t opcode, uint8_t *buffer, uint16_t len)
+{
+	bool checked = serialChecked(opcode);
+	int header = (longFrames ? 3 : 2) + (checked ? 1 : 0);
+	int size = len+header+(checked ? 2 : 0);
+	if (len > maxFrameLength)
+	{
+		fprintf(stderr, "Frame too long for the board (%u bytes)!\n", len);
+		return;
+	}
 	
-	uint8_t *cmdbuffer = (uint8_t*) malloc(sizeof(uint8_t) * (len+2));
+	uint8_t *cmdbuffer = (uint8_t*) malloc(sizeof(uint8_t) * size);
 	if (cmdbuffer == NULL)
 	{
 		fprintf(stderr, "Memory allocation error!\n");
 		return;
 	}
-	cmdbuffer[0] = MYTERM_COMMAND;
-	cmdbuffer[1] = len;
-	memcpy(cmdbuffer+2, buffer, len);
+	cmdbuffer[0] = opcode;
+	if (longFrames)
+	{
+		cmdbuffer[1] = len >> 8;
+		cmdbuffer[2] = len & 0xFF;
+	}
+	else
+		cmdbuffer[1] = len;
+	if (len > 0)
+		memcpy(cmdbuffer+header, buffer, len);
+	if (checked)
+	{
+		// MYTERM_NAK frames take no sequence number, and are not sent again.
+		cmdbuffer[header-1] = opcode == MYTERM_NAK ? 0 : txSeq++;
+		uint16_t crc = crc16(CRC16_INIT, cmdbuffer, len+header);
+		cmdbuffer[len+header] = crc >> 8;
+		cmdbuffer[len+header+1] = crc & 0xFF;
+		if (opcode != MYTERM_NAK)
+		{
+			memcpy(lastFrame, cmdbuffer, size);
+			lastFrameLength = size;
+		}
+	}
 	
-	write(serial_port, cmdbuffer, (len+2));
+	traceBeginArg("serial write", "bytes", size);
+	write(serial_port, cmdbuffer, size);
+	traceEnd("serial write");
+	APDU_PROBE2(serial_send, serial_port, len);
+	statsRecordBytes(size, 0);
 	free(cmdbuffer);
 	return;
 }
 
-int waitResponse(int serial_port, uint8_t *buffer, uint8_t *len)
+// Asks the board for a frame again, telling it the last one sent (see
+// MYTERM_NAK in mycodes.h).
+static void serialSendNak(int serial_port, uint8_t seq)
 {
-	uint8_t tmp_buffer[BUFFER_SIZE];
-	uint8_t data_length = 0;
-	uint8_t res_code = 0;
-	uint8_t max_size = *len;
-	bool incoming = false;
-	
-	int n = 0;
+	uint8_t nak[MYTERM_NAK_LENGTH] = {seq, (uint8_t) (txSeq-1)};
+	logMessage(LOG_MODULE_SERIAL, LOG_WARNING, "Frame %ld garbled or missing, asking for it again", seq, 0);
+	sendFrame(serial_port, MYTERM_NAK, nak, sizeof(nak));
+	askedSeq = seq;
+}
+
+// Sends the last frame again, as the board didn't get it.
+static void serialResend(int serial_port)
+{
+	logMessage(LOG_MODULE_SERIAL, LOG_WARNING, "Sending frame %ld again", (uint8_t) (txSeq-1), 0);
+	write(serial_port, lastFrame, lastFrameLength);
+	statsRecordBytes(lastFrameLength, 0);
+}
+
+// Reads at most size bytes. Returns 0 if nothing came within VTIME.
+static int serialRead(int serial_port, uint8_t *buffer, int size)
+{
+	traceBegin("serial read");
+	int n = read(serial_port, buffer, size);
+	traceEndArg("serial read", "bytes", n);
 	
+	if (n > 0)
+	{
+		statsRecordBytes(0, n);
+		logHex(LOG_MODULE_SERIAL, LOG_DEBUG, "Serial port received", buffer, n);
+	}
+	return n;
+}
+
+// Waits up to timeout ms for data (forever if timeout is negative).
+static bool serialPoll(int serial_port, int timeout)
+{
+	struct pollfd pfd = {serial_port, POLLIN, 0};
+	return timeout < 0 || poll(&pfd, 1, timeout) > 0;
+}
+
+// Makes sure that at least need bytes are in rxBuffer. Each read waits up
+// to timeout ms (forever if timeout is negative); within a frame (inFrame),
+// SERIAL_GAP_TIMEOUT ms, or not at all once the link went silent with
+// bytes still to search (see serialReadRawFrame). Returns 1 once they are
+// there, 0 if they didn't come in time, -1 if the port hung up.
+static int serialFill(int serial_port, int need, int timeout, bool inFrame)
+{
+	while (rxCount < need)
+	{
+		int wait = !inFrame ? timeout : (stalled ? 0 : SERIAL_GAP_TIMEOUT);
+		if (!serialPoll(serial_port, wait))
+		{
+			stalled = true;
+			return 0;
+		}
+		int n = serialRead(serial_port, rxBuffer+rxCount, sizeof(rxBuffer)-rxCount);
+		// Nothing to read after poll() said otherwise: the port hung up.
+		if (n < 0 || (n == 0 && wait >= 0))
+			return -1;
+		if (n > 0)
+			stalled = false;
+		rxCount += n;
+	}
+	return 1;
+}
+
+// Drops the first n bytes of rxBuffer.
+static void serialConsume(int n)
+{
+	rxCount -= n;
+	memmove(rxBuffer, rxBuffer+n, rxCount);
+}
+
+// Size of the frame with a sequence number and a CRC at pos in rxBuffer:
+// 0 if it isn't all there yet, -1 if it can't be one (wrong CRC, too
+// long, or not such a frame).
+static int serialCheckedFrame(int pos)
+{
+	const uint8_t *frame = rxBuffer+pos;
+	int header_size = (longFrames ? 3 : 2) + 1;
+	if (rxCount-pos < header_size)
+		return rxCount > pos && !serialChecked(frame[0]) ? -1 : 0;
+	if (!serialChecked(frame[0]))
+		return -1;
+	uint16_t data_length = longFrames ? (frame[1] << 8) | frame[2] : frame[1];
+	int size = header_size+data_length+2;
+	if (data_length > LONG_BUFFER_SIZE)
+		return -1;
+	if (rxCount-pos < size)
+		return 0;
+	return crc16(CRC16_INIT, frame, size-2) == ((frame[size-2] << 8) | frame[size-1]) ? size : -1;
+}
+
+// Offset of the first whole frame in rxBuffer after its first byte, or 0
+// if there is none. Unless searching for the next frame (resync), it must
+// be the one after the frame expected, so that the data of a frame still
+// coming is hardly ever taken for a frame.
+static int serialFindFrame(void)
+{
+	int header_size = (longFrames ? 3 : 2) + 1;
+	for (int pos=1; pos<rxCount; pos++)
+		if (serialCheckedFrame(pos) > 0 && (resync || rxBuffer[pos+header_size-1] == (uint8_t) (rxSeq+1)))
+			return pos;
+	return 0;
+}
+
+// Reads exactly one frame: the board may send several frames back to
+// back, so the header is read first, then no more than the data length.
+// If the buffer is too small, only *len bytes are kept. With a timeout,
+// it applies to each read, so that a garbled length can't block us.
+// Returns the opcode, and the sequence number in *seq for frames which
+// have one.
+// With MYTERM_CONFIG_CRC, bytes of a frame must come within
+// SERIAL_GAP_TIMEOUT of each other, and a frame is only taken once its
+// CRC matched. Otherwise it is garbled: its first byte is dropped (or
+// all bytes up to the next whole frame already received), and the next
+// frame is searched for in the bytes after it, so that the frames which
+// follow a garbled one are kept. Only the first garbled byte is reported
+// (SERIAL_FRAME_GARBLED); until a frame is found, the others are dropped
+// silently, as well as the opcodes of frames without a CRC.
+static int serialReadRawFrame(int serial_port, uint8_t *buffer, uint16_t *len, int timeout,
+uint8_t *seq, enum serialFrameStatus *status)
+{
+	uint16_t max_size = *len;
+
+	*status = SERIAL_FRAME_NONE;
+	*len = 0;
+
+	while (1)
+	{
+		int res = serialFill(serial_port, 1, timeout, false);
+		if (res < 0)
+			return -1;
+		// The link is silent: what comes next starts a frame.
+		if (res == 0)
+		{
+			resync = false;
+			return MYTERM_TIMEOUT;
+		}
+
+		uint8_t res_code = rxBuffer[0];
+		bool checked = serialChecked(res_code);
+		int header_size = (longFrames ? 3 : 2) + (checked ? 1 : 0);
+		if (resync && !checked)
+		{
+			serialConsume(1);
+			continue;
+		}
+
+		if (!checked)
+		{
+			// Read as it comes, as it can't be checked anyway.
+			*status = SERIAL_FRAME_GARBLED;
+			res = serialFill(serial_port, header_size, timeout, false);
+			if (res <= 0)
+			{
+				serialConsume(rxCount);
+				return res < 0 ? -1 : MYTERM_TIMEOUT;
+			}
+			uint16_t data_length = longFrames ? (rxBuffer[1] << 8) | rxBuffer[2] : rxBuffer[1];
+			serialConsume(header_size);
+			int received = 0;
+			while (received < data_length)
+			{
+				res = serialFill(serial_port, 1, timeout, false);
+				if (res <= 0)
+					return res < 0 ? -1 : MYTERM_TIMEOUT;
+				int n = data_length-received < rxCount ? data_length-received : rxCount;
+				// avoid buffer overflow
+				for (int i=0; i<n && received+i < max_size; i++)
+					buffer[received+i] = rxBuffer[i];
+				serialConsume(n);
+				received += n;
+			}
+			*len = data_length > max_size ? max_size : data_length;
+			*status = SERIAL_FRAME_OK;
+			return (int) res_code;
+		}
+
+		// A frame already all there after this one shows that its length
+		// is wrong (see serialFindFrame).
+		int size;
+		while ((size = serialCheckedFrame(0)) == 0 && serialFindFrame() == 0)
+		{
+			res = serialFill(serial_port, rxCount+1, 0, true);
+			if (res < 0)
+				return -1;
+			if (res == 0) // cut
+				break;
+		}
+		if (size > 0)
+		{
+			uint16_t data_length = size-header_size-2;
+			*seq = rxBuffer[header_size-1];
+			*len = data_length > max_size ? max_size : data_length;
+			memcpy(buffer, rxBuffer+header_size, *len);
+			serialConsume(size);
+			resync = false;
+			*status = SERIAL_FRAME_OK;
+			return (int) res_code;
+		}
+
+		int next = serialFindFrame();
+		serialConsume(next > 0 ? next : 1);
+		if (!resync)
+		{
+			resync = true;
+			*status = SERIAL_FRAME_GARBLED;
+			return MYTERM_READERROR;
+		}
+	}
+}
+
+// Keeps a frame received ahead of the one expected, until that one is
+// sent again. Returns false if there is no room left for it.
+static bool serialHold(uint8_t opcode, uint8_t seq, const uint8_t *data, uint16_t len)
+{
+	struct serialHeldFrame *free_slot = NULL;
+	for (int i=0; i<SERIAL_HELD_FRAMES; i++)
+	{
+		struct serialHeldFrame *h = &heldFrames[i];
+		if (h->used && h->seq == seq) // already there
+			return true;
+		if (!h->used && free_slot == NULL)
+			free_slot = h;
+	}
+	if (free_slot == NULL)
+		return false;
+	free_slot->used = true;
+	free_slot->opcode = opcode;
+	free_slot->seq = seq;
+	free_slot->len = len;
+	memcpy(free_slot->data, data, len);
+	return true;
+}
+
+// Takes the held frame expected next, if there is one: returns its opcode,
+// or -1. Held frames which came before the one expected are dropped.
+static int serialTakeHeld(uint8_t *buffer, uint16_t *len)
+{
+	int res = -1;
+	for (int i=0; i<SERIAL_HELD_FRAMES; i++)
+	{
+		struct serialHeldFrame *h = &heldFrames[i];
+		if (h->used && (int8_t) (h->seq - rxSeq) < 0)
+			h->used = false;
+		else if (h->used && h->seq == rxSeq && res < 0)
+		{
+			*len = h->len > *len ? *len : h->len;
+			memcpy(buffer, h->data, *len);
+			h->used = false;
+			res = h->opcode;
+			rxSeq++;
+		}
+	}
+	return res;
+}
+
+// Sequence number of the first held frame (or of the last one), -1 if
+// there is none.
+static int serialHeldEdge(bool last)
+{
+	int edge = -1;
+	for (int i=0; i<SERIAL_HELD_FRAMES; i++)
+	{
+		struct serialHeldFrame *h = &heldFrames[i];
+		int8_t ahead = (int8_t) (h->seq - edge);
+		if (h->used && (edge < 0 || (last ? ahead > 0 : ahead < 0)))
+			edge = h->seq;
+	}
+	return edge;
+}
+
+// Reads the next frame. With MYTERM_CONFIG_CRC, a garbled frame is asked
+// for again (MYTERM_NAK), as well as an answer which doesn't come within
+// timeout; the frames which follow it are held until it comes, frames
+// sent twice are skipped, and the MYTERM_NAK frames of the board are
+// handled here. If the board can't send a frame again any more, the
+// frames up to the next one held are lost, and MYTERM_READERROR is
+// returned. Only the last frame we sent can be sent again.
+static int serialReadFrame(int serial_port, uint8_t *buffer, uint16_t *len, int timeout)
+{
+	uint16_t max_size = *len;
+	int wait = timeout;
+	int naks = 0;
+	bool asked = false;	// the board got a MYTERM_NAK, and answers at once
+
 	if (buffer == NULL)
 		return 0;
-	
-	while (n == 0)
+
+	while (1)
 	{
-		n = read(serial_port, &tmp_buffer, BUFFER_SIZE);
-		if (n < 0)
-		  return n;
-		else if (n > 0)
+		enum serialFrameStatus status;
+		uint8_t seq = 0;
+		*len = max_size;
+		int res = checksums ? serialTakeHeld(buffer, len) : -1;
+		if (res >= 0)
 		{
-			#ifdef LOGLEVEL_DEBUG
-			printf("Debug message: Serial port received %d bytes.\n\n",n);
-			printf("\tBuffer content:\n");
-			printf("\t");
-			for (int x=0; x<n; x++)
-				printf("0x%02X ",tmp_buffer[x]);
-			printf("\n\n");
-			#endif
-			
-			// First time, get the expected data length
-			// and start filling the buffer
-			if (!incoming)
+			APDU_PROBE3(serial_receive, serial_port, res, *len);
+			return res;
+		}
+		res = serialReadRawFrame(serial_port, buffer, len, wait, &seq, &status);
+		if (res < 0)
+			return res;
+
+		if (!checksums || (status == SERIAL_FRAME_OK && !serialChecked(res)))
+		{
+			if (status != SERIAL_FRAME_OK)
+				return MYTERM_TIMEOUT;
+			APDU_PROBE3(serial_receive, serial_port, res, *len);
+			return res;
+		}
+
+		// A frame garbled after held ones is the one following them;
+		// otherwise, or if nothing came, the one expected is asked for.
+		if (status != SERIAL_FRAME_OK)
+		{
+			if (status == SERIAL_FRAME_NONE && asked)
+				return MYTERM_TIMEOUT;
+			if (naks == SERIAL_RETRIES)
+				return MYTERM_READERROR;
+			int last = serialHeldEdge(true);
+			serialSendNak(serial_port, status == SERIAL_FRAME_GARBLED && last >= 0 ? last+1 : rxSeq);
+			naks++;
+			asked = true;
+			wait = SERIAL_NAK_TIMEOUT;
+			continue;
+		}
+
+		if (res == MYTERM_NAK)
+		{
+			if (*len < MYTERM_NAK_LENGTH)
+				continue;
+			// The board didn't get our last frame: its answer is still to
+			// come.
+			if (buffer[0] == (uint8_t) (txSeq-1) && lastFrameLength > 0)
 			{
-				incoming = true;
-				if (n < 2) // malformed frame
-					return -1;
-				data_length = tmp_buffer[1];
-				res_code = tmp_buffer[0];
-			
-				if (n-2 <= max_size) // Is the buffer too small ?
+				if (naks++ == SERIAL_RETRIES)
+					return MYTERM_WRITEERROR;
+				serialResend(serial_port);
+				asked = false;
+				wait = timeout;
+			}
+			// The board sent frames we didn't get. They came before this
+			// MYTERM_NAK: the first one is asked for, unless it was, and
+			// the board couldn't send it again.
+			if ((int8_t) (buffer[1] - rxSeq) >= 0)
+			{
+				if (naks == 0 || askedSeq != rxSeq)
 				{
-					// no, everything is in order
-					// otherwise, copy only *len data.
-					
-					*len = n-2; // remove response code and data length
-					if (*len < data_length) // Some data is missing,
-					// set n to stay in the while loop.
-						n = 0;
+					if (naks++ == SERIAL_RETRIES)
+						return MYTERM_READERROR;
+					serialSendNak(serial_port, rxSeq);
+					asked = true;
+					wait = SERIAL_NAK_TIMEOUT;
+					continue;
 				}
-				
-				if (*len > 0)
-					memcpy(buffer, tmp_buffer+2, *len);
+				int first = serialHeldEdge(false);
+				uint8_t next = first >= 0 ? (uint8_t) first : (uint8_t) (buffer[1]+1);
+				logMessage(LOG_MODULE_SERIAL, LOG_ERROR, "Frames %ld to %ld lost", rxSeq, (uint8_t) (next-1));
+				rxSeq = next;
+				return MYTERM_READERROR;
 			}
-			// Some data incoming, that are appended in the buffer
-			else
+			continue;
+		}
+
+		// Sent again while we were asking for it
+		if ((int8_t) (seq - rxSeq) < 0)
+			continue;
+		// The frame expected is garbled or lost: this one waits for it.
+		if (seq != rxSeq)
+		{
+			if (!serialHold(res, seq, buffer, *len))
+				logMessage(LOG_MODULE_SERIAL, LOG_WARNING, "Frame %ld dropped, too many frames held", seq, 0);
+			if (naks == 0)
 			{
-				uint8_t start_pos = *len;
-				*len += (uint8_t) n;
-				
-				// avoid buffer overflow
-				if (*len > max_size)
-					n -= (int) *len - max_size;
-				
-				memcpy(buffer+start_pos, tmp_buffer, n);
-				
-				// is it finished ?
-				if (*len < data_length)
-					n = 0; // No, stay in the loop
-				else
-					n = 1; // Yes, exit!
+				serialSendNak(serial_port, rxSeq);
+				naks++;
+				asked = true;
+				wait = SERIAL_NAK_TIMEOUT;
 			}
+			continue;
 		}
+		rxSeq++;
+		APDU_PROBE3(serial_receive, serial_port, res, *len);
+		return res;
 	}
-	return (int) res_code;
+}
+
+// Whether a frame started to arrive, or was held, without waiting.
+bool serialReadable(int serial_port)
+{
+	if (rxCount > 0)
+		return true;
+	for (int i=0; i<SERIAL_HELD_FRAMES; i++)
+		if (heldFrames[i].used && heldFrames[i].seq == rxSeq)
+			return true;
+	return serialPoll(serial_port, 0);
+}
+
+int waitResponse(int serial_port, uint8_t *buffer, uint16_t *len)
+{
+	return serialReadFrame(serial_port, buffer, len, -1);
+}
+
+// Same as waitResponse, but gives up if the frame doesn't come within
+// timeout ms.
+int waitResponseTimeout(int serial_port, uint8_t *buffer, uint16_t *len, int timeout)
+{
+	return serialReadFrame(serial_port, buffer, len, timeout);
 }
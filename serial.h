@@ -29,8 +29,30 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SERIAL_ECHO_LENGTH 32 // bytes of the MYTERM_ECHO test pattern
+#define SERIAL_GAP_TIMEOUT 100 // ms between two bytes of a frame, with MYTERM_CONFIG_CRC
+#define SERIAL_NAK_TIMEOUT 100 // ms for the board to answer MYTERM_NAK
+#define SERIAL_RETRIES     3   // MYTERM_NAK sent for a single frame
+#define SERIAL_HELD_FRAMES 8   // frames received ahead of a garbled one, kept until it comes
+
 bool serialInitialize(int serial_port);
-void sendCommand(int serial_port, uint8_t *buffer, uint8_t len);
-int waitResponse(int serial_port, uint8_t *buffer, uint8_t *len);
+void serialSetLongFrames(uint16_t maxLength);
+uint16_t serialMaxFrameLength(void);
+void serialSetChecksums(void);
+bool serialSetBaudrate(int serial_port, long rate);
+bool serialCheckLink(int serial_port, int timeout);
+void sendCommand(int serial_port, uint8_t *buffer, uint16_t len);
+void sendFrame(int serial_port, uint8_t opcode, uint8_t *buffer, uint16_t len);
+bool serialReadable(int serial_port);
+int waitResponse(int serial_port, uint8_t *buffer, uint16_t *len);
+int waitResponseTimeout(int serial_port, uint8_t *buffer, uint16_t *len, int timeout);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * serialspeed.c: Serial rates without a Bxxx constant, set with termios2
+ * (Linux only). Kept apart from serial.c, as <asm/termbits.h> conflicts
+ * with <termios.h>.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "serialspeed.h"
+
+#ifdef __linux__
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+// Sets any rate with BOTHER, once the bytes already written are sent.
+bool serialspeedSet(int serial_port, long rate)
+{
+	struct termios2 tty;
+	if (ioctl(serial_port, TCGETS2, &tty) != 0)
+		return false;
+	
+	tty.c_cflag &= ~CBAUD;
+	tty.c_cflag |= BOTHER;
+	tty.c_ispeed = rate;
+	tty.c_ospeed = rate;
+	return ioctl(serial_port, TCSETSW2, &tty) == 0;
+}
+
+#else
+
+bool serialspeedSet(int serial_port, long rate)
+{
+	(void) serial_port;
+	(void) rate;
+	return false;
+}
+
+#endif
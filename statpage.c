@@ -0,0 +1,251 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * statpage.c: Statistics page published in shared memory, for external
+ * monitoring (see apdustat.c).
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "statpage.h"
+#include "mycodes.h"
+#include "main.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+static struct statpage *page = NULL;
+static char pageName[64];
+
+static uint64_t statpageNow(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+// Find the slot of a reader, claiming a free one the first time.
+static struct statpageReader* statpageSlot(int port)
+{
+	if (page == NULL)
+		return NULL;
+
+	for (int i=0; i<STATPAGE_MAX_READERS; i++)
+	{
+		struct statpageReader *slot = &page->readers[i];
+		uint32_t used = atomic_load_explicit(&slot->used, memory_order_acquire);
+
+		if (used && slot->port == port)
+			return slot;
+		if (!used)
+		{
+			uint32_t expected = 0;
+			if (atomic_compare_exchange_strong(&slot->used, &expected, 2))
+			{
+				slot->port = port;
+				atomic_store_explicit(&slot->used, 1, memory_order_release);
+				return slot;
+			}
+			// Somebody else took it, check if it was for the same port.
+			while (atomic_load_explicit(&slot->used, memory_order_acquire) != 1);
+			if (slot->port == port)
+				return slot;
+		}
+	}
+	return NULL;
+}
+
+static void statpageWriteBegin(struct statpageReader *slot)
+{
+	uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq+1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void statpageWriteEnd(struct statpageReader *slot)
+{
+	uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq+1, memory_order_release);
+}
+
+bool statpageOpen(const char *name)
+{
+	if (name == NULL)
+		name = STATPAGE_DEFAULT_NAME;
+
+	int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		perror("Error while opening statistics page : ");
+		return false;
+	}
+	if (ftruncate(fd, sizeof(struct statpage)) != 0)
+	{
+		perror("Error while sizing statistics page : ");
+		close(fd);
+		return false;
+	}
+
+	page = mmap(NULL, sizeof(struct statpage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+	{
+		perror("Error while mapping statistics page : ");
+		page = NULL;
+		return false;
+	}
+
+	atomic_store_explicit(&page->magic, 0, memory_order_relaxed);
+	memset(page->readers, 0, sizeof(page->readers));
+	page->version = STATPAGE_VERSION;
+	page->size = sizeof(struct statpage);
+	page->maxReaders = STATPAGE_MAX_READERS;
+	page->pid = getpid();
+	atomic_store_explicit(&page->magic, STATPAGE_MAGIC, memory_order_release);
+
+	strncpy(pageName, name, sizeof(pageName)-1);
+	return true;
+}
+
+void statpageClose(void)
+{
+	if (page == NULL)
+		return;
+	munmap(page, sizeof(struct statpage));
+	shm_unlink(pageName);
+	page = NULL;
+}
+
+void statpageSetState(int port, uint32_t state)
+{
+	struct statpageReader *slot = statpageSlot(port);
+	if (slot == NULL || slot->state == state)
+		return;
+
+	statpageWriteBegin(slot);
+	slot->state = state;
+	slot->stateSince = statpageNow();
+	statpageWriteEnd(slot);
+}
+
+void statpageCardFound(int port, uint8_t *uid, uint8_t uidLength)
+{
+	struct statpageReader *slot = statpageSlot(port);
+	if (slot == NULL)
+		return;
+
+	if (uidLength > STATPAGE_UID_LENGTH)
+		uidLength = STATPAGE_UID_LENGTH;
+
+	statpageWriteBegin(slot);
+	slot->cardsSeen++;
+	slot->state = STATPAGE_CARDFOUND;
+	slot->stateSince = statpageNow();
+	slot->uidLength = uidLength;
+	memcpy(slot->uid, uid, uidLength);
+	statpageWriteEnd(slot);
+}
+
+void statpageCommandSent(int port, uint8_t ins)
+{
+	struct statpageReader *slot = statpageSlot(port);
+	if (slot == NULL)
+		return;
+
+	uint32_t state = slot->state;
+	if (ins == 0xA4)
+		state = STATPAGE_SELECTING;
+	else if (ins == 0xB2 || ins == 0xA8)
+		state = STATPAGE_READING;
+
+	statpageWriteBegin(slot);
+	slot->apdusSent++;
+	if (slot->state != state)
+	{
+		slot->state = state;
+		slot->stateSince = statpageNow();
+	}
+	statpageWriteEnd(slot);
+}
+
+void statpageResponse(int port, int rescode, bool hasSw, uint8_t sw1, uint8_t sw2)
+{
+	int swClass = -1;
+	if (hasSw && !(sw1 == 0x90 && sw2 == 0x00) && sw1 != 0x61)
+	{
+		if (sw1 == 0x62 || sw1 == 0x63)
+			swClass = STATPAGE_SW_WARNING;
+		else if (sw1 >= 0x64 && sw1 <= 0x66)
+			swClass = STATPAGE_SW_EXECERROR;
+		else if (sw1 >= 0x67 && sw1 <= 0x6F)
+			swClass = STATPAGE_SW_CHECKERROR;
+		else
+			swClass = STATPAGE_SW_OTHER;
+	}
+	if (rescode != MYTERM_TIMEOUT && swClass < 0)
+		return;
+
+	struct statpageReader *slot = statpageSlot(port);
+	if (slot == NULL)
+		return;
+
+	statpageWriteBegin(slot);
+	if (rescode == MYTERM_TIMEOUT)
+		slot->timeouts++;
+	if (swClass >= 0)
+		slot->swErrors[swClass]++;
+	statpageWriteEnd(slot);
+}
+
+void statpageSessionCompleted(int port)
+{
+	struct statpageReader *slot = statpageSlot(port);
+	if (slot == NULL)
+		return;
+
+	statpageWriteBegin(slot);
+	slot->sessionsCompleted++;
+	slot->state = STATPAGE_EXTRACTED;
+	slot->stateSince = statpageNow();
+	statpageWriteEnd(slot);
+}
+
+// Reader side of the seqlock. Returns false if the slot kept changing.
+bool statpageReadSlot(const struct statpageReader *slot, struct statpageReader *copy)
+{
+	for (int retry=0; retry<1000; retry++)
+	{
+		uint32_t before = atomic_load_explicit(&((struct statpageReader*) slot)->seq, memory_order_acquire);
+		if (before & 1)
+			continue;
+
+		memcpy(copy, (const void*) slot, sizeof(struct statpageReader));
+		atomic_thread_fence(memory_order_acquire);
+
+		uint32_t after = atomic_load_explicit(&((struct statpageReader*) slot)->seq, memory_order_relaxed);
+		if (before == after)
+			return true;
+	}
+	return false;
+}
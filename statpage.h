@@ -0,0 +1,105 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * statpage.h: Statistics page published in shared memory, for external
+ * monitoring (see apdustat.c).
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATPAGE_H
+#define STATPAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define STATPAGE_DEFAULT_NAME "/apdu-stats"
+#define STATPAGE_MAGIC        0x55445041 // "APDU"
+#define STATPAGE_VERSION      1
+#define STATPAGE_MAX_READERS  16
+#define STATPAGE_UID_LENGTH   10
+
+// Reader states, from apduWaitForCard to data extraction
+enum
+{
+	STATPAGE_IDLE,
+	STATPAGE_WAITCARD,
+	STATPAGE_CARDFOUND,
+	STATPAGE_SELECTING,
+	STATPAGE_READING,
+	STATPAGE_EXTRACTED,
+	STATPAGE_STATE_COUNT
+};
+
+// Status word error classes (see ISO 7816-4, section 5.1.3)
+enum
+{
+	STATPAGE_SW_WARNING,	// 62xx, 63xx
+	STATPAGE_SW_EXECERROR,	// 64xx to 66xx
+	STATPAGE_SW_CHECKERROR,	// 67xx to 6Fxx
+	STATPAGE_SW_OTHER,
+	STATPAGE_SW_COUNT
+};
+
+// Each slot is written by the only thread driving its reader, and
+// protected by a seqlock: seq is odd while the slot is being updated,
+// readers retry until they get the same even value before and after
+// copying the slot.
+struct statpageReader
+{
+	_Atomic uint32_t seq;
+	_Atomic uint32_t used;		// claimed once, never released
+	int32_t port;
+	uint32_t state;
+	uint64_t stateSince;		// ms since the Epoch
+	uint8_t uidLength;
+	uint8_t uid[STATPAGE_UID_LENGTH];
+
+	uint64_t cardsSeen;
+	uint64_t sessionsCompleted;
+	uint64_t apdusSent;
+	uint64_t timeouts;
+	uint64_t swErrors[STATPAGE_SW_COUNT];
+};
+
+// magic is written last: a page with a wrong magic is not ready yet.
+struct statpage
+{
+	_Atomic uint32_t magic;
+	uint32_t version;
+	uint32_t size;				// sizeof(struct statpage)
+	uint32_t maxReaders;
+	int32_t pid;
+	struct statpageReader readers[STATPAGE_MAX_READERS];
+};
+
+bool statpageOpen(const char *name);
+void statpageClose(void);
+
+void statpageSetState(int port, uint32_t state);
+void statpageCardFound(int port, uint8_t *uid, uint8_t uidLength);
+void statpageCommandSent(int port, uint8_t ins);
+void statpageResponse(int port, int rescode, bool hasSw, uint8_t sw1, uint8_t sw2);
+void statpageSessionCompleted(int port);
+
+bool statpageReadSlot(const struct statpageReader *slot, struct statpageReader *copy);
+
+#endif
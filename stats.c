@@ -0,0 +1,252 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * stats.c: Always-on APDU latency histograms and counters.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+#include "main.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Every counter is a relaxed atomic: recording never takes a lock,
+// whatever the number of threads driving readers.
+struct statsAtomicHistogram
+{
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+	_Atomic uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+static struct
+{
+	struct statsAtomicHistogram latency[STATS_INS_COUNT];
+	_Atomic uint64_t rescodes[256];
+	_Atomic uint32_t sw[256*256];
+	_Atomic uint64_t bytesSent;
+	_Atomic uint64_t bytesReceived;
+} counters;
+
+static _Atomic uint64_t lastDump = 0; // s, CLOCK_MONOTONIC
+
+static const char *INS_NAMES[STATS_INS_COUNT] = {
+	"SELECT", "READ RECORD", "GPO", "Other"
+};
+
+static int statsInsIndex(uint8_t ins)
+{
+	switch (ins)
+	{
+		case 0xA4:
+			return STATS_INS_SELECT;
+		case 0xB2:
+			return STATS_INS_READRECORD;
+		case 0xA8:
+			return STATS_INS_GPO;
+		default:
+			return STATS_INS_OTHER;
+	}
+}
+
+static unsigned int statsBucketIndex(uint64_t value)
+{
+	if (value < STATS_HIST_LINEAR)
+		return (unsigned int) value;
+
+	unsigned int msb = 63 - __builtin_clzll(value); // >= 4
+	unsigned int sub = (value >> (msb-3)) & (STATS_HIST_SUBBUCKETS-1);
+	unsigned int index = STATS_HIST_LINEAR + (msb-4)*STATS_HIST_SUBBUCKETS + sub;
+
+	if (index >= STATS_HIST_BUCKETS)
+		index = STATS_HIST_BUCKETS-1;
+	return index;
+}
+
+// Highest value counted in a bucket
+static uint64_t statsBucketValue(unsigned int index)
+{
+	if (index < STATS_HIST_LINEAR)
+		return index;
+
+	unsigned int msb = (index-STATS_HIST_LINEAR)/STATS_HIST_SUBBUCKETS + 4;
+	unsigned int sub = (index-STATS_HIST_LINEAR)%STATS_HIST_SUBBUCKETS;
+	uint64_t width = 1ULL << (msb-3);
+	return (STATS_HIST_SUBBUCKETS+sub)*width + width-1;
+}
+
+static uint64_t statsElapsedUs(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t us = (int64_t)(now.tv_sec-start->tv_sec)*1000000
+		+ (now.tv_nsec-start->tv_nsec)/1000;
+	return us < 0 ? 0 : (uint64_t) us;
+}
+
+// Starts the latency measure of a command sent now.
+void statsRecordCommand(struct statsRequest *req, uint8_t ins)
+{
+	req->ins = ins;
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+}
+
+// Counts an answer. The latency of its command req is taken if it was
+// started; req is NULL for answers not matched to a command.
+void statsRecordResponse(struct statsRequest *req, int rescode, bool hasSw, uint8_t sw1, uint8_t sw2)
+{
+	if (req != NULL && req->ins >= 0)
+	{
+		struct statsAtomicHistogram *h = &counters.latency[statsInsIndex(req->ins)];
+		uint64_t us = statsElapsedUs(&req->start);
+		req->ins = -1;
+
+		atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&h->sum, us, memory_order_relaxed);
+		atomic_fetch_add_explicit(&h->buckets[statsBucketIndex(us)], 1, memory_order_relaxed);
+
+		uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+		while (us > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, us,
+			memory_order_relaxed, memory_order_relaxed));
+	}
+
+	// Negative values are host-side read errors, not rescodes.
+	if (rescode >= 0 && rescode < 256)
+		atomic_fetch_add_explicit(&counters.rescodes[rescode], 1, memory_order_relaxed);
+
+	if (hasSw)
+		atomic_fetch_add_explicit(&counters.sw[(sw1 << 8) | sw2], 1, memory_order_relaxed);
+}
+
+void statsRecordBytes(unsigned int sent, unsigned int received)
+{
+	if (sent > 0)
+		atomic_fetch_add_explicit(&counters.bytesSent, sent, memory_order_relaxed);
+	if (received > 0)
+		atomic_fetch_add_explicit(&counters.bytesReceived, received, memory_order_relaxed);
+}
+
+// Counters are read one by one, so a snapshot taken while other threads
+// are recording may be off by the few exchanges in progress.
+void statsSnapshot(struct statsSnapshot *snap)
+{
+	if (snap == NULL)
+		return;
+
+	for (int i=0; i<STATS_INS_COUNT; i++)
+	{
+		struct statsAtomicHistogram *h = &counters.latency[i];
+		snap->latency[i].count = atomic_load_explicit(&h->count, memory_order_relaxed);
+		snap->latency[i].sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+		snap->latency[i].max = atomic_load_explicit(&h->max, memory_order_relaxed);
+		for (int j=0; j<STATS_HIST_BUCKETS; j++)
+			snap->latency[i].buckets[j] = atomic_load_explicit(&h->buckets[j], memory_order_relaxed);
+	}
+	for (int i=0; i<256; i++)
+		snap->rescodes[i] = atomic_load_explicit(&counters.rescodes[i], memory_order_relaxed);
+	for (int i=0; i<256*256; i++)
+		snap->sw[i] = atomic_load_explicit(&counters.sw[i], memory_order_relaxed);
+	snap->bytesSent = atomic_load_explicit(&counters.bytesSent, memory_order_relaxed);
+	snap->bytesReceived = atomic_load_explicit(&counters.bytesReceived, memory_order_relaxed);
+}
+
+// Returns the upper bound of the bucket containing the given percentile.
+uint64_t statsPercentile(const struct statsHistogram *hist, double percent)
+{
+	if (hist == NULL || hist->count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t) (hist->count * percent / 100.0);
+	if (rank >= hist->count)
+		rank = hist->count-1;
+
+	uint64_t seen = 0;
+	for (unsigned int i=0; i<STATS_HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if (seen > rank)
+		{
+			uint64_t value = statsBucketValue(i);
+			return value > hist->max ? hist->max : value;
+		}
+	}
+	return hist->max;
+}
+
+void statsDump(FILE *f)
+{
+	struct statsSnapshot *snap = malloc(sizeof(struct statsSnapshot));
+	if (snap == NULL)
+		return;
+	statsSnapshot(snap);
+
+	fprintf(f, "### APDU statistics ###\n");
+	fprintf(f, "%-12s %10s %10s %10s %10s %10s %10s\n", "Instruction", "count",
+		"mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+	for (int i=0; i<STATS_INS_COUNT; i++)
+	{
+		struct statsHistogram *h = &snap->latency[i];
+		if (h->count == 0)
+			continue;
+		fprintf(f, "%-12s %10llu %10llu %10llu %10llu %10llu %10llu\n", INS_NAMES[i],
+			(unsigned long long) h->count,
+			(unsigned long long) (h->sum/h->count),
+			(unsigned long long) statsPercentile(h, 50),
+			(unsigned long long) statsPercentile(h, 90),
+			(unsigned long long) statsPercentile(h, 99),
+			(unsigned long long) h->max);
+	}
+
+	fprintf(f, "Rescodes:");
+	for (int i=0; i<256; i++)
+		if (snap->rescodes[i] > 0)
+			fprintf(f, " 0x%02x=%llu", i, (unsigned long long) snap->rescodes[i]);
+	fprintf(f, "\nStatus words:");
+	for (int i=0; i<256*256; i++)
+		if (snap->sw[i] > 0)
+			fprintf(f, " %04x=%u", i, snap->sw[i]);
+	fprintf(f, "\nBytes sent: %llu, received: %llu\n\n",
+		(unsigned long long) snap->bytesSent, (unsigned long long) snap->bytesReceived);
+
+	free(snap);
+}
+
+void statsDumpIfDue(FILE *f, unsigned int intervalSec)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t last = atomic_load_explicit(&lastDump, memory_order_relaxed);
+	if (last == 0)
+	{
+		// First call only starts the period.
+		atomic_compare_exchange_strong(&lastDump, &last, (uint64_t) now.tv_sec);
+		return;
+	}
+
+	// Only one of the concurrent callers gets to dump.
+	if ((uint64_t) now.tv_sec-last >= intervalSec &&
+		atomic_compare_exchange_strong(&lastDump, &last, (uint64_t) now.tv_sec))
+		statsDump(f);
+}
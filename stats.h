@@ -0,0 +1,85 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * stats.h: Always-on APDU latency histograms and counters.
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// Instructions having their own latency histogram
+enum
+{
+	STATS_INS_SELECT,		// 0xA4
+	STATS_INS_READRECORD,	// 0xB2
+	STATS_INS_GPO,			// 0xA8
+	STATS_INS_OTHER,
+	STATS_INS_COUNT
+};
+
+// HDR-style log-linear histogram, in microseconds: values below 16 have
+// their own bucket, then each power of two is split in 8 sub-buckets
+// (relative error below 12.5%). Highest bucket covers up to ~71 minutes.
+#define STATS_HIST_LINEAR     16
+#define STATS_HIST_SUBBUCKETS 8
+#define STATS_HIST_BUCKETS    (STATS_HIST_LINEAR+28*STATS_HIST_SUBBUCKETS)
+
+struct statsHistogram
+{
+	uint64_t count;
+	uint64_t sum;	// us
+	uint64_t max;	// us
+	uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+struct statsSnapshot
+{
+	struct statsHistogram latency[STATS_INS_COUNT];
+	uint64_t rescodes[256];		// per MYTERM rescode
+	uint32_t sw[256*256];		// per SW1SW2 (index: sw1 << 8 | sw2)
+	uint64_t bytesSent;			// on the serial link
+	uint64_t bytesReceived;
+};
+
+// When a command was sent, kept by the caller until its answer comes, so
+// that several commands can be in flight.
+struct statsRequest
+{
+	int ins;	// -1 once answered
+	struct timespec start;
+};
+
+void statsRecordCommand(struct statsRequest *req, uint8_t ins);
+void statsRecordResponse(struct statsRequest *req, int rescode, bool hasSw, uint8_t sw1, uint8_t sw2);
+void statsRecordBytes(unsigned int sent, unsigned int received);
+
+void statsSnapshot(struct statsSnapshot *snap);
+uint64_t statsPercentile(const struct statsHistogram *hist, double percent);
+void statsDump(FILE *f);
+void statsDumpIfDue(FILE *f, unsigned int intervalSec);
+
+#endif
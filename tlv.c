@@ -25,19 +25,21 @@
  */
 
 #include "tlv.h"
+#include "probes.h"
 #include "main.h"
+#include "log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 
-struct TLVobject* tlvParseData(uint8_t *data, uint8_t length)
+struct TLVobject* tlvParseData(uint8_t *data, unsigned int length)
 {
 	if (length < 2 || data == NULL) return NULL;
 		
 	struct TLVobject *ptr = (struct TLVobject*) malloc(sizeof(struct TLVobject));
 	if (ptr == NULL) return NULL;
-	uint8_t pindex = 0;
+	unsigned int pindex = 0;
 	
 	ptr->oclass = (data[pindex] & 0xC0) >> 6;
 	ptr->constructed = ((data[pindex] & 0x20) == 0x20) ? true : false;
@@ -52,6 +54,7 @@ struct TLVobject* tlvParseData(uint8_t *data, uint8_t length)
 			ptr->tag = (ptr->tag << 8) + data[pindex++];
 			if (pindex > length) // expecting another byte, but data seems to be incomplete, exiting
 			{
+				logHex(LOG_MODULE_TLV, LOG_WARNING, "Truncated TLV tag", data, length);
 				free(ptr);
 				return NULL;
 			}
@@ -66,13 +69,14 @@ struct TLVobject* tlvParseData(uint8_t *data, uint8_t length)
 	{
 		uint8_t count = data[pindex++] & 0x7F;
 		ptr->length = 0;
-		for (int i=pindex; i<pindex+count; i++)
+		for (unsigned int i=pindex; i<pindex+count; i++)
 			ptr->length = (ptr->length << 8) + data[i];
 		pindex += count;
 	}
 	
 	if (ptr->length > length-pindex) // data length is shorter than expected. Exiting
 	{
+		logMessage(LOG_MODULE_TLV, LOG_WARNING, "TLV tag %lx truncated: %ld bytes missing", ptr->tag, (long) (ptr->length-(length-pindex)));
 		free(ptr);
 		return NULL;
 	}
@@ -91,7 +95,7 @@ struct TLVobject* tlvParseData(uint8_t *data, uint8_t length)
 		
 		while (pindex < length)
 		{
-			uint8_t rstart = pindex;
+			unsigned int rstart = pindex;
 			unsigned int rlen = 0; // length of subrecord
 			
 			// Skip tag
@@ -105,7 +109,7 @@ struct TLVobject* tlvParseData(uint8_t *data, uint8_t length)
 			{
 				uint8_t count = data[pindex++] & 0x7F;
 				rlen = 0;
-				for (int i=pindex; i<pindex+count; i++)
+				for (unsigned int i=pindex; i<pindex+count; i++)
 					rlen = (rlen << 8) + data[i];
 				pindex += count;
 			}
@@ -139,6 +143,8 @@ struct TLVobject* tlvParseData(uint8_t *data, uint8_t length)
 		memcpy(ptr->data[0], data+pindex, ptr->length);
 	}
 	
+	logMessage(LOG_MODULE_TLV, LOG_DEBUG, "TLV tag %lx, %ld bytes", ptr->tag, ptr->length);
+	APDU_PROBE3(tlv_parse, length, ptr->tag, ptr->constructed);
 	return ptr;
 }
 
@@ -212,7 +218,7 @@ void tlvObjectPrintIndented(struct TLVobject *obj, unsigned int indentLevel)
 	{
 		bool printable = true;
 		printf("%sData: ", padd);
-		for (uint8_t j=0; j<obj->length; j++)
+		for (unsigned int j=0; j<obj->length; j++)
 		{
 			printf("%02x",((uint8_t*)obj->data[0])[j]);
 			if (((uint8_t*)obj->data[0])[j] > 0x7F || ((uint8_t*)obj->data[0])[j] < 0x20)
@@ -223,7 +229,7 @@ void tlvObjectPrintIndented(struct TLVobject *obj, unsigned int indentLevel)
 		if (printable)
 		{
 			printf("%sStr: ", padd);
-			for (uint8_t j=0; j<obj->length; j++)
+			for (unsigned int j=0; j<obj->length; j++)
 			{
 				printf("%c",((uint8_t*)obj->data[0])[j]);
 			}
@@ -30,6 +30,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum
 {
 	TLV_UNIVERSAL_CLASS,
@@ -50,9 +54,13 @@ struct TLVobject
 							// uint8_t** otherwise
 };
 
-struct TLVobject* tlvParseData(uint8_t *data, uint8_t length);
+struct TLVobject* tlvParseData(uint8_t *data, unsigned int length);
 struct TLVobject* tlvObjectLookForTag(struct TLVobject* obj, unsigned int tag);
 void tlvObjectPrint(struct TLVobject* obj);
 void tlvObjectFree(struct TLVobject* obj);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * trace.c: Optional timeline of the session phases, exported in the
+ * Chrome trace JSON format (chrome://tracing, ui.perfetto.dev).
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "trace.h"
+#include "main.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct traceRecord
+{
+	const char *name;
+	const char *argName;	// NULL if no argument
+	int64_t arg;
+	uint64_t ts;			// us, CLOCK_MONOTONIC
+	char phase;				// 'B'egin or 'E'nd
+};
+
+// One ring per thread, only written by its thread. Rings are never
+// freed, so that events of finished threads can still be exported.
+struct traceRing
+{
+	pid_t tid;
+	_Atomic uint64_t count;	// total number of events recorded
+	struct traceRecord records[TRACE_RING_SIZE];
+	struct traceRing *next;
+};
+
+bool traceEnabled = false;
+
+static _Atomic(struct traceRing*) rings = NULL;
+static _Thread_local struct traceRing *ring = NULL;
+
+static struct traceRing* traceRingCreate(void)
+{
+	struct traceRing *r = calloc(1, sizeof(struct traceRing));
+	if (r == NULL)
+		return NULL;
+	r->tid = (pid_t) syscall(SYS_gettid);
+
+	// Lock-free push on the list of rings
+	r->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &r->next, r));
+	return r;
+}
+
+void traceEvent(const char *name, char phase, const char *argName, int64_t arg)
+{
+	if (ring == NULL && (ring = traceRingCreate()) == NULL)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t count = atomic_load_explicit(&ring->count, memory_order_relaxed);
+	struct traceRecord *rec = &ring->records[count % TRACE_RING_SIZE];
+	rec->name = name;
+	rec->argName = argName;
+	rec->arg = arg;
+	rec->ts = (uint64_t) now.tv_sec*1000000 + now.tv_nsec/1000;
+	rec->phase = phase;
+	atomic_store_explicit(&ring->count, count+1, memory_order_release);
+}
+
+// Writes every ring to a Chrome trace JSON file. Events recorded while
+// writing may be lost or appear twice.
+bool traceWrite(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+	{
+		perror("Error while opening trace file : ");
+		return false;
+	}
+
+	bool first = true;
+	pid_t pid = getpid();
+
+	fprintf(f, "{\"traceEvents\":[\n");
+	for (struct traceRing *r = atomic_load(&rings); r != NULL; r = r->next)
+	{
+		uint64_t count = atomic_load_explicit(&r->count, memory_order_acquire);
+		uint64_t start = count > TRACE_RING_SIZE ? count-TRACE_RING_SIZE : 0;
+
+		for (uint64_t i=start; i<count; i++)
+		{
+			struct traceRecord *rec = &r->records[i % TRACE_RING_SIZE];
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+				first ? "" : ",\n", rec->name, rec->phase,
+				(unsigned long long) rec->ts, pid, r->tid);
+			if (rec->argName != NULL)
+				fprintf(f, ",\"args\":{\"%s\":%lld}", rec->argName, (long long) rec->arg);
+			fprintf(f, "}");
+			first = false;
+		}
+	}
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	fclose(f);
+	return true;
+}
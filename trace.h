@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021-2022 Guilhem Tiennot
+ * 
+ * Little example program that retrieves credit card number in NFC with
+ * a PN532-based module. It can communicate with most of the Arduino
+ * boards over UART.
+ * 
+ * trace.h: Optional timeline of the session phases, exported in the
+ * Chrome trace JSON format (chrome://tracing, ui.perfetto.dev).
+ * 
+ * This file is part of APDU.
+ * 
+ * APDU is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * APDU is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with APDU.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Events kept per thread. The oldest ones are overwritten.
+#define TRACE_RING_SIZE 8192
+
+extern bool traceEnabled;
+
+void traceEvent(const char *name, char phase, const char *argName, int64_t arg);
+bool traceWrite(const char *path);
+
+// Names and argument names must be string literals: only the pointers
+// are stored in the ring.
+#define traceBegin(name) \
+	do { if (traceEnabled) traceEvent(name, 'B', NULL, 0); } while (0)
+#define traceBeginArg(name, argName, arg) \
+	do { if (traceEnabled) traceEvent(name, 'B', argName, arg); } while (0)
+#define traceEnd(name) \
+	do { if (traceEnabled) traceEvent(name, 'E', NULL, 0); } while (0)
+#define traceEndArg(name, argName, arg) \
+	do { if (traceEnabled) traceEvent(name, 'E', argName, arg); } while (0)
+
+#endif